@@ -7,39 +7,153 @@
  *   Tap item         - Select item
  *   Double-tap item  - Follow link
  *   Swipe up/down    - Scroll content
- *   Tap header       - Show bookmarks menu
+ *   Tap header       - Show bookmarks menu (plus table of contents
+ *                      for text documents with section headings)
  *
  * Hardware Keys:
  *   KEY_NEXT (Right) - Follow selected link
  *   KEY_PREV (Left)  - Go back in history
+ *   KEY_PLUS/MINUS   - Change font size
  */
 
 #include "inkview.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <vector>
 #include <string>
+#include <set>
+#include <map>
+#include <algorithm>
 #include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <strings.h>
+#include <cctype>
+#include <ctime>
+#include <cstdarg>
 
 // ============================================================================
 // Constants
 // ============================================================================
 
-static const int kFontSize = 14;
-static const int kTitleFontSize = 20;
-static const int kLineHeight = kFontSize + 4;
+// Most performance numbers below are defaults: the settings file on the SD
+// card can override them at runtime (see Settings).
+
+// Zoom levels: content font sizes selectable at runtime
+static const int kZoomFontSizes[] = {12, 14, 16, 18, 22, 26};
+static const int kZoomLevels = sizeof(kZoomFontSizes) / sizeof(kZoomFontSizes[0]);
+static const int kDefaultZoom = 1;          // 14pt
+static const int kMaxCachedFonts = 3;       // Open font handles kept around
+static const int kMaxCachedLayouts = 4;     // Layouts kept per page (size x width)
+static const int kLayoutIdleBatch = 2000;   // Lines laid out per idle step
+static const int kLayoutIdleDelay = 30;     // Delay between idle steps in ms
+static const int kLayoutAheadScreens = 6;   // Screens the worker lays out below the reader
+static const int kLayoutBatchItems = 64;    // Lines per batch the worker hands over
+static const int kLayoutRingSize = 32;      // Batches waiting for the UI (the worker's budget)
+static const int kMaxDocumentViews = 64;    // Documents whose pan offset is remembered
+
+// Memory governor thresholds (the PocketBook 622 has 128MB of RAM)
+static const long kMemorySoftRss = 48 * 1024 * 1024;       // Shed caches above this RSS
+static const long kMemoryHardRss = 72 * 1024 * 1024;       // Shed everything above this RSS
+static const long kMemorySoftAvailable = 24 * 1024 * 1024; // Shed caches below this free memory
+static const long kMemoryHardAvailable = 10 * 1024 * 1024; // Shed everything below this
+static const int kMemoryPollInterval = 5000;               // Governor poll period in ms
 static const int kMaxHistory = 50;
 static const int kSocketTimeout = 15;
+static const int kMinReadChunk = 4 * 1024;       // recv() size bounds, picked from
+static const int kMaxReadChunk = 64 * 1024;      // the measured bandwidth-delay product
+static const int kMinReceiveBuffer = 16 * 1024;  // SO_RCVBUF bounds
+static const int kMaxReceiveBuffer = 256 * 1024;
+static const long kInitialBdp = 16 * 1024;       // Until a transfer has been measured
+static const long kMinBdpSample = 16 * 1024;     // Smaller responses don't show throughput
+static const int kRadioIdleTimeout = 30 * 1000;  // Drop WiFi after this long without traffic
+static const int kBenchCorpusSize = 256 * 1024;  // Bytes of each embedded parse corpus
+static const int kBenchMinTime = 300;            // Repeat each benchmark for at least this long (ms)
+static const int kBenchSegmentSize = 64 * 1024;  // Flash benchmark cache segment
+static const int kBenchSegments = 16;
 static const int kDefaultGopherPort = 70;
 static const int kMaxResponseSize = 512 * 1024; // 512KB max response
 static const int kScreenMargin = 1;             // Screen edge margin
 static const int kDoubleTapTime = 500;          // Double-tap threshold in ms
+static const int kMaxTocEntries = 400;          // Max headings collected per document
+static const int kTocMenuPageSize = 20;         // Headings per TOC submenu
 // static const int kContentPadding = 4;        // Padding inside content area
 
+// Downloads go to this directory on the SD card (internal flash if no card)
+static const char *kDownloadSubdir = "/Gopher";
+static const int kMaxDecodeLine = 512; // Longest uuencoded line we buffer
+static const int kMaxArchiveMembers = 2000; // Members listed per archive
+static const int kInflateChunk = 16 * 1024; // Inflate output buffer size
+
+// Pseudo-host for pages generated from downloaded archives. Selectors are
+// "<archive path>" for the member list and "<archive path>|<member>" for a
+// member; '|' never appears in download paths (see sanitize_filename).
+static const char *kArchiveHost = "archive";
+
+// Search engines queried together by multi-search
+struct SearchEngine
+{
+    const char *name;
+    const char *host;
+    const char *selector;
+    int port;
+};
+
+static const SearchEngine kSearchEngines[] = {
+    {"Veronica-2", "gopher.floodgap.com", "/v2/vs", 70},
+    {"Gopherpedia", "gopherpedia.com", "/lookup", 70},
+};
+static const int kSearchEngineCount = sizeof(kSearchEngines) / sizeof(kSearchEngines[0]);
+static const int kFanoutTimeout = 12;          // Per-source timeout in seconds
+static const int kFanoutRedrawInterval = 1500; // Min ms between result redraws
+
+// Pseudo-host for merged multi-search results; the selector is the query
+static const char *kMultiSearchHost = "multisearch";
+
+// Pseudo-host for generated informational pages such as about:stats
+static const char *kAboutHost = "about";
+
+// Search result cache
+static const int kSearchCacheFreshness = 15 * 60; // Seconds a cached result is reused
+static const int kMaxCachedSearches = 16;         // Result sets kept in memory
+static const int kMaxRecentQueries = 8;           // Queries offered when searching again
+
+// Peek preview of text items
+static const int kPeekSize = 4 * 1024;  // Leading bytes fetched for a peek
+static const int kMaxPrefixEntries = 8; // Peeked prefixes kept for a full load
+
+// Thumbnail grid for menus of images
+static const int kThumbnailSize = 160;                // Longest side of a cached thumbnail
+static const int kThumbnailConcurrency = 3;           // Images fetched at once
+static const int kMaxThumbnailSource = 1024 * 1024;   // Larger images get no thumbnail
+static const char *kThumbnailSubdir = "/.thumbs";     // Under the download directory
+
+// Offline mirrors of whole sites
+static const int kMirrorRadioBudget = 120;   // Seconds of radio time per mirror run
+static const int kMaxMirrorDocuments = 500;  // Menus and texts saved per site
+
+// Write-back persistence
+static const int kPersistDelay = 2000;      // Writes are held this long (ms) to batch them
+static const int kPersistQueueLimit = 32;   // Queued files before writers have to wait
+
+// Progress footer during page loads
+static const int kProgressInterval = 500; // Min ms between footer redraws
+static const int kProgressShare = 5;      // Max percent of load time spent redrawing it
+
 // Default starting page - Floodgap's Gopher server
 static const char *kDefaultHost = "gopher.floodgap.com";
 static const char *kDefaultSelector = "/";
@@ -79,12 +193,34 @@ struct GopherItem
     std::string host;
     int port;
 
-    bool is_selectable() const
-    {
-        return type != GOPHER_INFO && type != GOPHER_ERROR &&
-               type != '+' && type != GOPHER_CSO &&
-               type != GOPHER_TELNET && type != GOPHER_TN3270;
-    }
+    bool is_selectable() const; // Looked up in the item type registry
+};
+
+struct TocEntry
+{
+    std::string title;
+    int line; // Index into GopherPage::items
+};
+
+// gopher:// URL found in a text line; the line's item follows the first one
+struct TextLink
+{
+    int item;      // Index into GopherPage::items
+    size_t start;  // Byte span of the URL in the item's display text
+    size_t length;
+};
+
+// Wrapped layout of a text page for one font size and screen width
+struct PageLayout
+{
+    int font_size;              // Font size the layout was built for
+    int columns;                // Characters per row at that size and width
+    std::vector<int> rows;      // Wrapped rows per item, 0 = not laid out yet
+    std::vector<int> first_row; // Row index of each item, filled once complete
+    size_t next_item;           // Idle-time layout progress
+    int known_items;            // Items laid out so far (for estimates)
+    int known_rows;             // Rows of those items
+    long last_used;
 };
 
 struct GopherPage
@@ -93,8 +229,97 @@ struct GopherPage
     std::string selector;
     int port;
     std::vector<GopherItem> items;
-    std::string raw_text; // For text files
+    char type;                        // Item type the page was loaded as
+    std::string raw_text;             // For text files
+    std::vector<TocEntry> toc;        // Section headings found in text files
+    std::vector<TextLink> links;      // URLs found in text files, in item order
+    std::vector<PageLayout> layouts;  // Recently used wrapped layouts
     bool is_menu;
+    bool preformatted;                // Text shown unwrapped, panned sideways
+    int pan_column;                   // First character column shown when preformatted
+
+    // Secondary indexes over items, built once when a menu is parsed
+    std::map<char, std::vector<int> > type_index; // Items of each type
+    std::vector<int> by_display;                  // Non-info items by display text
+    std::vector<int> by_host;                     // Non-info items by host
+
+    // Active filter/sort view: the item indices shown, in order
+    bool view_active;
+    char view_type;            // Type filter, 0 = all
+    int view_sort;             // ViewSort
+    std::vector<int> view;     // Position -> item
+    std::vector<int> view_pos; // Item -> position, -1 if filtered out
+
+    GopherPage() : port(0), type(GOPHER_MENU), is_menu(true), preformatted(false), pan_column(0), view_active(false), view_type(0), view_sort(0) {}
+
+    // Exchanges contents without copying, for page transitions
+    void swap(GopherPage &other)
+    {
+        host.swap(other.host);
+        selector.swap(other.selector);
+        std::swap(port, other.port);
+        items.swap(other.items);
+        std::swap(type, other.type);
+        raw_text.swap(other.raw_text);
+        toc.swap(other.toc);
+        links.swap(other.links);
+        layouts.swap(other.layouts);
+        std::swap(is_menu, other.is_menu);
+        std::swap(preformatted, other.preformatted);
+        std::swap(pan_column, other.pan_column);
+        type_index.swap(other.type_index);
+        by_display.swap(other.by_display);
+        by_host.swap(other.by_host);
+        std::swap(view_active, other.view_active);
+        std::swap(view_type, other.view_type);
+        std::swap(view_sort, other.view_sort);
+        view.swap(other.view);
+        view_pos.swap(other.view_pos);
+    }
+};
+
+enum ViewSort
+{
+    SORT_NONE = 0,
+    SORT_DISPLAY = 1,
+    SORT_HOST = 2,
+};
+
+// Runtime values of the tunable constants, see kTunables
+struct Settings
+{
+    int socket_timeout;
+    int max_response_size;
+    int max_history;
+    int double_tap_time;
+    int min_read_chunk;
+    int max_read_chunk;
+    int min_receive_buffer;
+    int max_receive_buffer;
+    int max_cached_fonts;
+    int max_cached_layouts;
+    int max_cached_searches;
+    int search_cache_freshness;
+    int memory_soft_rss;
+    int memory_hard_rss;
+    int memory_soft_available;
+    int memory_hard_available;
+    int memory_poll_interval;
+    int radio_idle_timeout;
+    int fanout_timeout;
+    int fanout_redraw_interval;
+    int layout_idle_batch;
+    int layout_idle_delay;
+    int layout_ahead_screens;
+    int peek_size;
+    int thumbnail_concurrency;
+    int max_thumbnail_source;
+    int mirror_radio_budget;
+    int max_mirror_documents;
+    int persist_delay;
+    int persist_queue_limit;
+    int progress_interval;
+    int progress_share;
 };
 
 struct HistoryEntry
@@ -102,6 +327,7 @@ struct HistoryEntry
     std::string host;
     std::string selector;
     int port;
+    char type;
 };
 
 // ============================================================================
@@ -110,10 +336,21 @@ struct HistoryEntry
 
 static ifont *mono_font = NULL;
 
+static int zoom_level = kDefaultZoom;  // Index into kZoomFontSizes
+static int font_size = 14;             // Content font size
+static int title_font_size = 20;       // Header title height
+static int line_height = 18;           // Height of one content row
+static int char_width = 8;             // Measured advance of the mono font
+static int text_columns = 0;           // Characters per content row
+
+static Settings settings; // Filled by reset_settings() and the settings file
+
 static GopherPage current_page;
+static GopherPage staging_page; // Next page, built while current_page stays on screen
 static std::vector<HistoryEntry> history;
 
-static int scroll_offset = 0;       // Current scroll position (in lines)
+static int scroll_offset = 0;       // Item at the top of the content area
+static int scroll_row = 0;          // Wrapped row of that item shown first
 static int selected_index = -1;     // Currently selected item index
 static int visible_lines = 0;       // Number of lines visible on screen
 static int header_height = 0;       // Height of header area
@@ -130,11 +367,18 @@ static bool search_pending = false;    // Whether a search is pending
 
 static bool initial_load_done = false; // Whether initial page has been loaded
 
+static ibitmap *viewed_image = NULL; // Image shown full screen, if any
+
 // Touch/gesture tracking
 static int last_tap_index = -1;    // Last tapped item index
 static long last_tap_time = 0;     // Time of last tap (for double-tap detection)
+static int touch_start_x = 0;      // X position at touch start (for horizontal pans)
 static int touch_start_y = 0;      // Y position at touch start (for swipe detection)
 static bool touch_is_drag = false; // Whether current touch is a drag/swipe
+static bool touch_is_long = false; // Whether current touch was a long press
+
+static void draw_screen();
+static void layout_worker_cancel();
 
 // ============================================================================
 // Utility Functions
@@ -147,12 +391,29 @@ static long get_current_time_ms()
     return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
+// Milliseconds with microsecond resolution, for intervals too short for
+// get_current_time_ms()
+static double get_precise_time_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
 static void set_status(const char *msg)
 {
     strncpy(status_message, msg, sizeof(status_message) - 1);
     status_message[sizeof(status_message) - 1] = '\0';
 }
 
+static void set_menu_item(imenu &item, short type, short index, const char *text, imenu *submenu)
+{
+    item.type = type;
+    item.index = index;
+    item.text = (char *)text;
+    item.submenu = submenu;
+}
+
 static std::string trim(const std::string &s)
 {
     size_t start = s.find_first_not_of(" \t\r\n");
@@ -182,673 +443,8139 @@ static std::vector<std::string> split(const std::string &s, char delim)
     return result;
 }
 
-// ============================================================================
-// Network Functions
-// ============================================================================
-
-static int connect_to_host(const char *hostname, int port)
+// Paints a page that is still loading without making it current: it is
+// swapped in for one redraw, scrolled to the top, then swapped back.
+static void draw_staged_page(GopherPage &page)
 {
-    struct hostent *he;
-    struct sockaddr_in server_addr;
-    int sockfd;
-
-    // Resolve hostname
-    he = gethostbyname(hostname);
-    if (he == NULL)
-    {
-        set_status("DNS resolution failed");
-        return -1;
-    }
+    int saved_offset = scroll_offset;
+    int saved_row = scroll_row;
+    int saved_selected = selected_index;
 
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    layout_worker_cancel();
+    current_page.swap(page);
+    scroll_offset = 0;
+    scroll_row = 0;
+    selected_index = -1;
+    for (size_t i = 0; i < current_page.items.size(); i++)
     {
-        set_status("Failed to create socket");
-        return -1;
+        if (current_page.items[i].is_selectable())
+        {
+            selected_index = i;
+            break;
+        }
     }
+    draw_screen();
+    layout_worker_cancel();
+    current_page.swap(page);
 
-    // Set socket timeout
-    struct timeval tv;
-    tv.tv_sec = kSocketTimeout;
-    tv.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-    // Setup server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    scroll_offset = saved_offset;
+    scroll_row = saved_row;
+    selected_index = saved_selected;
+}
 
-    // Connect
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        close(sockfd);
-        set_status("Connection failed");
-        return -1;
-    }
+// ============================================================================
+// Settings
+// ============================================================================
 
-    return sockfd;
-}
+// Tunables are read from a "name = value" file at startup, and again from
+// the stats page or when the file changes while the app is in the
+// background. Values take an optional K or M suffix and are clamped to
+// their range; anything wrong is reported on about:stats and left at the
+// default.
 
-static std::string fetch_gopher(const char *host, const char *selector, int port)
+struct Tunable
 {
-    char buffer[4096];
-    std::string response;
+    const char *name;
+    int *value;
+    int default_value;
+    int min_value;
+    int max_value;
+};
 
-    int sockfd = connect_to_host(host, port);
-    if (sockfd < 0)
-    {
-        return "";
-    }
+static const Tunable kTunables[] = {
+    {"socket_timeout", &settings.socket_timeout, kSocketTimeout, 1, 120},
+    {"max_response_size", &settings.max_response_size, kMaxResponseSize, 16 * 1024, 8 * 1024 * 1024},
+    {"max_history", &settings.max_history, kMaxHistory, 1, 500},
+    {"double_tap_time", &settings.double_tap_time, kDoubleTapTime, 100, 2000},
+    {"min_read_chunk", &settings.min_read_chunk, kMinReadChunk, 512, kMaxReadChunk},
+    {"max_read_chunk", &settings.max_read_chunk, kMaxReadChunk, 512, kMaxReadChunk},
+    {"min_receive_buffer", &settings.min_receive_buffer, kMinReceiveBuffer, 4 * 1024, 4 * 1024 * 1024},
+    {"max_receive_buffer", &settings.max_receive_buffer, kMaxReceiveBuffer, 4 * 1024, 4 * 1024 * 1024},
+    {"max_cached_fonts", &settings.max_cached_fonts, kMaxCachedFonts, 1, kZoomLevels},
+    {"max_cached_layouts", &settings.max_cached_layouts, kMaxCachedLayouts, 1, 16},
+    {"max_cached_searches", &settings.max_cached_searches, kMaxCachedSearches, 1, 256},
+    {"search_cache_freshness", &settings.search_cache_freshness, kSearchCacheFreshness, 0, 24 * 60 * 60},
+    {"memory_soft_rss", &settings.memory_soft_rss, kMemorySoftRss, 8 * 1024 * 1024, 512 * 1024 * 1024},
+    {"memory_hard_rss", &settings.memory_hard_rss, kMemoryHardRss, 8 * 1024 * 1024, 512 * 1024 * 1024},
+    {"memory_soft_available", &settings.memory_soft_available, kMemorySoftAvailable, 0, 512 * 1024 * 1024},
+    {"memory_hard_available", &settings.memory_hard_available, kMemoryHardAvailable, 0, 512 * 1024 * 1024},
+    {"memory_poll_interval", &settings.memory_poll_interval, kMemoryPollInterval, 1000, 60 * 1000},
+    {"radio_idle_timeout", &settings.radio_idle_timeout, kRadioIdleTimeout, 1000, 60 * 60 * 1000},
+    {"fanout_timeout", &settings.fanout_timeout, kFanoutTimeout, 1, 120},
+    {"fanout_redraw_interval", &settings.fanout_redraw_interval, kFanoutRedrawInterval, 0, 60 * 1000},
+    {"layout_idle_batch", &settings.layout_idle_batch, kLayoutIdleBatch, 100, 100000},
+    {"layout_idle_delay", &settings.layout_idle_delay, kLayoutIdleDelay, 0, 1000},
+    {"layout_ahead_screens", &settings.layout_ahead_screens, kLayoutAheadScreens, 0, 100},
+    {"peek_size", &settings.peek_size, kPeekSize, 512, 64 * 1024},
+    {"thumbnail_concurrency", &settings.thumbnail_concurrency, kThumbnailConcurrency, 1, 8},
+    {"max_thumbnail_source", &settings.max_thumbnail_source, kMaxThumbnailSource, 64 * 1024, 8 * 1024 * 1024},
+    {"mirror_radio_budget", &settings.mirror_radio_budget, kMirrorRadioBudget, 10, 60 * 60},
+    {"max_mirror_documents", &settings.max_mirror_documents, kMaxMirrorDocuments, 1, 10000},
+    {"persist_delay", &settings.persist_delay, kPersistDelay, 0, 60 * 1000},
+    {"persist_queue_limit", &settings.persist_queue_limit, kPersistQueueLimit, 1, 1024},
+    {"progress_interval", &settings.progress_interval, kProgressInterval, 100, 10 * 1000},
+    {"progress_share", &settings.progress_share, kProgressShare, 1, 50},
+};
 
-    // Send selector + CRLF
-    std::string request = std::string(selector) + "\r\n";
-    if (send(sockfd, request.c_str(), request.length(), 0) < 0)
-    {
-        close(sockfd);
-        set_status("Failed to send request");
-        return "";
-    }
+static const int kTunableCount = sizeof(kTunables) / sizeof(kTunables[0]);
 
-    // Receive response
-    ssize_t bytes_received;
-    while ((bytes_received = recv(sockfd, buffer, sizeof(buffer) - 1, 0)) > 0)
-    {
-        buffer[bytes_received] = '\0';
-        response += buffer;
+static const char *kSettingsFile = "/gopher-browser.cfg";
 
-        // Safety limit
-        if (response.length() > kMaxResponseSize)
-        {
-            set_status("Response too large");
-            break;
-        }
-    }
+static std::string settings_path;                 // File last loaded, empty if none
+static time_t settings_mtime = 0;
+static std::vector<std::string> settings_warnings; // Problems found in the file
 
-    close(sockfd);
-    return response;
+static void reset_settings()
+{
+    for (int i = 0; i < kTunableCount; i++)
+        *kTunables[i].value = kTunables[i].default_value;
 }
 
-// ============================================================================
-// Gopher Protocol Parsing
-// ============================================================================
-
-static GopherItem parse_gopher_line(const std::string &line)
+static const Tunable *find_tunable(const std::string &name)
 {
-    GopherItem item;
-    item.port = kDefaultGopherPort;
-
-    if (line.empty())
+    for (int i = 0; i < kTunableCount; i++)
     {
-        item.type = GOPHER_INFO;
-        item.display = "";
-        return item;
+        if (name == kTunables[i].name)
+            return &kTunables[i];
     }
+    return NULL;
+}
 
-    // First character is the type
-    item.type = line[0];
-
-    // Rest is tab-separated: display\tselector\thost\tport
-    std::string rest = line.substr(1);
-    std::vector<std::string> parts = split(rest, '\t');
+// Parses "123", "64K" or "48M"; false if it isn't a number or doesn't
+// fit in a long (32 bits on the device)
+static bool parse_setting_value(const std::string &text, long &value)
+{
+    char *end;
+    errno = 0;
+    value = strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || errno == ERANGE)
+        return false;
 
-    if (parts.size() >= 1)
-    {
-        item.display = parts[0];
-    }
-    if (parts.size() >= 2)
-    {
-        item.selector = parts[1];
-    }
-    if (parts.size() >= 3)
+    long multiplier = 1;
+    if (*end == 'K' || *end == 'k')
     {
-        item.host = parts[2];
+        multiplier = 1024;
+        end++;
     }
-    if (parts.size() >= 4)
+    else if (*end == 'M' || *end == 'm')
     {
-        std::string port_str = trim(parts[3]);
-        if (!port_str.empty())
-        {
-            item.port = atoi(port_str.c_str());
-            if (item.port <= 0)
-                item.port = kDefaultGopherPort;
-        }
+        multiplier = 1024 * 1024;
+        end++;
     }
-
-    return item;
+    if (value > LONG_MAX / multiplier || value < LONG_MIN / multiplier)
+        return false;
+    value *= multiplier;
+    return *end == '\0';
 }
 
-static void parse_gopher_menu(const std::string &response, GopherPage &page)
+static void settings_warning(int line, const char *format, const char *detail)
 {
-    page.items.clear();
-    page.is_menu = true;
+    char text[160];
+    char message[128];
+    snprintf(message, sizeof(message), format, detail);
+    snprintf(text, sizeof(text), "line %d: %s", line, message);
+    settings_warnings.push_back(text);
+}
 
-    std::string line;
-    for (size_t i = 0; i < response.length(); i++)
+// Keeps paired bounds consistent after clamping
+static void order_settings(int &low, int high, const char *name)
+{
+    if (low > high)
     {
-        char c = response[i];
-        if (c == '\n')
-        {
-            // Remove trailing CR if present
-            if (!line.empty() && line[line.length() - 1] == '\r')
-            {
-                line = line.substr(0, line.length() - 1);
-            }
-
-            // Check for end marker
-            if (line == ".")
-            {
-                break;
-            }
-
-            if (!line.empty())
-            {
-                page.items.push_back(parse_gopher_line(line));
-            }
-            line.clear();
-        }
-        else
-        {
-            line += c;
-        }
+        low = high;
+        settings_warnings.push_back(std::string(name) + " lowered to its upper bound");
     }
+}
 
-    // Handle last line if no newline at end
-    if (!line.empty() && line != ".")
+// Loads the settings file from the SD card, or internal flash without a
+// card. Missing file means defaults.
+static void load_settings()
+{
+    reset_settings();
+    settings_warnings.clear();
+    settings_path.clear();
+    settings_mtime = 0;
+
+    std::string path = std::string(SDCARDDIR) + kSettingsFile;
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL)
     {
-        page.items.push_back(parse_gopher_line(line));
+        path = std::string(FLASHDIR) + kSettingsFile;
+        f = fopen(path.c_str(), "r");
     }
-}
+    if (f == NULL)
+        return;
 
-static void parse_text_file(const std::string &response, GopherPage &page)
-{
-    page.items.clear();
-    page.is_menu = false;
-    page.raw_text = response;
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0)
+        settings_mtime = st.st_mtime;
+    settings_path = path;
 
-    // Convert text to info items for display
-    std::string line;
-    for (size_t i = 0; i < response.length(); i++)
+    char buf[256];
+    int line_number = 0;
+    while (fgets(buf, sizeof(buf), f) != NULL)
     {
-        char c = response[i];
-        if (c == '\n')
+        line_number++;
+        std::string line = buf;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        line = trim(line);
+        if (line.empty())
+            continue;
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
         {
-            if (!line.empty() && line[line.length() - 1] == '\r')
-            {
-                line = line.substr(0, line.length() - 1);
-            }
-            if (line == ".")
-            {
-                break;
-            }
+            settings_warning(line_number, "expected name = value, got \"%s\"", line.c_str());
+            continue;
+        }
 
-            GopherItem item;
-            item.type = GOPHER_INFO;
-            item.display = line;
-            page.items.push_back(item);
-            line.clear();
+        std::string name = trim(line.substr(0, eq));
+        std::string text = trim(line.substr(eq + 1));
+        const Tunable *tunable = find_tunable(name);
+        long value;
+        if (tunable == NULL)
+        {
+            settings_warning(line_number, "unknown setting %s", name.c_str());
+        }
+        else if (!parse_setting_value(text, value))
+        {
+            settings_warning(line_number, "bad value for %s", name.c_str());
         }
         else
         {
-            line += c;
+            if (value < tunable->min_value || value > tunable->max_value)
+            {
+                settings_warning(line_number, "%s out of range, clamped", name.c_str());
+                value = value < tunable->min_value ? tunable->min_value : tunable->max_value;
+            }
+            *tunable->value = (int)value;
         }
     }
+    fclose(f);
 
-    if (!line.empty() && line != ".")
-    {
-        GopherItem item;
-        item.type = GOPHER_INFO;
-        item.display = line;
-        page.items.push_back(item);
-    }
+    order_settings(settings.min_read_chunk, settings.max_read_chunk, "min_read_chunk");
+    order_settings(settings.min_receive_buffer, settings.max_receive_buffer, "min_receive_buffer");
+    order_settings(settings.memory_soft_rss, settings.memory_hard_rss, "memory_soft_rss");
+    order_settings(settings.memory_hard_available, settings.memory_soft_available, "memory_hard_available");
+}
+
+// True if the settings file appeared, disappeared or was edited
+static bool settings_changed()
+{
+    struct stat st;
+    std::string path = settings_path.empty() ? std::string(SDCARDDIR) + kSettingsFile : settings_path;
+    if (stat(path.c_str(), &st) != 0)
+        return !settings_path.empty();
+    return settings_path.empty() || st.st_mtime != settings_mtime;
 }
 
 // ============================================================================
-// Navigation
+// Memory Governor
 // ============================================================================
 
-static void navigate_to(const char *host, const char *selector, int port, char expected_type = GOPHER_MENU);
-static void draw_screen();
+// Subsystems holding sizeable memory register here. When the process grows
+// past the soft threshold (or the system runs low), consumers are asked to
+// shrink in priority order until usage is back under it; past the hard
+// threshold all of them drop everything they can rebuild.
 
-static void push_history()
+enum MemoryPressure
 {
-    HistoryEntry entry;
-    entry.host = current_page.host;
-    entry.selector = current_page.selector;
-    entry.port = current_page.port;
-
-    history.push_back(entry);
+    MEMORY_OK = 0,
+    MEMORY_SOFT = 1, // Drop caches that aren't needed for the current screen
+    MEMORY_HARD = 2, // Drop everything that can be rebuilt or refetched
+};
 
-    // Limit history size
-    while (history.size() > kMaxHistory)
-    {
-        history.erase(history.begin());
-    }
-}
+typedef long (*MemoryUsageProc)();
+typedef void (*MemoryShrinkProc)(int pressure);
 
-static bool go_back()
+struct MemoryConsumer
 {
-    if (history.empty())
-    {
-        return false;
-    }
+    const char *name;
+    int priority; // Lower priorities are shed first
+    MemoryUsageProc usage;
+    MemoryShrinkProc shrink;
+};
 
-    HistoryEntry entry = history.back();
-    history.pop_back();
+struct MemoryStats
+{
+    long rss;          // Resident set size at last poll
+    long available;    // System free memory at last poll
+    int soft_sheds;    // Times the soft threshold was crossed
+    int hard_sheds;    // Times the hard threshold was crossed
+    long bytes_shed;   // Consumer bytes released so far
+};
 
-    // Navigate without adding to history
-    current_page.host = entry.host;
-    current_page.selector = entry.selector;
-    current_page.port = entry.port;
+static std::vector<MemoryConsumer> memory_consumers;
+static MemoryStats memory_stats = {0, 0, 0, 0, 0};
 
-    set_status("Loading...");
-    is_loading = true;
+static void register_memory_consumer(const char *name, int priority,
+                                     MemoryUsageProc usage, MemoryShrinkProc shrink)
+{
+    MemoryConsumer consumer;
+    consumer.name = name;
+    consumer.priority = priority;
+    consumer.usage = usage;
+    consumer.shrink = shrink;
+
+    // Keep sorted by priority
+    std::vector<MemoryConsumer>::iterator it = memory_consumers.begin();
+    while (it != memory_consumers.end() && it->priority <= priority)
+        ++it;
+    memory_consumers.insert(it, consumer);
+}
 
-    std::string response = fetch_gopher(entry.host.c_str(), entry.selector.c_str(), entry.port);
+static long read_rss()
+{
+    long pages_total = 0;
+    long pages_resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages_total, &pages_resident) != 2)
+        pages_resident = 0;
+    fclose(f);
+    return pages_resident * sysconf(_SC_PAGESIZE);
+}
 
-    is_loading = false;
+// MemAvailable if the kernel has it, otherwise MemFree + Cached (2.6 kernels)
+static long read_available_memory()
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+        return -1;
 
-    if (response.empty())
+    long available = -1;
+    long free_kb = 0;
+    long cached_kb = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), f) != NULL)
     {
-        set_status("Failed to load page");
-        return false;
+        long value;
+        if (sscanf(line, "MemAvailable: %ld", &value) == 1)
+            available = value;
+        else if (sscanf(line, "MemFree: %ld", &value) == 1)
+            free_kb = value;
+        else if (sscanf(line, "Cached: %ld", &value) == 1)
+            cached_kb = value;
     }
+    fclose(f);
 
-    parse_gopher_menu(response, current_page);
+    if (available < 0)
+        available = free_kb + cached_kb;
+    return available * 1024;
+}
+
+// Pressure for a process of rss bytes with available bytes free in the
+// system, -1 if unknown
+static int memory_pressure(long rss, long available)
+{
+    if (rss > settings.memory_hard_rss || (available >= 0 && available < settings.memory_hard_available))
+        return MEMORY_HARD;
+    if (rss > settings.memory_soft_rss || (available >= 0 && available < settings.memory_soft_available))
+        return MEMORY_SOFT;
+    return MEMORY_OK;
+}
+
+static int current_memory_pressure()
+{
+    memory_stats.rss = read_rss();
+    memory_stats.available = read_available_memory();
+    return memory_pressure(memory_stats.rss, memory_stats.available);
+}
+
+// Asks consumers to shrink, lowest priority first. At soft pressure stops as
+// soon as the process is back under the soft threshold, unless asked to shed
+// from every consumer (going to background).
+static void shed_memory(int pressure, bool stop_when_relieved)
+{
+    if (pressure == MEMORY_HARD)
+        memory_stats.hard_sheds++;
+    else
+        memory_stats.soft_sheds++;
+
+    for (size_t i = 0; i < memory_consumers.size(); i++)
+    {
+        MemoryConsumer &consumer = memory_consumers[i];
+        long before = consumer.usage();
+        if (before <= 0)
+            continue;
+
+        consumer.shrink(pressure);
+
+        long after = consumer.usage();
+        if (before > after)
+            memory_stats.bytes_shed += before - after;
+
+        if (stop_when_relieved && pressure == MEMORY_SOFT &&
+            current_memory_pressure() == MEMORY_OK)
+            break;
+    }
+}
+
+static void memory_governor_check()
+{
+    int pressure = current_memory_pressure();
+    if (pressure != MEMORY_OK)
+    {
+        shed_memory(pressure, true);
+    }
+}
+
+static void memory_governor_tick()
+{
+    memory_governor_check();
+    SetWeakTimer("memory", memory_governor_tick, settings.memory_poll_interval);
+}
+
+static void memory_governor_start()
+{
+    SetWeakTimer("memory", memory_governor_tick, settings.memory_poll_interval);
+}
+
+static void memory_governor_stop()
+{
+    ClearTimer(memory_governor_tick);
+}
+
+// Reloads the settings file; timers pick up new periods when restarted
+static void apply_settings()
+{
+    load_settings();
+    memory_governor_start();
+    memory_governor_check();
+}
+
+// ============================================================================
+// Radio Power
+// ============================================================================
+
+// WiFi is brought up on demand and dropped after radio_idle_timeout without
+// traffic; a connection that was already up is left to whoever opened it.
+// On-time, bytes and wake-ups are counted per session.
+
+struct RadioStats
+{
+    bool on;
+    bool owns_connection; // NetConnect was called by us, so NetDisconnect is ours too
+    long on_since;        // When the current window opened, ms
+    long on_time;         // Closed windows so far, ms
+    long wakeups;         // Times the radio was brought up
+    long bytes;           // Received while it was up
+};
+
+static RadioStats radio = {false, false, 0, 0, 0, 0};
+
+static long radio_on_time()
+{
+    return radio.on_time + (radio.on ? get_current_time_ms() - radio.on_since : 0);
+}
+
+static void radio_idle()
+{
+    if (!radio.on)
+        return;
+
+    if (radio.owns_connection)
+        NetDisconnect();
+    radio.owns_connection = false;
+    radio.on_time += get_current_time_ms() - radio.on_since;
+    radio.on = false;
+}
+
+// Brings the radio up for a transfer. Returns false if there's no network.
+static bool radio_begin()
+{
+    ClearTimer(radio_idle);
+    if (radio.on)
+        return true;
+
+    if ((QueryNetwork() & NET_CONNECTED) == 0)
+    {
+        if (NetConnect(NULL) != 0)
+        {
+            set_status("Network unavailable");
+            return false;
+        }
+        radio.wakeups++;
+        radio.owns_connection = true;
+    }
+    radio.on = true;
+    radio.on_since = get_current_time_ms();
+    return true;
+}
+
+// Ends a transfer and starts the idle countdown
+static void radio_end(long bytes)
+{
+    radio.bytes += bytes;
+    if (radio.on)
+        SetWeakTimer("radio", radio_idle, settings.radio_idle_timeout);
+}
+
+static void radio_shutdown()
+{
+    ClearTimer(radio_idle);
+    radio_idle();
+}
+
+// ============================================================================
+// Persistence
+// ============================================================================
+
+// Files the app keeps (thumbnails, history, snapshots) are written by a
+// background thread so SD card stalls never block the event loop. Writes
+// wait persist_delay ms in a bounded queue: appends to the same file are
+// merged into one, a newer copy of a file replaces the queued one, and each
+// batch is synced once at the end. Whole files go through a temporary file
+// and rename, so a power loss leaves the old or the new copy. Exit, power
+// off and USB storage flush the queue at once.
+
+struct PersistJob
+{
+    std::string path;
+    std::string data;
+    bool append;     // Otherwise replaces the file
+    long due;        // Held until then; persist_delay is read when queued
+};
+
+struct PersistStats
+{
+    long jobs;
+    long coalesced;    // Jobs merged into one already queued
+    long waits;        // Writers that found the queue full
+    long batches;
+    long fsyncs;
+    long bytes;
+    long failures;
+    int max_depth;
+    long last_latency; // Batch write time, ms
+    long max_latency;
+    long total_latency;
+};
+
+static PersistStats persist_stats = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+static std::vector<PersistJob> persist_queue;
+static std::vector<PersistJob> persist_writing; // Batch the writer holds, until renamed into place
+static pthread_mutex_t persist_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t persist_wake = PTHREAD_COND_INITIALIZER; // Work or urgency for the writer
+static pthread_cond_t persist_idle = PTHREAD_COND_INITIALIZER; // A batch finished
+static pthread_t persist_thread;
+static bool persist_running = false;
+static bool persist_urgent = false;
+static bool persist_stopping = false;
+static bool persist_busy = false; // Writer holds a batch outside the queue
+
+static bool write_fd(int fd, const std::string &data)
+{
+    size_t done = 0;
+    while (done < data.length())
+    {
+        ssize_t n = write(fd, data.data() + done, data.length() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Writes a batch and syncs every file once. Returns the number of failures.
+static int persist_batch(const std::vector<PersistJob> &batch, long &fsyncs)
+{
+    int failures = 0;
+    std::vector<int> fds;
+    std::vector<size_t> renames; // Jobs whose temporary file replaces the target
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        const PersistJob &job = batch[i];
+        std::string path = job.append ? job.path : job.path + ".tmp";
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | (job.append ? O_APPEND : O_TRUNC), 0644);
+        if (fd < 0 || !write_fd(fd, job.data))
+        {
+            failures++;
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        fds.push_back(fd);
+        if (!job.append)
+            renames.push_back(i);
+    }
+
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        fsync(fds[i]);
+        close(fds[i]);
+        fsyncs++;
+    }
+    for (size_t i = 0; i < renames.size(); i++)
+    {
+        const PersistJob &job = batch[renames[i]];
+        if (rename((job.path + ".tmp").c_str(), job.path.c_str()) != 0)
+            failures++;
+    }
+    return failures;
+}
+
+static void *persist_main(void *)
+{
+    pthread_mutex_lock(&persist_lock);
+    while (!persist_stopping || !persist_queue.empty())
+    {
+        if (persist_queue.empty())
+        {
+            pthread_cond_wait(&persist_wake, &persist_lock);
+            continue;
+        }
+
+        // Hold the first write back a while so later ones join its batch
+        long due = persist_queue[0].due;
+        long now = get_current_time_ms();
+        if (!persist_urgent && !persist_stopping && now < due)
+        {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            long wait_us = tv.tv_usec + (due - now) * 1000;
+            struct timespec until;
+            until.tv_sec = tv.tv_sec + wait_us / 1000000;
+            until.tv_nsec = (wait_us % 1000000) * 1000;
+            pthread_cond_timedwait(&persist_wake, &persist_lock, &until);
+            continue;
+        }
+
+        // Stays readable through persist_read while it is written; only
+        // this thread changes it, and only under the lock
+        persist_writing.swap(persist_queue);
+        persist_busy = true;
+        pthread_cond_broadcast(&persist_idle);
+        pthread_mutex_unlock(&persist_lock);
+
+        long start = get_current_time_ms();
+        long fsyncs = 0;
+        int failures = persist_batch(persist_writing, fsyncs);
+        long latency = get_current_time_ms() - start;
+        long bytes = 0;
+        for (size_t i = 0; i < persist_writing.size(); i++)
+            bytes += persist_writing[i].data.length();
+
+        pthread_mutex_lock(&persist_lock);
+        persist_writing.clear();
+        persist_stats.batches++;
+        persist_stats.fsyncs += fsyncs;
+        persist_stats.bytes += bytes;
+        persist_stats.failures += failures;
+        persist_stats.last_latency = latency;
+        persist_stats.total_latency += latency;
+        if (latency > persist_stats.max_latency)
+            persist_stats.max_latency = latency;
+        persist_busy = false;
+        pthread_cond_broadcast(&persist_idle);
+    }
+    pthread_mutex_unlock(&persist_lock);
+    return NULL;
+}
+
+static void persist_start()
+{
+    if (persist_running)
+        return;
+    persist_stopping = false;
+    persist_running = pthread_create(&persist_thread, NULL, persist_main, NULL) == 0;
+}
+
+// Queues a write. Without the writer thread (it failed to start, or has
+// stopped) the file is written right away.
+static void persist_enqueue(const std::string &path, const std::string &data, bool append)
+{
+    pthread_mutex_lock(&persist_lock);
+    persist_stats.jobs++;
+
+    if (!persist_running)
+    {
+        pthread_mutex_unlock(&persist_lock);
+        std::vector<PersistJob> batch(1);
+        batch[0].path = path;
+        batch[0].data = data;
+        batch[0].append = append;
+        long start = get_current_time_ms();
+        long fsyncs = 0;
+        int failures = persist_batch(batch, fsyncs);
+        long latency = get_current_time_ms() - start;
+
+        pthread_mutex_lock(&persist_lock);
+        persist_stats.batches++;
+        persist_stats.fsyncs += fsyncs;
+        persist_stats.bytes += data.length();
+        persist_stats.failures += failures;
+        persist_stats.last_latency = latency;
+        persist_stats.total_latency += latency;
+        if (latency > persist_stats.max_latency)
+            persist_stats.max_latency = latency;
+        pthread_mutex_unlock(&persist_lock);
+        return;
+    }
+
+    // Merge into a queued write of the same file
+    for (size_t i = 0; i < persist_queue.size(); i++)
+    {
+        PersistJob &job = persist_queue[i];
+        if (job.path != path)
+            continue;
+        if (append)
+        {
+            job.data += data;
+        }
+        else
+        {
+            job.data = data;
+            job.append = false;
+        }
+        persist_stats.coalesced++;
+        pthread_mutex_unlock(&persist_lock);
+        return;
+    }
+
+    // Bounded: a full queue is written out now and the caller waits for it
+    if ((int)persist_queue.size() >= settings.persist_queue_limit)
+    {
+        persist_stats.waits++;
+        persist_urgent = true;
+        pthread_cond_signal(&persist_wake);
+        while ((int)persist_queue.size() >= settings.persist_queue_limit)
+            pthread_cond_wait(&persist_idle, &persist_lock);
+        persist_urgent = false;
+    }
+
+    PersistJob job;
+    job.path = path;
+    job.data = data;
+    job.append = append;
+    job.due = get_current_time_ms() + settings.persist_delay;
+    persist_queue.push_back(job);
+    if ((int)persist_queue.size() > persist_stats.max_depth)
+        persist_stats.max_depth = persist_queue.size();
+    pthread_cond_signal(&persist_wake);
+    pthread_mutex_unlock(&persist_lock);
+}
+
+static void persist_write(const std::string &path, const std::string &data)
+{
+    persist_enqueue(path, data, false);
+}
+
+static void persist_append(const std::string &path, const std::string &data)
+{
+    persist_enqueue(path, data, true);
+}
+
+static const PersistJob *persist_find(const std::vector<PersistJob> &jobs, const std::string &path)
+{
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        if (jobs[i].path == path)
+            return &jobs[i];
+    }
+    return NULL;
+}
+
+// Reads a whole file, or the copy of it still waiting in the queue or
+// being written. Jobs are merged per file, so each list has one at most.
+static bool persist_read(const std::string &path, std::string &data)
+{
+    pthread_mutex_lock(&persist_lock);
+    bool found = false;
+    const PersistJob *queued = persist_find(persist_queue, path);
+    const PersistJob *writing = persist_find(persist_writing, path);
+    if (queued != NULL && !queued->append)
+    {
+        data = queued->data;
+        found = true;
+    }
+    else if (writing != NULL && !writing->append)
+    {
+        data = writing->data;
+        if (queued != NULL)
+            data += queued->data;
+        found = true;
+    }
+    pthread_mutex_unlock(&persist_lock);
+    if (found)
+        return true;
+
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    data.clear();
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        data.append(buffer, n);
+    fclose(f);
+    return true;
+}
+
+// Writes everything queued now and waits until it is on the card
+static void persist_flush()
+{
+    pthread_mutex_lock(&persist_lock);
+    persist_urgent = true;
+    pthread_cond_signal(&persist_wake);
+    while (persist_running && (!persist_queue.empty() || persist_busy))
+        pthread_cond_wait(&persist_idle, &persist_lock);
+    persist_urgent = false;
+    pthread_mutex_unlock(&persist_lock);
+}
+
+static void persist_stop()
+{
+    if (!persist_running)
+        return;
+
+    pthread_mutex_lock(&persist_lock);
+    persist_stopping = true;
+    pthread_cond_signal(&persist_wake);
+    pthread_mutex_unlock(&persist_lock);
+
+    pthread_join(persist_thread, NULL);
+    persist_running = false;
+}
+
+// ============================================================================
+// Load Progress
+// ============================================================================
+
+// While a page loads the footer shows the phase, bytes and items received
+// and the transfer rate. Only the footer strip is redrawn, with the fast
+// black and white refresh, and never more often than progress_interval.
+// The gap also grows with the measured cost of a redraw, so drawing takes
+// at most progress_share percent of the time away from receiving and
+// parsing.
+
+struct LoadProgress
+{
+    bool active;
+    const char *phase;
+    const GopherPage *page; // Page being filled, for the item count
+    long start;
+    long receive_start;     // First byte, for the rate
+    long bytes;
+    long last_draw;
+    long draw_cost;         // Duration of the last redraw (ms)
+    long draws;             // Totals for about:stats
+    long draw_time;
+
+    LoadProgress()
+        : active(false), phase(""), page(NULL), start(0), receive_start(0), bytes(0),
+          last_draw(0), draw_cost(0), draws(0), draw_time(0)
+    {
+    }
+};
+
+static LoadProgress progress;
+
+static int footer_top()
+{
+    return ScreenHeight() - 25 - kScreenMargin;
+}
+
+static std::string progress_text()
+{
+    char text[128];
+    int length = snprintf(text, sizeof(text), "%s...", progress.phase);
+    if (progress.bytes > 0)
+    {
+        length += snprintf(text + length, sizeof(text) - length, " %.1f KB", progress.bytes / 1024.0);
+        if (progress.page != NULL && !progress.page->items.empty())
+        {
+            length += snprintf(text + length, sizeof(text) - length, ", %d %s", (int)progress.page->items.size(),
+                               progress.page->is_menu ? "items" : "lines");
+        }
+        long elapsed = get_current_time_ms() - progress.receive_start;
+        if (elapsed > 0)
+            snprintf(text + length, sizeof(text) - length, ", %.1f KB/s", progress.bytes / 1.024 / elapsed);
+    }
+    return text;
+}
+
+// Redraws the left part of the footer; the page indicator is left alone
+static void draw_progress()
+{
+    long begin = get_current_time_ms();
+    int y = footer_top() + 1;
+    int width = ScreenWidth() - kScreenMargin * 2 - 120;
+    int height = ScreenHeight() - kScreenMargin - y;
+
+    FillArea(kScreenMargin, y, width, height, WHITE);
+    SetFont(mono_font, BLACK);
+    DrawTextRect(kScreenMargin + 6, y + 4, width - 6, font_size, progress_text().c_str(), ALIGN_LEFT);
+    PartialUpdateBW(kScreenMargin, y, width, height);
+
+    progress.last_draw = get_current_time_ms();
+    progress.draw_cost = progress.last_draw - begin;
+    progress.draws++;
+    progress.draw_time += progress.draw_cost;
+}
+
+// Draws if the interval and the CPU share allow it
+static void progress_tick()
+{
+    if (!progress.active)
+        return;
+
+    long gap = settings.progress_interval;
+    long share_gap = progress.draw_cost * 100 / settings.progress_share;
+    if (share_gap > gap)
+        gap = share_gap;
+    if (progress.last_draw == 0 || get_current_time_ms() - progress.last_draw >= gap)
+        draw_progress();
+}
+
+static void progress_phase(const char *phase)
+{
+    if (!progress.active)
+        return;
+    progress.phase = phase;
+    if (strcmp(phase, "Receiving") == 0)
+        progress.receive_start = get_current_time_ms();
+    progress_tick();
+}
+
+static void progress_received(long bytes)
+{
+    if (!progress.active)
+        return;
+    progress.bytes += bytes;
+    progress_tick();
+}
+
+// The first phase is drawn at once; later ones wait for the interval
+static void progress_begin(const GopherPage &page)
+{
+    progress.active = true;
+    progress.phase = "Loading";
+    progress.page = &page;
+    progress.start = get_current_time_ms();
+    progress.receive_start = progress.start;
+    progress.bytes = 0;
+    progress.last_draw = 0;
+    progress.draw_cost = 0;
+}
+
+static void progress_end()
+{
+    progress.active = false;
+    progress.page = NULL;
+}
+
+// ============================================================================
+// Network Functions
+// ============================================================================
+
+// Transfer measurements behind the socket options: the bandwidth-delay
+// product is estimated from time-to-first-byte and the rate at which the
+// rest arrives, and smoothed over fetches. Both leave out DNS and the
+// handshake, and the rate counts only time spent in recv(), not parsing or
+// drawing.
+struct TransportStats
+{
+    long bdp;        // Smoothed bandwidth-delay product in bytes
+    bool fast_open;  // TCP Fast Open still worth trying
+    long fetches;
+    long bytes;
+    long recv_calls;
+    long last_ttfb;  // Request sent to first byte, ms
+    long last_ttlb;  // Request sent to last byte, ms
+};
+
+static TransportStats transport = {kInitialBdp, true, 0, 0, 0, 0, 0};
+
+static int clamp_size(long value, int min_value, int max_value)
+{
+    if (value < min_value)
+        return min_value;
+    if (value > max_value)
+        return max_value;
+    return (int)value;
+}
+
+// Receive size for the next fetch: one BDP
+static int read_chunk_size()
+{
+    return clamp_size(transport.bdp, settings.min_read_chunk, settings.max_read_chunk);
+}
+
+// transfer_ms is the time spent receiving after the first byte
+static void update_bdp(long bytes, long ttfb, long ttlb, double transfer_ms)
+{
+    transport.fetches++;
+    transport.bytes += bytes;
+    transport.last_ttfb = ttfb;
+    transport.last_ttlb = ttlb;
+
+    // Under a millisecond is too short to give a rate
+    if (bytes < kMinBdpSample || transfer_ms < 1)
+        return;
+
+    // bytes/ms * ms of latency
+    long sample = (long)(bytes / transfer_ms * (ttfb > 0 ? ttfb : 1));
+    transport.bdp = (3 * transport.bdp + sample) / 4;
+}
+
+// Socket options set before connecting, so the window scale covers the
+// receive buffer
+static void tune_socket(int sockfd)
+{
+    struct timeval tv;
+    tv.tv_sec = settings.socket_timeout;
+    tv.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    int rcvbuf = clamp_size(2 * transport.bdp, settings.min_receive_buffer, settings.max_receive_buffer);
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // The selector goes out as one small write; don't let it wait on Nagle
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static bool resolve_host(const char *hostname, int port, struct sockaddr_in &server_addr)
+{
+    progress_phase("Resolving");
+    struct hostent *he = gethostbyname(hostname);
+    if (he == NULL)
+        return false;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    memcpy(&server_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    return true;
+}
+
+static int connect_to_host(const char *hostname, int port)
+{
+    struct sockaddr_in server_addr;
+    int sockfd;
+
+    // Resolve hostname
+    if (!resolve_host(hostname, port, server_addr))
+    {
+        set_status("DNS resolution failed");
+        return -1;
+    }
+
+    // Create socket
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        set_status("Failed to create socket");
+        return -1;
+    }
+
+    tune_socket(sockfd);
+
+    // Connect
+    progress_phase("Connecting");
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        close(sockfd);
+        set_status("Connection failed");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Connects and sends the request. Where the kernel supports TCP Fast Open
+// the request rides on the SYN; if the kernel refuses it, Fast Open is
+// turned off for the session and a plain connect is made.
+static int open_request(const char *hostname, int port, const std::string &request)
+{
+#ifdef MSG_FASTOPEN
+    if (transport.fast_open)
+    {
+        struct sockaddr_in server_addr;
+        if (!resolve_host(hostname, port, server_addr))
+        {
+            set_status("DNS resolution failed");
+            return -1;
+        }
+
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd >= 0)
+        {
+            tune_socket(sockfd);
+            progress_phase("Connecting");
+            if (sendto(sockfd, request.c_str(), request.length(), MSG_FASTOPEN,
+                       (struct sockaddr *)&server_addr, sizeof(server_addr)) == (ssize_t)request.length())
+            {
+                return sockfd;
+            }
+            int error = errno;
+            close(sockfd);
+
+            if (error != EOPNOTSUPP && error != EINVAL && error != ENOTCONN && error != EPIPE)
+            {
+                set_status("Connection failed");
+                return -1;
+            }
+        }
+        transport.fast_open = false;
+    }
+#endif
+
+    int sockfd = connect_to_host(hostname, port);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+
+    if (send(sockfd, request.c_str(), request.length(), 0) < 0)
+    {
+        close(sockfd);
+        set_status("Failed to send request");
+        return -1;
+    }
+    return sockfd;
+}
+
+// Consumer of a response as it arrives from the network
+struct ResponseSink
+{
+    virtual ~ResponseSink() {}
+
+    // Returns false to stop receiving
+    virtual bool write(const char *data, size_t len) = 0;
+
+    // Called once the server closed the connection; false if the data was bad
+    virtual bool finish() { return true; }
+};
+
+// Collects the whole response in memory, up to max_response_size
+struct StringSink : public ResponseSink
+{
+    std::string data;
+
+    bool write(const char *chunk, size_t len)
+    {
+        data.append(chunk, len);
+
+        // Safety limit
+        if (data.length() > (size_t)settings.max_response_size)
+        {
+            set_status("Response too large");
+            return false;
+        }
+        return true;
+    }
+};
+
+// Sends the selector and streams the response into sink.
+// Returns the number of bytes received, or -1 if the request failed.
+// clean_eof, if given, tells whether the server closed the connection,
+// as opposed to a receive error, a timeout or the sink stopping early.
+static long fetch_gopher_stream(const char *host, const char *selector, int port, ResponseSink &sink,
+                                bool *clean_eof = NULL)
+{
+    if (clean_eof != NULL)
+        *clean_eof = false;
+
+    static char buffer[kMaxReadChunk];
+    int chunk = read_chunk_size();
+    long total = 0;
+
+    if (!radio_begin())
+    {
+        return -1;
+    }
+
+    // Send selector + CRLF
+    std::string request = std::string(selector) + "\r\n";
+    int sockfd = open_request(host, port, request);
+    if (sockfd < 0)
+    {
+        radio_end(0);
+        return -1;
+    }
+
+    // Receive response
+    long start = get_current_time_ms();
+    long first_byte = 0;
+    double receiving = 0;
+    ssize_t bytes_received;
+    for (;;)
+    {
+        double before = get_precise_time_ms();
+        bytes_received = recv(sockfd, buffer, chunk, 0);
+        if (total > 0)
+            receiving += get_precise_time_ms() - before;
+        if (bytes_received <= 0)
+            break;
+
+        transport.recv_calls++;
+        if (total == 0)
+        {
+            first_byte = get_current_time_ms();
+            progress_phase("Receiving");
+        }
+        total += bytes_received;
+        if (!sink.write(buffer, bytes_received))
+        {
+            break;
+        }
+        progress_received(bytes_received);
+    }
+    if (clean_eof != NULL)
+        *clean_eof = bytes_received == 0;
+
+    close(sockfd);
+    if (total > 0)
+        update_bdp(total, first_byte - start, get_current_time_ms() - start, receiving);
+    radio_end(total);
+    return total;
+}
+
+static std::string fetch_gopher(const char *host, const char *selector, int port)
+{
+    StringSink sink;
+    if (fetch_gopher_stream(host, selector, port, sink) < 0)
+    {
+        return "";
+    }
+    return sink.data;
+}
+
+// ============================================================================
+// Gopher Protocol Parsing
+// ============================================================================
+
+// Empties a page before it is (re)filled
+static void clear_page(GopherPage &page, bool is_menu)
+{
+    page.items.clear();
+    page.raw_text.clear();
+    page.toc.clear();
+    page.links.clear();
+    page.layouts.clear();
+    page.type_index.clear();
+    page.by_display.clear();
+    page.by_host.clear();
+    page.view_active = false;
+    page.view_type = 0;
+    page.view_sort = SORT_NONE;
+    page.view.clear();
+    page.view_pos.clear();
+    page.is_menu = is_menu;
+    page.preformatted = false;
+    page.pan_column = 0;
+}
+
+// Orders item indices by a lowercase key, keeping equal keys in page order
+struct IndexKeyLess
+{
+    const std::vector<std::string> *keys;
+
+    bool operator()(int a, int b) const
+    {
+        int cmp = (*keys)[a].compare((*keys)[b]);
+        return cmp < 0 || (cmp == 0 && a < b);
+    }
+};
+
+static void sort_by_key(std::vector<int> &order, const std::vector<std::string> &keys)
+{
+    IndexKeyLess less;
+    less.keys = &keys;
+    std::sort(order.begin(), order.end(), less);
+}
+
+// Builds the per-type index and the sort permutations for filter/sort views
+static void build_page_indexes(GopherPage &page)
+{
+    int count = page.items.size();
+    std::vector<std::string> display_keys(count);
+    std::vector<std::string> host_keys(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        const GopherItem &item = page.items[i];
+        page.type_index[item.type].push_back(i);
+        if (item.type == GOPHER_INFO)
+            continue;
+
+        page.by_display.push_back(i);
+        for (size_t c = 0; c < item.display.length(); c++)
+            display_keys[i] += tolower((unsigned char)item.display[c]);
+        host_keys[i] = item.host + '\t' + display_keys[i];
+    }
+
+    page.by_host = page.by_display;
+    sort_by_key(page.by_display, display_keys);
+    sort_by_key(page.by_host, host_keys);
+}
+
+static GopherItem parse_gopher_line(const std::string &line)
+{
+    GopherItem item;
+    item.port = kDefaultGopherPort;
+
+    if (line.empty())
+    {
+        item.type = GOPHER_INFO;
+        item.display = "";
+        return item;
+    }
+
+    // First character is the type
+    item.type = line[0];
+
+    // Rest is tab-separated: display\tselector\thost\tport
+    std::string rest = line.substr(1);
+    std::vector<std::string> parts = split(rest, '\t');
+
+    if (parts.size() >= 1)
+    {
+        item.display = parts[0];
+    }
+    if (parts.size() >= 2)
+    {
+        item.selector = parts[1];
+    }
+    if (parts.size() >= 3)
+    {
+        item.host = parts[2];
+    }
+    if (parts.size() >= 4)
+    {
+        std::string port_str = trim(parts[3]);
+        if (!port_str.empty())
+        {
+            item.port = atoi(port_str.c_str());
+            if (item.port <= 0)
+                item.port = kDefaultGopherPort;
+        }
+    }
+
+    return item;
+}
+
+// Splits a response into lines as it arrives and stops at the "." line.
+// Base of the streaming menu parser and text indexer.
+struct LineSink : public ResponseSink
+{
+    std::string line;
+    size_t received;
+    bool started;
+    bool ended; // Saw the "." terminator
+
+    LineSink() : received(0), started(false), ended(false) {}
+
+    // Called before the first line; clears the target page
+    virtual void begin() = 0;
+
+    // Called with each line, trailing CR removed
+    virtual void handle_line(const std::string &line) = 0;
+
+    void start()
+    {
+        if (!started)
+        {
+            started = true;
+            begin();
+        }
+    }
+
+    void end_line()
+    {
+        // Remove trailing CR if present
+        if (!line.empty() && line[line.length() - 1] == '\r')
+        {
+            line.erase(line.length() - 1);
+        }
+
+        // Check for end marker
+        if (line == ".")
+        {
+            ended = true;
+        }
+        else
+        {
+            handle_line(line);
+        }
+        line.clear();
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        start();
+
+        size_t pos = 0;
+        while (pos < len && !ended)
+        {
+            const char *nl = (const char *)memchr(data + pos, '\n', len - pos);
+            if (nl == NULL)
+            {
+                line.append(data + pos, len - pos);
+                break;
+            }
+            line.append(data + pos, nl - (data + pos));
+            end_line();
+            pos = nl - data + 1;
+        }
+
+        // Safety limit
+        received += len;
+        if (received > (size_t)settings.max_response_size)
+        {
+            set_status("Response too large");
+            return false;
+        }
+        return !ended;
+    }
+
+    // Handles the last line if there was no newline at the end.
+    // Returns false if nothing was received at all.
+    bool finish()
+    {
+        if (!ended && !line.empty())
+        {
+            end_line();
+        }
+        return started;
+    }
+};
+
+// Streaming menu parser: items are appended as lines arrive
+struct MenuSink : public LineSink
+{
+    GopherPage &page;
+
+    MenuSink(GopherPage &target) : page(target) {}
+
+    void begin()
+    {
+        clear_page(page, true);
+    }
+
+    void handle_line(const std::string &text)
+    {
+        if (!text.empty())
+        {
+            page.items.push_back(parse_gopher_line(text));
+        }
+    }
+
+    bool finish()
+    {
+        if (!LineSink::finish())
+            return false;
+        build_page_indexes(page);
+        return true;
+    }
+};
+
+static void parse_gopher_menu(const std::string &response, GopherPage &page)
+{
+    MenuSink sink(page);
+    sink.start();
+    sink.write(response.data(), response.length());
+    sink.finish();
+}
+
+// ----------------------------------------------------------------------------
+// Heading detection (table of contents for text files)
+// ----------------------------------------------------------------------------
+
+// Numbered heading: "1. Introduction", "3.2.1  Details", "Section 4 Foo"
+static bool is_numbered_heading(const std::string &line)
+{
+    size_t i = 0;
+    if (line.compare(0, 8, "Section ") == 0 || line.compare(0, 8, "SECTION ") == 0)
+    {
+        i = 8;
+    }
+
+    size_t digits_start = i;
+    while (i < line.length() && (isdigit((unsigned char)line[i]) || line[i] == '.'))
+    {
+        i++;
+    }
+    if (i == digits_start || !isdigit((unsigned char)line[digits_start]))
+        return false;
+
+    // Need whitespace and then a capitalized title
+    if (i >= line.length() || (line[i] != ' ' && line[i] != '\t'))
+        return false;
+    while (i < line.length() && (line[i] == ' ' || line[i] == '\t'))
+        i++;
+    if (i >= line.length() || !isupper((unsigned char)line[i]))
+        return false;
+
+    // Skip entries of the document's own contents listing ("Intro ..... 3")
+    if (line.find("...") != std::string::npos || line.find(". .") != std::string::npos)
+        return false;
+
+    return line.length() <= 72;
+}
+
+// Short line without lowercase letters: "INTRODUCTION", "  CHAPTER ONE  "
+static bool is_caps_heading(const std::string &line)
+{
+    int letters = 0;
+    int others = 0;
+    for (size_t i = 0; i < line.length(); i++)
+    {
+        unsigned char c = line[i];
+        if (islower(c))
+            return false;
+        if (isupper(c))
+            letters++;
+        else if (c != ' ' && c != '\t')
+            others++;
+    }
+    return letters >= 3 && letters >= others && line.length() <= 60;
+}
+
+// Line made of a single repeated '=', '-' or '~' character
+static bool is_underline(const std::string &line)
+{
+    std::string t = trim(line);
+    if (t.length() < 3)
+        return false;
+    char c = t[0];
+    if (c != '=' && c != '-' && c != '~')
+        return false;
+    return t.find_first_not_of(c) == std::string::npos;
+}
+
+static void add_toc_entry(GopherPage &page, const std::string &title, int line)
+{
+    if ((int)page.toc.size() >= kMaxTocEntries)
+        return;
+    if (!page.toc.empty() && page.toc.back().line == line)
+        return;
+
+    TocEntry entry;
+    entry.title = trim(title);
+    entry.line = line;
+    page.toc.push_back(entry);
+}
+
+// Runs on every line as it is appended during the text index pass
+static void detect_heading(GopherPage &page, const std::string &line)
+{
+    int index = page.items.size() - 1;
+
+    if (is_underline(line))
+    {
+        // Underlined heading: previous line is the title
+        if (index > 0)
+        {
+            const std::string &prev = page.items[index - 1].display;
+            std::string title = trim(prev);
+            if (!title.empty() && trim(line).length() * 2 >= title.length())
+            {
+                add_toc_entry(page, title, index - 1);
+            }
+        }
+        return;
+    }
+
+    if (trim(line).empty())
+        return;
+
+    if (is_numbered_heading(line) || is_caps_heading(line))
+    {
+        add_toc_entry(page, line, index);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Link detection
+// ----------------------------------------------------------------------------
+
+// gopher:// URLs (RFC 4266) in text lines become links while the text is
+// indexed. A memchr() for ':', which libc vectorizes, skips the many lines
+// without one before any pattern matching is done.
+
+static const char *kGopherScheme = "gopher://";
+static const size_t kGopherSchemeLength = 9;
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// Decodes %XX escapes; %09 separates a search selector from its query
+static std::string url_decode(const std::string &s)
+{
+    std::string result;
+    for (size_t i = 0; i < s.length(); i++)
+    {
+        int high, low;
+        if (s[i] == '%' && i + 2 < s.length() && (high = hex_digit(s[i + 1])) >= 0 &&
+            (low = hex_digit(s[i + 2])) >= 0)
+        {
+            result += (char)(high * 16 + low);
+            i += 2;
+        }
+        else
+        {
+            result += s[i];
+        }
+    }
+    return result;
+}
+
+// Parses the gopher URL starting at s[start] into link. Returns its length
+// in the text, or 0 if there is no usable URL there.
+static size_t parse_gopher_url(const std::string &s, size_t start, GopherItem &link)
+{
+    size_t host_start = start + kGopherSchemeLength;
+    size_t end = host_start;
+    while (end < s.length() && !isspace((unsigned char)s[end]) && strchr("\"<>", s[end]) == NULL)
+        end++;
+
+    // Trailing punctuation belongs to the sentence
+    while (end > host_start && strchr(".,;:!?)]'", s[end - 1]) != NULL)
+        end--;
+
+    std::string url = s.substr(host_start, end - host_start);
+    size_t slash = url.find('/');
+    std::string authority = url.substr(0, slash);
+    size_t colon = authority.find(':');
+    std::string host = authority.substr(0, colon);
+    if (host.empty())
+        return 0;
+
+    int port = kDefaultGopherPort;
+    if (colon != std::string::npos)
+    {
+        port = atoi(authority.c_str() + colon + 1);
+        if (port <= 0 || port > 65535)
+            return 0;
+    }
+
+    // "/<type><selector>"; no path means the server's root menu
+    std::string path = (slash == std::string::npos) ? "" : url.substr(slash + 1);
+    link.type = path.empty() ? (char)GOPHER_MENU : path[0];
+    link.selector = path.empty() ? "" : url_decode(path.substr(1));
+    link.host = host;
+    link.port = port;
+
+    // A search URL that carries its query opens the results directly
+    if (link.type == GOPHER_SEARCH && link.selector.find('\t') != std::string::npos)
+        link.type = GOPHER_MENU;
+    return end - start;
+}
+
+// Records the URLs in a freshly appended line; the first followable one
+// makes the line itself a link
+static void detect_links(GopherPage &page, int index)
+{
+    GopherItem &item = page.items[index];
+    const std::string &s = item.display;
+    const char *data = s.c_str();
+
+    const char *colon = (const char *)memchr(data, ':', s.length());
+    while (colon != NULL)
+    {
+        size_t pos = colon - data;
+        size_t scheme_start = pos >= 6 ? pos - 6 : 0;
+        if (pos >= 6 && strncasecmp(data + scheme_start, kGopherScheme, kGopherSchemeLength) == 0)
+        {
+            GopherItem link;
+            size_t length = parse_gopher_url(s, scheme_start, link);
+            if (length > 0 && link.is_selectable())
+            {
+                TextLink text_link;
+                text_link.item = index;
+                text_link.start = scheme_start;
+                text_link.length = length;
+                page.links.push_back(text_link);
+
+                if (item.type == GOPHER_INFO)
+                {
+                    item.type = link.type;
+                    item.selector = link.selector;
+                    item.host = link.host;
+                    item.port = link.port;
+                }
+                pos = scheme_start + length - 1;
+            }
+        }
+
+        if (pos + 1 >= s.length())
+            break;
+        colon = (const char *)memchr(data + pos + 1, ':', s.length() - pos - 1);
+    }
+}
+
+static void add_text_line(GopherPage &page, const std::string &line)
+{
+    GopherItem item;
+    item.type = GOPHER_INFO;
+    item.display = line;
+    item.port = 0;
+    page.items.push_back(item);
+
+    detect_heading(page, line);
+    detect_links(page, page.items.size() - 1);
+}
+
+// Streaming text indexer: one info item per line, headings collected as
+// lines are appended
+struct TextSink : public LineSink
+{
+    GopherPage &page;
+
+    TextSink(GopherPage &target) : page(target) {}
+
+    void begin()
+    {
+        clear_page(page, false);
+    }
+
+    void handle_line(const std::string &text)
+    {
+        add_text_line(page, text);
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        start();
+        page.raw_text.append(data, len);
+        return LineSink::write(data, len);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// HTML rendering
+// ----------------------------------------------------------------------------
+
+// Appends a code point as UTF-8
+static void append_utf8(std::string &out, unsigned long cp)
+{
+    if (cp < 0x80)
+    {
+        out += (char)cp;
+    }
+    else if (cp < 0x800)
+    {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x110000)
+    {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// Streaming HTML to text renderer for type h items: tags become line
+// breaks, entities are decoded, script/style bodies are dropped and <hN>
+// headings go straight into the table of contents. Holds at most one tag,
+// one entity and the line being built.
+struct HtmlSink : public ResponseSink
+{
+    GopherPage &page;
+    std::string text;  // Current output line
+    std::string tag;   // Tag being read, without '<' and '>'
+    std::string entity;
+    bool started;
+    bool in_tag;
+    bool in_entity;
+    bool in_pre;
+    bool in_heading;
+    bool skipping;     // Inside <script> or <style>
+    bool pending_space;
+    size_t received;
+
+    HtmlSink(GopherPage &target)
+        : page(target), started(false), in_tag(false), in_entity(false), in_pre(false),
+          in_heading(false), skipping(false), pending_space(false), received(0) {}
+
+    void emit_line()
+    {
+        std::string line = in_pre ? text : trim(text);
+        add_text_line(page, line);
+        if (in_heading && !line.empty())
+            add_toc_entry(page, line, page.items.size() - 1);
+        text.clear();
+        pending_space = false;
+    }
+
+    // Ends the current line; blank lines are not repeated
+    void break_line(bool paragraph)
+    {
+        if (!trim(text).empty() || in_pre)
+            emit_line();
+        else
+            text.clear();
+
+        if (paragraph && !page.items.empty() && !page.items.back().display.empty())
+            add_text_line(page, "");
+    }
+
+    void put_char(char c)
+    {
+        if (skipping)
+            return;
+
+        if (in_pre)
+        {
+            if (c == '\n')
+                emit_line();
+            else if (c != '\r')
+                text += c;
+            return;
+        }
+
+        // Collapse whitespace
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        {
+            pending_space = !text.empty();
+            return;
+        }
+        if (pending_space)
+            text += ' ';
+        pending_space = false;
+        text += c;
+    }
+
+    void put_entity()
+    {
+        std::string decoded;
+        if (entity == "amp")
+            decoded = "&";
+        else if (entity == "lt")
+            decoded = "<";
+        else if (entity == "gt")
+            decoded = ">";
+        else if (entity == "quot")
+            decoded = "\"";
+        else if (entity == "apos")
+            decoded = "'";
+        else if (entity == "nbsp")
+            append_utf8(decoded, 0xA0);
+        else if (!entity.empty() && entity[0] == '#')
+        {
+            unsigned long cp = (entity.length() > 1 && (entity[1] == 'x' || entity[1] == 'X'))
+                                   ? strtoul(entity.c_str() + 2, NULL, 16)
+                                   : strtoul(entity.c_str() + 1, NULL, 10);
+            append_utf8(decoded, cp);
+        }
+        else
+            decoded = "&" + entity + ";";
+
+        for (size_t i = 0; i < decoded.length(); i++)
+            put_char(decoded[i]);
+        entity.clear();
+    }
+
+    void handle_tag()
+    {
+        std::string name;
+        size_t i = 0;
+        bool closing = !tag.empty() && tag[0] == '/';
+        if (closing)
+            i = 1;
+        while (i < tag.length() && isalnum((unsigned char)tag[i]))
+            name += tolower((unsigned char)tag[i++]);
+        tag.clear();
+
+        if (name == "script" || name == "style")
+        {
+            skipping = !closing;
+            return;
+        }
+        if (skipping)
+            return;
+
+        if (name == "br")
+            break_line(false);
+        else if (name == "p" || name == "div" || name == "blockquote" || name == "table" ||
+                 name == "ul" || name == "ol" || name == "hr" || name == "title")
+            break_line(true);
+        else if (name == "tr" || name == "dt" || name == "dd")
+            break_line(false);
+        else if (name == "li")
+        {
+            break_line(false);
+            if (!closing)
+                text = "* ";
+        }
+        else if (name == "pre")
+        {
+            break_line(true);
+            in_pre = !closing;
+        }
+        else if (name.length() == 2 && name[0] == 'h' && name[1] >= '1' && name[1] <= '6')
+        {
+            if (!closing)
+            {
+                break_line(true);
+                in_heading = true;
+            }
+            else
+            {
+                break_line(true);
+                in_heading = false;
+            }
+        }
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        if (!started)
+        {
+            clear_page(page, false);
+            started = true;
+        }
+
+        for (size_t i = 0; i < len; i++)
+        {
+            char c = data[i];
+            if (in_entity)
+            {
+                if (c == ';')
+                {
+                    in_entity = false;
+                    put_entity();
+                    continue;
+                }
+                if (entity.length() < 10 && (isalnum((unsigned char)c) || c == '#'))
+                {
+                    entity += c;
+                    continue;
+                }
+
+                // Not an entity after all; c is handled below
+                in_entity = false;
+                put_char('&');
+                for (size_t e = 0; e < entity.length(); e++)
+                    put_char(entity[e]);
+                entity.clear();
+            }
+
+            if (in_tag)
+            {
+                if (c == '>')
+                {
+                    in_tag = false;
+                    handle_tag();
+                }
+                else if (tag.length() < 64)
+                {
+                    tag += c;
+                }
+            }
+            else if (c == '<')
+            {
+                in_tag = true;
+            }
+            else if (c == '&')
+            {
+                in_entity = true;
+            }
+            else
+            {
+                put_char(c);
+            }
+        }
+
+        // Safety limit
+        received += len;
+        if (received > (size_t)settings.max_response_size)
+        {
+            set_status("Response too large");
+            return false;
+        }
+        return true;
+    }
+
+    bool finish()
+    {
+        if (!trim(text).empty())
+            emit_line();
+        return started;
+    }
+};
+
+// ============================================================================
+// Downloads
+// ============================================================================
+
+// Returns the download directory, creating it on first use
+static std::string download_dir()
+{
+    std::string dir = std::string(SDCARDDIR) + kDownloadSubdir;
+    if (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST)
+        return dir;
+
+    dir = std::string(FLASHDIR) + kDownloadSubdir;
+    mkdir(dir.c_str(), 0755);
+    return dir;
+}
+
+// Strips directories and characters the FAT filesystem doesn't allow
+static std::string sanitize_filename(const std::string &name)
+{
+    std::string result;
+    for (size_t i = 0; i < name.length(); i++)
+    {
+        unsigned char c = name[i];
+        if (c == '/' || c == '\\')
+            result.clear();
+        else if (c < 32 || strchr(":*?\"<>|", c) != NULL)
+            result += '_';
+        else
+            result += c;
+    }
+    result = trim(result);
+    if (result.empty() || result == "." || result == "..")
+        result = "download";
+    return result;
+}
+
+// Output file of a decoder, opened once the original name is known
+struct DownloadFile
+{
+    FILE *file;
+    std::string path;
+    long bytes;
+
+    DownloadFile() : file(NULL), bytes(0) {}
+};
+
+static bool download_open(DownloadFile &out, const std::string &name)
+{
+    std::string dir = download_dir();
+    std::string base = sanitize_filename(name);
+
+    // Don't overwrite earlier downloads: name.ext, name-1.ext, ...
+    std::string stem = base;
+    std::string ext;
+    size_t dot = base.rfind('.');
+    if (dot != std::string::npos && dot > 0)
+    {
+        stem = base.substr(0, dot);
+        ext = base.substr(dot);
+    }
+
+    out.path = dir + "/" + base;
+    struct stat st;
+    for (int n = 1; stat(out.path.c_str(), &st) == 0; n++)
+    {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "-%d", n);
+        out.path = dir + "/" + stem + suffix + ext;
+    }
+
+    out.file = fopen(out.path.c_str(), "wb");
+    out.bytes = 0;
+    return out.file != NULL;
+}
+
+static bool download_write(DownloadFile &out, const unsigned char *data, size_t len)
+{
+    if (out.file == NULL || fwrite(data, 1, len, out.file) != len)
+        return false;
+    out.bytes += len;
+    return true;
+}
+
+// Closes the file; a failed download is removed rather than left half-written
+static bool download_close(DownloadFile &out, bool keep)
+{
+    if (out.file == NULL)
+        return false;
+
+    bool ok = fclose(out.file) == 0 && keep;
+    out.file = NULL;
+    if (!ok)
+        unlink(out.path.c_str());
+    return ok;
+}
+
+// Base of the sinks that save an item to the download directory
+struct DownloadSink : public ResponseSink
+{
+    DownloadFile out;
+    std::string error;
+};
+
+// Streaming uudecoder for type 6 items. Buffers at most one line, writes
+// decoded bytes as each line completes.
+struct UudecodeSink : public DownloadSink
+{
+    enum State
+    {
+        UU_BEGIN, // Looking for the "begin <mode> <name>" line
+        UU_BODY,  // Decoding lines
+        UU_DONE,  // Saw the terminating "end" line
+        UU_ERROR,
+    };
+
+    State state;
+    std::string line;
+    bool line_overflow;
+    bool saw_empty_line; // Zero-length line ("`") precedes "end"
+    std::string fallback_name;
+
+    UudecodeSink(const std::string &name)
+        : state(UU_BEGIN), line_overflow(false), saw_empty_line(false), fallback_name(name) {}
+
+    bool fail(const char *msg)
+    {
+        error = msg;
+        state = UU_ERROR;
+        return false;
+    }
+
+    bool decode_line()
+    {
+        if (state == UU_BEGIN)
+        {
+            if (line.compare(0, 6, "begin ") != 0)
+                return true;
+
+            // begin <octal mode> <filename>
+            size_t name_start = line.find(' ', 6);
+            std::string name = name_start == std::string::npos ? "" : trim(line.substr(name_start + 1));
+            if (!download_open(out, name.empty() ? fallback_name : name))
+                return fail("Cannot create file");
+            state = UU_BODY;
+            return true;
+        }
+
+        if (state != UU_BODY)
+            return true;
+
+        if (line == "end")
+        {
+            state = UU_DONE;
+            return true;
+        }
+        if (line.empty())
+            return true;
+
+        int n = (line[0] - 32) & 63;
+        if (n == 0)
+        {
+            saw_empty_line = true;
+            return true;
+        }
+
+        // Each 3 bytes are 4 characters; some encoders add a checksum char
+        size_t needed = 1 + ((n + 2) / 3) * 4;
+        if (line.length() < needed)
+        {
+            // Trailing spaces are often stripped in transit
+            line.append(needed - line.length(), ' ');
+        }
+
+        unsigned char decoded[64];
+        int produced = 0;
+        for (size_t i = 1; produced < n; i += 4)
+        {
+            unsigned char c0 = (line[i] - 32) & 63;
+            unsigned char c1 = (line[i + 1] - 32) & 63;
+            unsigned char c2 = (line[i + 2] - 32) & 63;
+            unsigned char c3 = (line[i + 3] - 32) & 63;
+            decoded[produced++] = (c0 << 2) | (c1 >> 4);
+            if (produced < n)
+                decoded[produced++] = (c1 << 4) | (c2 >> 2);
+            if (produced < n)
+                decoded[produced++] = (c2 << 6) | c3;
+        }
+
+        if (!download_write(out, decoded, n))
+            return fail("Write failed");
+        return true;
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            char c = data[i];
+            if (c == '\n')
+            {
+                if (!line.empty() && line[line.length() - 1] == '\r')
+                    line.erase(line.length() - 1);
+                if (!line_overflow && !decode_line())
+                    return false;
+                line.clear();
+                line_overflow = false;
+                if (state == UU_DONE)
+                    return false; // Nothing more to read
+            }
+            else if ((int)line.length() < kMaxDecodeLine)
+            {
+                line += c;
+            }
+            else if (state == UU_BODY)
+            {
+                // Dropping part of a body line would corrupt the file
+                return fail("Encoded line too long");
+            }
+            else
+            {
+                line_overflow = true;
+            }
+        }
+        return state != UU_ERROR;
+    }
+
+    bool finish()
+    {
+        if (state == UU_BEGIN)
+            error = "No uuencoded data found";
+        else if (state == UU_BODY && !saw_empty_line)
+            error = "Truncated uuencoded data";
+        else if (state == UU_BODY)
+            state = UU_DONE; // Missing "end" line after the terminator is harmless
+
+        return download_close(out, state == UU_DONE) && error.empty();
+    }
+};
+
+// CRC-16/CCITT as used by BinHex 4.0 (polynomial 0x1021, initial value 0)
+static unsigned short crc16_ccitt(unsigned short crc, unsigned char byte)
+{
+    static unsigned short table[256];
+    static bool table_ready = false;
+    if (!table_ready)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            unsigned short value = i << 8;
+            for (int bit = 0; bit < 8; bit++)
+                value = (value & 0x8000) ? (value << 1) ^ 0x1021 : (value << 1);
+            table[i] = value;
+        }
+        table_ready = true;
+    }
+    return (crc << 8) ^ table[((crc >> 8) ^ byte) & 0xFF];
+}
+
+// Streaming BinHex 4.0 decoder for type 4 items: 6-bit text decoding, then
+// RLE90 expansion, then the header/data fork/resource fork structure with
+// a CRC after each part. Only the data fork is written out.
+struct BinhexSink : public DownloadSink
+{
+    enum State
+    {
+        HQX_START,       // Looking for ':' at the start of a line
+        HQX_HEADER,      // Name length, name, type, creator, flags, fork lengths
+        HQX_HEADER_CRC,
+        HQX_DATA,
+        HQX_DATA_CRC,
+        HQX_RSRC,
+        HQX_RSRC_CRC,
+        HQX_DONE,
+        HQX_ERROR,
+    };
+
+    State state;
+    bool at_line_start;
+    bool text_ended;  // Saw the closing ':'
+
+    // 6-bit decoding
+    unsigned int bits;
+    int bit_count;
+
+    // RLE90 expansion
+    bool rle_marker;
+    unsigned char rle_last;
+
+    // Fork structure
+    unsigned char header[96];
+    int header_len;
+    int header_size; // Known after the first byte
+    unsigned short crc;
+    unsigned short stored_crc;
+    int crc_bytes;
+    unsigned long data_left;
+    unsigned long rsrc_left;
+    unsigned char out_buf[4096];
+    int out_len;
+
+    BinhexSink()
+        : state(HQX_START), at_line_start(true), text_ended(false), bits(0), bit_count(0),
+          rle_marker(false), rle_last(0), header_len(0), header_size(0), crc(0),
+          stored_crc(0), crc_bytes(0), data_left(0), rsrc_left(0), out_len(0) {}
+
+    bool fail(const char *msg)
+    {
+        if (state != HQX_ERROR)
+            error = msg;
+        state = HQX_ERROR;
+        return false;
+    }
+
+    static int decode_char(unsigned char c)
+    {
+        static const char *alphabet =
+            "!\"#$%&'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr";
+        static signed char table[256];
+        static bool table_ready = false;
+        if (!table_ready)
+        {
+            memset(table, -1, sizeof(table));
+            for (int i = 0; alphabet[i] != '\0'; i++)
+                table[(unsigned char)alphabet[i]] = i;
+            table_ready = true;
+        }
+        return table[c];
+    }
+
+    static unsigned long be32(const unsigned char *p)
+    {
+        return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+               ((unsigned long)p[2] << 8) | p[3];
+    }
+
+    bool flush_data()
+    {
+        if (out_len > 0 && !download_write(out, out_buf, out_len))
+            return fail("Write failed");
+        out_len = 0;
+        return true;
+    }
+
+    // Collects a 2-byte CRC and compares it with the running one
+    bool check_crc(unsigned char byte, State next)
+    {
+        stored_crc = (stored_crc << 8) | byte;
+        if (++crc_bytes < 2)
+            return true;
+
+        if (stored_crc != crc)
+            return fail("BinHex CRC mismatch");
+        crc = 0;
+        crc_bytes = 0;
+        stored_crc = 0;
+        state = next;
+        return true;
+    }
+
+    bool start_forks()
+    {
+        int name_len = header[0];
+        unsigned long data_len = be32(header + 1 + name_len + 1 + 10);
+        unsigned long rsrc_len = be32(header + 1 + name_len + 1 + 14);
+
+        std::string name((const char *)header + 1, name_len);
+        if (!download_open(out, name))
+            return fail("Cannot create file");
+
+        data_left = data_len;
+        rsrc_left = rsrc_len;
+        state = data_left > 0 ? HQX_DATA : HQX_DATA_CRC;
+        return true;
+    }
+
+    // One byte after RLE expansion
+    bool put_byte(unsigned char byte)
+    {
+        switch (state)
+        {
+        case HQX_HEADER:
+            if (header_len == 0)
+            {
+                if (byte < 1 || byte > 63)
+                    return fail("Bad BinHex header");
+                // len, name, version, type, creator, flags, data len, rsrc len
+                header_size = 1 + byte + 1 + 4 + 4 + 2 + 4 + 4;
+            }
+            header[header_len++] = byte;
+            crc = crc16_ccitt(crc, byte);
+            if (header_len == header_size)
+                state = HQX_HEADER_CRC;
+            return true;
+
+        case HQX_HEADER_CRC:
+            if (!check_crc(byte, HQX_HEADER_CRC))
+                return false;
+            if (crc_bytes == 0)
+                return start_forks();
+            return true;
+
+        case HQX_DATA:
+            crc = crc16_ccitt(crc, byte);
+            out_buf[out_len++] = byte;
+            if (out_len == (int)sizeof(out_buf) && !flush_data())
+                return false;
+            if (--data_left == 0)
+            {
+                state = HQX_DATA_CRC;
+                return flush_data();
+            }
+            return true;
+
+        case HQX_DATA_CRC:
+            return check_crc(byte, rsrc_left > 0 ? HQX_RSRC : HQX_RSRC_CRC);
+
+        case HQX_RSRC:
+            // Mac resource forks are of no use here, only verified
+            crc = crc16_ccitt(crc, byte);
+            if (--rsrc_left == 0)
+                state = HQX_RSRC_CRC;
+            return true;
+
+        case HQX_RSRC_CRC:
+            return check_crc(byte, HQX_DONE);
+
+        default:
+            return true; // Padding after the last CRC
+        }
+    }
+
+    // One decoded 8-bit byte before RLE expansion; 0x90 introduces a run
+    bool put_rle(unsigned char byte)
+    {
+        if (rle_marker)
+        {
+            rle_marker = false;
+            if (byte == 0)
+            {
+                rle_last = 0x90;
+                return put_byte(0x90);
+            }
+            for (int i = 1; i < byte; i++)
+            {
+                if (!put_byte(rle_last))
+                    return false;
+            }
+            return true;
+        }
+        if (byte == 0x90)
+        {
+            rle_marker = true;
+            return true;
+        }
+        rle_last = byte;
+        return put_byte(byte);
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        for (size_t i = 0; i < len && state != HQX_ERROR && !text_ended; i++)
+        {
+            unsigned char c = data[i];
+
+            if (state == HQX_START)
+            {
+                if (c == ':' && at_line_start)
+                    state = HQX_HEADER;
+                at_line_start = (c == '\n' || c == '\r');
+                continue;
+            }
+
+            if (c == '\n' || c == '\r' || c == ' ' || c == '\t')
+                continue;
+            if (c == ':')
+            {
+                text_ended = true;
+                break;
+            }
+
+            int value = decode_char(c);
+            if (value < 0)
+                return fail("Bad BinHex character");
+
+            bits = (bits << 6) | value;
+            bit_count += 6;
+            if (bit_count >= 8)
+            {
+                bit_count -= 8;
+                if (!put_rle((bits >> bit_count) & 0xFF))
+                    return false;
+            }
+        }
+        return state != HQX_ERROR && !text_ended;
+    }
+
+    bool finish()
+    {
+        if (state == HQX_START)
+            fail("No BinHex data found");
+        else if (state != HQX_DONE && state != HQX_ERROR)
+            fail("Truncated BinHex data");
+        else if (state == HQX_DONE)
+            flush_data();
+
+        if (out.file == NULL)
+            return false;
+        return download_close(out, state == HQX_DONE);
+    }
+};
+
+// Last path component of a selector, used when the encoded data has no name
+static std::string selector_filename(const std::string &selector)
+{
+    size_t slash = selector.rfind('/');
+    return slash == std::string::npos ? selector : selector.substr(slash + 1);
+}
+
+// Writes the response unchanged, for binaries and archives
+struct FileSink : public DownloadSink
+{
+    FileSink(const std::string &name)
+    {
+        if (!download_open(out, name))
+            error = "Cannot create file";
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        if (!download_write(out, (const unsigned char *)data, len))
+        {
+            if (error.empty())
+                error = "Write failed";
+            return false;
+        }
+        return true;
+    }
+
+    bool finish()
+    {
+        return download_close(out, error.empty());
+    }
+};
+
+// Fetches an image item into one scratch file for the image viewer. The
+// first bytes are checked so formats the SDK can't decode are refused
+// before the rest is transferred.
+struct ImageSink : public DownloadSink
+{
+    ImageSink()
+    {
+        out.path = download_dir() + "/.image";
+        out.file = fopen(out.path.c_str(), "wb");
+        if (out.file == NULL)
+            error = "Cannot create file";
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        const unsigned char *bytes = (const unsigned char *)data;
+        if (out.bytes == 0 && len >= 2 &&
+            !(bytes[0] == 0xFF && bytes[1] == 0xD8) && !(bytes[0] == 'B' && bytes[1] == 'M'))
+        {
+            error = "Only JPEG and BMP images can be shown";
+            return false;
+        }
+        if (!download_write(out, bytes, len))
+        {
+            if (error.empty())
+                error = "Write failed";
+            return false;
+        }
+        return true;
+    }
+
+    bool finish()
+    {
+        return download_close(out, error.empty() && out.bytes > 0);
+    }
+};
+
+// ============================================================================
+// Archive Browser
+// ============================================================================
+
+// Members of downloaded ZIP and tar files are listed as a generated menu and
+// opened one at a time, reading the archive through mmap so only the pages
+// touched are loaded.
+
+struct ArchiveMember
+{
+    std::string name;
+    unsigned long offset;      // Local header (ZIP) or member data (tar)
+    unsigned long size;        // Uncompressed size
+    unsigned long packed_size; // Size in the archive
+    unsigned long crc;         // CRC-32 (ZIP only)
+    int method;                // 0 = stored, 8 = deflated
+};
+
+struct MappedFile
+{
+    const unsigned char *data;
+    size_t size;
+};
+
+static bool map_file(const std::string &path, MappedFile &file)
+{
+    file.data = NULL;
+    file.size = 0;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    file.data = (const unsigned char *)data;
+    file.size = st.st_size;
+    return true;
+}
+
+static void unmap_file(MappedFile &file)
+{
+    if (file.data != NULL)
+        munmap((void *)file.data, file.size);
+    file.data = NULL;
+    file.size = 0;
+}
+
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static bool is_zip_file(const MappedFile &file)
+{
+    return file.size >= 4 && le32(file.data) == 0x04034b50;
+}
+
+static bool is_tar_file(const MappedFile &file)
+{
+    return file.size >= 512 && memcmp(file.data + 257, "ustar", 5) == 0;
+}
+
+// Names end up in menu lines and selectors, where tabs and line breaks
+// would split the line; such members are left out
+static bool member_name_ok(const std::string &name)
+{
+    return name.find_first_of("\t\r\n") == std::string::npos;
+}
+
+// Reads the central directory from the end of the ZIP file
+static bool read_zip_directory(const MappedFile &file, std::vector<ArchiveMember> &members)
+{
+    // End of central directory record, possibly followed by a comment
+    if (file.size < 22)
+        return false;
+
+    const unsigned char *eocd = NULL;
+    size_t min_pos = file.size > 22 + 65535 ? file.size - 22 - 65535 : 0;
+    for (size_t pos = file.size - 22;; pos--)
+    {
+        if (le32(file.data + pos) == 0x06054b50)
+        {
+            eocd = file.data + pos;
+            break;
+        }
+        if (pos == min_pos)
+            return false;
+    }
+
+    // Sizes from the archive are checked by subtraction so they can't wrap
+    unsigned int count = le16(eocd + 10);
+    unsigned long dir_size = le32(eocd + 12);
+    unsigned long dir_offset = le32(eocd + 16);
+    if (dir_offset == 0xFFFFFFFFUL || dir_offset > file.size || dir_size > file.size - dir_offset)
+        return false; // ZIP64 or damaged
+
+    size_t pos = dir_offset;
+    size_t end = dir_offset + dir_size;
+    for (unsigned int i = 0; i < count && end - pos >= 46; i++)
+    {
+        const unsigned char *p = file.data + pos;
+        if (le32(p) != 0x02014b50)
+            return false;
+
+        size_t name_len = le16(p + 28);
+        size_t extra_len = le16(p + 30);
+        size_t comment_len = le16(p + 32);
+        size_t entry_len = 46 + name_len + extra_len + comment_len;
+        if (entry_len > end - pos)
+            return false;
+
+        ArchiveMember member;
+        member.method = le16(p + 10);
+        member.crc = le32(p + 16);
+        member.packed_size = le32(p + 20);
+        member.size = le32(p + 24);
+        member.offset = le32(p + 42);
+        member.name.assign((const char *)p + 46, name_len);
+        if (member_name_ok(member.name))
+            members.push_back(member);
+
+        pos += entry_len;
+    }
+    return true;
+}
+
+// Saturates instead of overflowing; a size that large is rejected anyway
+static unsigned long parse_octal(const unsigned char *p, int len)
+{
+    unsigned long value = 0;
+    for (int i = 0; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+    {
+        if (value > (ULONG_MAX - 7) / 8)
+            return ULONG_MAX;
+        value = value * 8 + (p[i] - '0');
+    }
+    return value;
+}
+
+// Walks the 512-byte tar headers, verifying each header checksum
+static bool read_tar_index(const MappedFile &file, std::vector<ArchiveMember> &members)
+{
+    std::string long_name;
+    size_t pos = 0;
+
+    while (pos < file.size && file.size - pos >= 512)
+    {
+        const unsigned char *h = file.data + pos;
+        if (h[0] == '\0')
+            break; // End-of-archive blocks
+
+        unsigned long checksum = 0;
+        for (int i = 0; i < 512; i++)
+            checksum += (i >= 148 && i < 156) ? ' ' : h[i];
+        if (checksum != parse_octal(h + 148, 8))
+            return false;
+
+        unsigned long size = parse_octal(h + 124, 12);
+        size_t data = pos + 512;
+        char type = h[156];
+        if (size > file.size - data)
+            return false; // Member extends past the end of the archive
+
+        if (type == 'L')
+        {
+            // GNU long name for the next member
+            long_name.assign((const char *)file.data + data, strnlen((const char *)file.data + data, size));
+        }
+        else if (type == '0' || type == '\0' || type == '5')
+        {
+            ArchiveMember member;
+            if (!long_name.empty())
+            {
+                member.name = long_name;
+            }
+            else
+            {
+                std::string prefix((const char *)h + 345, strnlen((const char *)h + 345, 155));
+                member.name.assign((const char *)h, strnlen((const char *)h, 100));
+                if (!prefix.empty())
+                    member.name = prefix + "/" + member.name;
+            }
+            if (type == '5' && !member.name.empty() && member.name[member.name.length() - 1] != '/')
+                member.name += '/';
+
+            member.offset = data;
+            member.size = size;
+            member.packed_size = size;
+            member.crc = 0;
+            member.method = 0;
+            if (member_name_ok(member.name))
+                members.push_back(member);
+            long_name.clear();
+        }
+
+        // size fits in the file, so this can't wrap; it always moves forward
+        size_t next = data + size + (512 - size % 512) % 512;
+        if (next <= pos)
+            return false;
+        pos = next;
+    }
+    return true;
+}
+
+static bool read_archive_index(const MappedFile &file, std::vector<ArchiveMember> &members)
+{
+    if (is_zip_file(file))
+        return read_zip_directory(file, members);
+    if (is_tar_file(file))
+        return read_tar_index(file, members);
+    return false;
+}
+
+// Members worth opening in the text viewer
+static bool is_text_member(const std::string &name)
+{
+    static const char *extensions[] = {
+        "txt", "text", "md", "nfo", "diz", "asc", "me", "1st", "doc", "faq",
+        "log", "csv", "ini", "cfg", "conf", "gmi", "gph", "htm", "html", "xml",
+        "c", "h", "cpp", "py", "pl", "sh", "lisp", "el", "tex", "1", NULL};
+
+    std::string base = name.substr(name.rfind('/') + 1);
+    size_t dot = base.rfind('.');
+    if (dot == std::string::npos)
+        return true; // README, LICENSE, ...
+
+    std::string ext = base.substr(dot + 1);
+    for (size_t i = 0; i < ext.length(); i++)
+        ext[i] = tolower((unsigned char)ext[i]);
+    for (int i = 0; extensions[i] != NULL; i++)
+    {
+        if (ext == extensions[i])
+            return true;
+    }
+    return false;
+}
+
+// Streams one member's contents into sink, inflating with a fixed buffer
+static bool extract_member(const MappedFile &file, const ArchiveMember &member,
+                           ResponseSink &sink, std::string &error)
+{
+    bool is_zip = is_zip_file(file);
+    size_t data = member.offset;
+    if (is_zip)
+    {
+        if (data > file.size || file.size - data < 30 || le32(file.data + data) != 0x04034b50)
+        {
+            error = "Bad local header";
+            return false;
+        }
+        data += 30 + le16(file.data + data + 26) + le16(file.data + data + 28);
+    }
+    if (data > file.size || member.packed_size > file.size - data)
+    {
+        error = "Member extends past end of archive";
+        return false;
+    }
+
+    const unsigned char *src = file.data + data;
+
+    if (member.method == 0)
+    {
+        unsigned long crc = crc32(0L, Z_NULL, 0);
+        for (size_t pos = 0; pos < member.packed_size; pos += kInflateChunk)
+        {
+            size_t len = member.packed_size - pos;
+            if (len > (size_t)kInflateChunk)
+                len = kInflateChunk;
+            crc = crc32(crc, src + pos, len);
+            if (!sink.write((const char *)src + pos, len))
+                return true; // Sink is full; keep what we have
+        }
+
+        // Tar has no checksum over the data
+        if (is_zip && crc != member.crc)
+        {
+            error = "CRC mismatch";
+            return false;
+        }
+        return true;
+    }
+
+    if (member.method != 8)
+    {
+        error = "Unsupported compression method";
+        return false;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+    {
+        error = "Inflate failed";
+        return false;
+    }
+
+    std::vector<unsigned char> out(kInflateChunk);
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    bool complete = false;
+    bool ok = true;
+
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = member.packed_size;
+    while (ok)
+    {
+        zs.next_out = &out[0];
+        zs.avail_out = out.size();
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+        {
+            error = "Corrupt compressed data";
+            ok = false;
+            break;
+        }
+
+        size_t produced = out.size() - zs.avail_out;
+        crc = crc32(crc, &out[0], produced);
+        if (produced > 0 && !sink.write((const char *)&out[0], produced))
+            break; // Sink is full; keep what we have
+
+        if (ret == Z_STREAM_END)
+        {
+            complete = true;
+            break;
+        }
+        if (produced == 0 && zs.avail_in == 0)
+        {
+            error = "Truncated compressed data";
+            ok = false;
+        }
+    }
+    inflateEnd(&zs);
+
+    if (complete && crc != member.crc)
+    {
+        error = "CRC mismatch";
+        ok = false;
+    }
+    return ok;
+}
+
+static std::string format_size(unsigned long bytes)
+{
+    char buf[32];
+    if (bytes >= 1024 * 1024)
+        snprintf(buf, sizeof(buf), "%.1fM", bytes / (1024.0 * 1024.0));
+    else if (bytes >= 1024)
+        snprintf(buf, sizeof(buf), "%luK", (bytes + 1023) / 1024);
+    else
+        snprintf(buf, sizeof(buf), "%luB", bytes);
+    return buf;
+}
+
+// Generates the gopher menu listing an archive, or the text of one member
+static std::string archive_page(const std::string &selector)
+{
+    size_t bar = selector.find('|');
+    std::string path = selector.substr(0, bar);
+
+    MappedFile file;
+    if (!map_file(path, file))
+    {
+        set_status("Cannot open archive");
+        return "";
+    }
+
+    std::vector<ArchiveMember> members;
+    if (!read_archive_index(file, members))
+    {
+        unmap_file(file);
+        set_status("Not a readable ZIP or tar archive");
+        return "";
+    }
+
+    std::string page;
+    if (bar == std::string::npos)
+    {
+        page = "i" + selector_filename(path) + ": " + format_size(file.size) + "\t\tarchive\t0\r\n";
+        page += "i\t\tarchive\t0\r\n";
+
+        for (size_t i = 0; i < members.size() && (int)i < kMaxArchiveMembers; i++)
+        {
+            const ArchiveMember &m = members[i];
+            bool is_dir = !m.name.empty() && m.name[m.name.length() - 1] == '/';
+            if (is_dir)
+                continue;
+
+            std::string display = m.name + "  (" + format_size(m.size) + ")";
+            if (is_text_member(m.name))
+                page += "0" + display + "\t" + path + "|" + m.name + "\t" + kArchiveHost + "\t0\r\n";
+            else
+                page += "i" + display + "\t\tarchive\t0\r\n";
+        }
+        if ((int)members.size() > kMaxArchiveMembers)
+            page += "i(more members not shown)\t\tarchive\t0\r\n";
+    }
+    else
+    {
+        std::string name = selector.substr(bar + 1);
+        StringSink sink;
+        std::string error;
+        bool found = false;
+
+        for (size_t i = 0; i < members.size(); i++)
+        {
+            if (members[i].name == name)
+            {
+                found = true;
+                if (!extract_member(file, members[i], sink, error))
+                    set_status(error.c_str());
+                break;
+            }
+        }
+        if (!found)
+            set_status("Member not found");
+        page.swap(sink.data);
+    }
+
+    unmap_file(file);
+    return page;
+}
+
+// ============================================================================
+// Multi-Search
+// ============================================================================
+
+// Sends one query to every configured search engine at once over
+// non-blocking sockets, plus a search of the local downloads. Results are
+// merged into the current page as lines arrive, de-duplicated, and shown as
+// soon as the first source answers.
+
+struct FanoutSource
+{
+    const SearchEngine *engine;
+    int fd;
+    bool connecting;     // Non-blocking connect still in progress
+    std::string request;
+    size_t sent;
+    std::string pending; // Partial line
+    long deadline;
+    int results;
+    bool done;
+    const char *error;
+};
+
+static int connect_nonblocking(const char *hostname, int port)
+{
+    struct sockaddr_in server_addr;
+    if (!resolve_host(hostname, port, server_addr))
+        return -1;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+        return -1;
+    tune_socket(sockfd);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+static std::string item_key(const GopherItem &item)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", item.port);
+    return std::string(1, item.type) + item.host + ":" + port + item.selector;
+}
+
+static std::string menu_line(const GopherItem &item)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", item.port);
+    return std::string(1, item.type) + item.display + "\t" + item.selector + "\t" +
+           item.host + "\t" + port + "\r\n";
+}
+
+struct MergedResults
+{
+    GopherPage *page;           // Staging page the results are shown in
+    std::string menu;           // Gopher menu text of everything merged so far
+    std::set<std::string> seen; // item_key() of merged items
+    bool updated;               // New items since the last redraw
+    long bytes;                 // Received from all engines
+};
+
+// Adds a result unless another source already returned it
+static void merge_result(MergedResults &merged, const GopherItem &item)
+{
+    if (!merged.seen.insert(item_key(item)).second)
+        return;
+
+    merged.menu += menu_line(item);
+    merged.page->items.push_back(item);
+    merged.updated = true;
+}
+
+static void merge_info(MergedResults &merged, const std::string &text)
+{
+    GopherItem item;
+    item.type = GOPHER_INFO;
+    item.display = text;
+    item.port = 0;
+    merged.menu += menu_line(item);
+    merged.page->items.push_back(item);
+    merged.updated = true;
+}
+
+// Offline source: downloaded files whose names contain the query
+static void search_downloads(MergedResults &merged, const std::string &query)
+{
+    std::string dir = download_dir();
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+        return;
+
+    std::string needle = query;
+    for (size_t i = 0; i < needle.length(); i++)
+        needle[i] = tolower((unsigned char)needle[i]);
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        std::string name = entry->d_name;
+        std::string lower = name;
+        for (size_t i = 0; i < lower.length(); i++)
+            lower[i] = tolower((unsigned char)lower[i]);
+        if (name[0] == '.' || lower.find(needle) == std::string::npos)
+            continue;
+
+        GopherItem item;
+        item.display = "[local] " + name;
+        item.selector = dir + "/" + name;
+        item.port = 0;
+
+        MappedFile file;
+        bool is_archive = false;
+        if (map_file(item.selector, file))
+        {
+            is_archive = is_zip_file(file) || is_tar_file(file);
+            unmap_file(file);
+        }
+        item.type = is_archive ? GOPHER_MENU : GOPHER_INFO;
+        item.host = is_archive ? kArchiveHost : "";
+        merge_result(merged, item);
+    }
+    closedir(d);
+}
+
+// Parses complete lines received from a source
+static void fanout_consume(FanoutSource &src, MergedResults &merged, const char *data, size_t len)
+{
+    src.pending.append(data, len);
+
+    size_t start = 0;
+    size_t nl;
+    while ((nl = src.pending.find('\n', start)) != std::string::npos)
+    {
+        std::string line = src.pending.substr(start, nl - start);
+        start = nl + 1;
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+
+        if (line == ".")
+        {
+            src.done = true;
+            break;
+        }
+
+        GopherItem item = parse_gopher_line(line);
+        if (!line.empty() && item.type != GOPHER_INFO && item.type != GOPHER_ERROR)
+        {
+            merge_result(merged, item);
+            src.results++;
+        }
+    }
+    src.pending.erase(0, start);
+}
+
+static void fanout_close(FanoutSource &src, const char *error)
+{
+    if (src.fd >= 0)
+        close(src.fd);
+    src.fd = -1;
+    src.done = true;
+    if (src.error == NULL)
+        src.error = error;
+}
+
+// Advances one source after poll() reported activity on its socket
+static void fanout_step(FanoutSource &src, MergedResults &merged, short revents)
+{
+    if (src.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(src.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (revents & (POLLERR | POLLHUP)))
+        {
+            fanout_close(src, "connection failed");
+            return;
+        }
+        src.connecting = false;
+    }
+
+    if (src.sent < src.request.length())
+    {
+        ssize_t n = send(src.fd, src.request.data() + src.sent, src.request.length() - src.sent, 0);
+        if (n < 0 && errno != EAGAIN)
+            fanout_close(src, "send failed");
+        else if (n > 0)
+            src.sent += n;
+        return;
+    }
+
+    char buffer[4096];
+    ssize_t n = recv(src.fd, buffer, sizeof(buffer), 0);
+    if (n > 0)
+    {
+        merged.bytes += n;
+        fanout_consume(src, merged, buffer, n);
+        if (src.done)
+            fanout_close(src, NULL);
+    }
+    else if (n == 0)
+    {
+        fanout_close(src, NULL);
+    }
+    else if (errno != EAGAIN)
+    {
+        fanout_close(src, "receive failed");
+    }
+}
+
+// Runs the query against all sources, showing merged results from the
+// staging page as they arrive. Returns the merged menu text.
+static std::string multi_search(const std::string &query, GopherPage &page)
+{
+    MergedResults merged;
+    merged.page = &page;
+    merged.updated = false;
+    merged.bytes = 0;
+
+    clear_page(page, true);
+
+    merge_info(merged, "Results for \"" + query + "\":");
+    search_downloads(merged, query);
+
+    // Without a network only the downloads are searched
+    bool online = radio_begin();
+    int source_count = online ? kSearchEngineCount : 0;
+    std::vector<FanoutSource> sources(source_count);
+    long now = get_current_time_ms();
+    for (int i = 0; i < source_count; i++)
+    {
+        FanoutSource &src = sources[i];
+        src.engine = &kSearchEngines[i];
+        src.request = std::string(src.engine->selector) + "\t" + query + "\r\n";
+        src.sent = 0;
+        src.deadline = now + settings.fanout_timeout * 1000;
+        src.results = 0;
+        src.done = false;
+        src.error = NULL;
+        src.connecting = true;
+        src.fd = connect_nonblocking(src.engine->host, src.engine->port);
+        if (src.fd < 0)
+            fanout_close(src, "connection failed");
+    }
+
+    bool shown_first = false;
+    long last_redraw = 0;
+
+    for (;;)
+    {
+        std::vector<struct pollfd> fds;
+        std::vector<int> owners;
+        now = get_current_time_ms();
+        for (int i = 0; i < source_count; i++)
+        {
+            FanoutSource &src = sources[i];
+            if (src.done)
+                continue;
+            if (now >= src.deadline)
+            {
+                fanout_close(src, "timed out");
+                continue;
+            }
+
+            struct pollfd pfd;
+            pfd.fd = src.fd;
+            pfd.events = (src.connecting || src.sent < src.request.length()) ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            owners.push_back(i);
+        }
+        if (fds.empty())
+            break;
+
+        if (poll(&fds[0], fds.size(), 250) > 0)
+        {
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if (fds[i].revents != 0)
+                    fanout_step(sources[owners[i]], merged, fds[i].revents);
+            }
+        }
+
+        // First results go up immediately, later ones at a calmer pace
+        now = get_current_time_ms();
+        if (merged.updated && (!shown_first || now - last_redraw >= settings.fanout_redraw_interval))
+        {
+            draw_staged_page(page);
+            merged.updated = false;
+            shown_first = true;
+            last_redraw = now;
+        }
+    }
+
+    merge_info(merged, "");
+    for (int i = 0; i < source_count; i++)
+    {
+        char summary[128];
+        if (sources[i].error != NULL && sources[i].results == 0)
+            snprintf(summary, sizeof(summary), "%s: %s", sources[i].engine->name, sources[i].error);
+        else
+            snprintf(summary, sizeof(summary), "%s: %d results", sources[i].engine->name, sources[i].results);
+        merge_info(merged, summary);
+    }
+
+    if (online)
+        radio_end(merged.bytes);
+    else
+        merge_info(merged, "Network unavailable, downloads only");
+
+    return merged.menu;
+}
+
+// ============================================================================
+// Search Cache
+// ============================================================================
+
+// Search results keyed by "host:port<selector>\t<query>". The map is ordered,
+// so looking up shorter prefixes of a query finds earlier, broader searches
+// of the same engine; their results are filtered locally to show something
+// while the refined query is still on the network.
+
+struct CachedSearch
+{
+    std::string menu; // Response in gopher menu format
+    time_t fetched_at;
+    long last_used;
+};
+
+static std::map<std::string, CachedSearch> search_cache;
+static std::vector<std::string> recent_queries; // Most recent first
+
+static std::string search_cache_key(const char *host, int port, const char *selector)
+{
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), ":%d", port);
+    return std::string(host) + port_str + selector;
+}
+
+static bool is_search_selector(const char *host, const char *selector)
+{
+    return strcmp(host, kMultiSearchHost) == 0 || strchr(selector, '\t') != NULL;
+}
+
+static std::string search_query_of(const char *host, const char *selector)
+{
+    if (strcmp(host, kMultiSearchHost) == 0)
+        return selector;
+    const char *tab = strchr(selector, '\t');
+    return tab != NULL ? tab + 1 : "";
+}
+
+static void remember_query(const std::string &query)
+{
+    for (size_t i = 0; i < recent_queries.size(); i++)
+    {
+        if (recent_queries[i] == query)
+        {
+            recent_queries.erase(recent_queries.begin() + i);
+            break;
+        }
+    }
+    recent_queries.insert(recent_queries.begin(), query);
+    if ((int)recent_queries.size() > kMaxRecentQueries)
+        recent_queries.resize(kMaxRecentQueries);
+}
+
+// Fresh cached results for exactly this search, or NULL
+static const CachedSearch *search_cache_get(const std::string &key)
+{
+    std::map<std::string, CachedSearch>::iterator it = search_cache.find(key);
+    if (it == search_cache.end())
+        return NULL;
+    if (time(NULL) - it->second.fetched_at > settings.search_cache_freshness)
+    {
+        search_cache.erase(it);
+        return NULL;
+    }
+    it->second.last_used = get_current_time_ms();
+    return &it->second;
+}
+
+static void search_cache_put(const std::string &key, const std::string &menu)
+{
+    if (search_cache.find(key) == search_cache.end() &&
+        (int)search_cache.size() >= settings.max_cached_searches)
+    {
+        std::map<std::string, CachedSearch>::iterator oldest = search_cache.begin();
+        for (std::map<std::string, CachedSearch>::iterator it = search_cache.begin();
+             it != search_cache.end(); ++it)
+        {
+            if (it->second.last_used < oldest->second.last_used)
+                oldest = it;
+        }
+        search_cache.erase(oldest);
+    }
+
+    CachedSearch &entry = search_cache[key];
+    entry.menu = menu;
+    entry.fetched_at = time(NULL);
+    entry.last_used = get_current_time_ms();
+}
+
+// Cached results of the longest earlier query this one extends, or NULL
+static const CachedSearch *search_cache_prefix(const std::string &key, size_t query_start,
+                                               std::string &prefix_query)
+{
+    for (size_t len = key.length() - 1; len > query_start; len--)
+    {
+        const CachedSearch *entry = search_cache_get(key.substr(0, len));
+        if (entry != NULL)
+        {
+            prefix_query = key.substr(query_start, len - query_start);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static std::string lowercase(const std::string &s)
+{
+    std::string result = s;
+    for (size_t i = 0; i < result.length(); i++)
+        result[i] = tolower((unsigned char)result[i]);
+    return result;
+}
+
+// True if every word of the query occurs in the text
+static bool matches_query(const std::string &text, const std::vector<std::string> &words)
+{
+    std::string lower = lowercase(text);
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        if (!words[i].empty() && lower.find(words[i]) == std::string::npos)
+            return false;
+    }
+    return true;
+}
+
+// Shows earlier results filtered by the refined query while it is fetched
+static void show_refined_preview(const CachedSearch &entry, const std::string &prefix_query,
+                                 const std::string &query, GopherPage &page)
+{
+    std::vector<std::string> words = split(lowercase(query), ' ');
+
+    GopherPage preview;
+    parse_gopher_menu(entry.menu, preview);
+
+    clear_page(page, true);
+
+    GopherItem note;
+    note.type = GOPHER_INFO;
+    note.port = 0;
+    note.display = "Filtered from \"" + prefix_query + "\", refreshing...";
+    page.items.push_back(note);
+
+    for (size_t i = 0; i < preview.items.size(); i++)
+    {
+        const GopherItem &item = preview.items[i];
+        if (item.is_selectable() && matches_query(item.display, words))
+        {
+            page.items.push_back(item);
+        }
+    }
+    draw_staged_page(page);
+}
+
+// Memory governor hooks: stale results go at soft pressure, all at hard
+static long search_cache_memory_usage()
+{
+    long total = 0;
+    for (std::map<std::string, CachedSearch>::iterator it = search_cache.begin();
+         it != search_cache.end(); ++it)
+    {
+        total += it->first.capacity() + it->second.menu.capacity() + sizeof(CachedSearch);
+    }
+    return total;
+}
+
+static void shrink_search_cache(int pressure)
+{
+    if (pressure == MEMORY_HARD)
+    {
+        search_cache.clear();
+        return;
+    }
+
+    time_t now = time(NULL);
+    std::map<std::string, CachedSearch>::iterator it = search_cache.begin();
+    while (it != search_cache.end())
+    {
+        if (now - it->second.fetched_at > settings.search_cache_freshness)
+            search_cache.erase(it++);
+        else
+            ++it;
+    }
+}
+
+// Runs a search through the cache: fresh results are reused as they are,
+// otherwise a broader cached search is filtered for display while the
+// network answers, and the new results are cached. Previews are built in
+// the staging page.
+static std::string cached_search(const char *host, const char *selector, int port, GopherPage &page)
+{
+    std::string key = search_cache_key(host, port, selector);
+    std::string query = search_query_of(host, selector);
+    remember_query(query);
+
+    const CachedSearch *cached = search_cache_get(key);
+    if (cached != NULL)
+        return cached->menu;
+
+    // Multi-search streams its own results into the page as they arrive
+    bool is_multi = strcmp(host, kMultiSearchHost) == 0;
+    if (!is_multi)
+    {
+        std::string prefix_query;
+        const CachedSearch *broader = search_cache_prefix(key, key.length() - query.length(), prefix_query);
+        if (broader != NULL)
+            show_refined_preview(*broader, prefix_query, query, page);
+    }
+
+    std::string response = is_multi ? multi_search(selector, page) : fetch_gopher(host, selector, port);
+    if (!response.empty())
+        search_cache_put(key, response);
+    return response;
+}
+
+// ============================================================================
+// Peek Preview
+// ============================================================================
+
+// A peek fetches only the first peek_size bytes of a text item and closes
+// the connection. The bytes are kept as a prefix entry: opening the item
+// afterwards shows them at once, then checks them against the start of the
+// full response and streams in only the rest.
+
+struct PrefixEntry
+{
+    std::string data;
+    bool complete; // The server closed before the limit: whole document
+    long added;    // Insertion order, for eviction
+};
+
+static std::map<std::string, PrefixEntry> prefix_cache;
+static long prefix_cache_clock = 0;
+static std::vector<std::string> peek_lines; // Lines shown in the peek popup
+static GopherItem peeked_item;
+
+// Keeps the first limit bytes of a response and stops receiving
+struct PrefixSink : public ResponseSink
+{
+    std::string data;
+    size_t limit;
+
+    PrefixSink(size_t max_bytes) : limit(max_bytes) {}
+
+    bool write(const char *chunk, size_t len)
+    {
+        size_t room = limit - data.length();
+        data.append(chunk, len < room ? len : room);
+        return data.length() < limit;
+    }
+};
+
+// Checks a response against a prefix the page sink was already given, and
+// passes on what follows it
+struct SkipPrefixSink : public ResponseSink
+{
+    ResponseSink &sink;
+    const std::string &prefix;
+    size_t matched;
+    bool diverged; // The document changed since the peek
+
+    SkipPrefixSink(ResponseSink &target, const std::string &skipped)
+        : sink(target), prefix(skipped), matched(0), diverged(false) {}
+
+    bool write(const char *chunk, size_t len)
+    {
+        if (matched < prefix.length())
+        {
+            size_t n = prefix.length() - matched;
+            if (n > len)
+                n = len;
+            if (memcmp(chunk, prefix.data() + matched, n) != 0)
+            {
+                diverged = true;
+                return false;
+            }
+            matched += n;
+            chunk += n;
+            len -= n;
+            if (len == 0)
+                return true;
+        }
+        return sink.write(chunk, len);
+    }
+};
+
+static void prefix_cache_put(const std::string &key, const std::string &data, bool complete)
+{
+    // Bounded, oldest out first; a dropped prefix only costs the full load
+    // its head start
+    if (prefix_cache.size() >= (size_t)kMaxPrefixEntries && prefix_cache.find(key) == prefix_cache.end())
+    {
+        std::map<std::string, PrefixEntry>::iterator oldest = prefix_cache.begin();
+        for (std::map<std::string, PrefixEntry>::iterator it = prefix_cache.begin(); it != prefix_cache.end(); ++it)
+        {
+            if (it->second.added < oldest->second.added)
+                oldest = it;
+        }
+        prefix_cache.erase(oldest);
+    }
+
+    PrefixEntry &entry = prefix_cache[key];
+    entry.data = data;
+    entry.complete = complete;
+    entry.added = ++prefix_cache_clock;
+}
+
+// Removes and returns the prefix entry for a document, if there is one
+static bool prefix_cache_take(const std::string &key, PrefixEntry &entry)
+{
+    std::map<std::string, PrefixEntry>::iterator it = prefix_cache.find(key);
+    if (it == prefix_cache.end())
+        return false;
+
+    entry.data.swap(it->second.data);
+    entry.complete = it->second.complete;
+    prefix_cache.erase(it);
+    return true;
+}
+
+static long prefix_cache_memory_usage()
+{
+    long total = 0;
+    std::map<std::string, PrefixEntry>::const_iterator it;
+    for (it = prefix_cache.begin(); it != prefix_cache.end(); ++it)
+    {
+        total += it->first.capacity() + it->second.data.capacity() + sizeof(PrefixEntry);
+    }
+    return total;
+}
+
+static void shrink_prefix_cache(int /*pressure*/)
+{
+    prefix_cache.clear();
+}
+
+// Fetches the start of a text item into the prefix cache and splits it into
+// peek_lines. Returns false if nothing arrived.
+static bool peek_item(const GopherItem &item)
+{
+    PrefixSink sink(settings.peek_size);
+    set_status("Peeking...");
+    is_loading = true;
+    bool clean_eof;
+    long received = fetch_gopher_stream(item.host.c_str(), item.selector.c_str(), item.port, sink, &clean_eof);
+    is_loading = false;
+    set_status("");
+    if (received <= 0 || sink.data.empty())
+        return false;
+
+    // Short of the limit is only the whole document if the server closed;
+    // a timeout or receive error leaves a prefix to complete later
+    bool complete = clean_eof && sink.data.length() < sink.limit;
+    prefix_cache_put(search_cache_key(item.host.c_str(), item.port, item.selector.c_str()), sink.data, complete);
+
+    // The last line may be cut off; it is shown as it is
+    peeked_item = item;
+    peek_lines.clear();
+    std::vector<std::string> lines = split(sink.data, '\n');
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        std::string &line = lines[i];
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (line == ".")
+            break;
+        peek_lines.push_back(line);
+    }
+    return true;
+}
+
+// ============================================================================
+// Thumbnail Grid
+// ============================================================================
+
+// Menus of images can be shown as a grid of thumbnails. Images on the grid
+// page are fetched a few at a time over non-blocking sockets, decoded
+// straight to thumbnail size and kept on the SD card, so a second visit
+// paints from the cache without touching the network. Progressive JPEGs
+// are cut off after their first scan, which already holds the whole
+// picture at low resolution; formats that can't be decoded are dropped
+// after their first bytes.
+
+// Tracks the marker structure of a JPEG as it arrives
+struct JpegScan
+{
+    size_t pos;       // Next byte to look at
+    bool progressive; // SOF2 seen
+    bool in_scan;     // Inside the entropy-coded data of the first scan
+    bool given_up;    // Baseline or malformed: needs the whole file
+};
+
+// Returns true once the first scan of a progressive JPEG has arrived;
+// scan.pos is then where it ends
+static bool jpeg_scan_advance(JpegScan &scan, const std::string &data)
+{
+    const unsigned char *bytes = (const unsigned char *)data.data();
+    size_t size = data.length();
+
+    while (!scan.given_up)
+    {
+        if (scan.in_scan)
+        {
+            // Stuffed zeros, restart markers and fill bytes stay in the scan
+            for (; scan.pos + 1 < size; scan.pos++)
+            {
+                if (bytes[scan.pos] != 0xFF)
+                    continue;
+                unsigned char next = bytes[scan.pos + 1];
+                if (next != 0x00 && next != 0xFF && (next < 0xD0 || next > 0xD7))
+                    return true;
+            }
+            return false;
+        }
+
+        if (scan.pos == 0)
+        {
+            if (size < 2)
+                return false;
+            scan.pos = 2; // SOI, checked by the caller
+            continue;
+        }
+
+        if (scan.pos + 4 > size)
+            return false;
+        if (bytes[scan.pos] != 0xFF)
+        {
+            scan.given_up = true;
+            break;
+        }
+
+        unsigned char marker = bytes[scan.pos + 1];
+        if (marker == 0xFF)
+        {
+            scan.pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            scan.pos += 2;
+            continue;
+        }
+
+        size_t length = (bytes[scan.pos + 2] << 8) | bytes[scan.pos + 3];
+        if (marker == 0xC2)
+            scan.progressive = true;
+        if (marker == 0xDA)
+        {
+            if (!scan.progressive)
+                scan.given_up = true;
+            scan.in_scan = true;
+        }
+        scan.pos += 2 + length;
+    }
+    return false;
+}
+
+// Scales a decoded image to fit kThumbnailSize as 8-bit gray, the format
+// the thumbnail cache stores. The gray weighting doesn't depend on whether
+// the decoder produced RGB or BGR.
+static ibitmap *make_thumbnail(const ibitmap *src)
+{
+    if (src->width == 0 || src->height == 0 || (src->depth != 8 && src->depth != 24 && src->depth != 32))
+        return NULL;
+
+    int width = src->width;
+    int height = src->height;
+    if (width > kThumbnailSize || height > kThumbnailSize)
+    {
+        if (width >= height)
+        {
+            height = height * kThumbnailSize / width;
+            width = kThumbnailSize;
+        }
+        else
+        {
+            width = width * kThumbnailSize / height;
+            height = kThumbnailSize;
+        }
+        if (width < 1)
+            width = 1;
+        if (height < 1)
+            height = 1;
+    }
+
+    ibitmap *thumb = (ibitmap *)malloc(sizeof(ibitmap) + width * height);
+    if (thumb == NULL)
+        return NULL;
+    thumb->width = width;
+    thumb->height = height;
+    thumb->depth = 8;
+    thumb->scanline = width;
+
+    int bytes_per_pixel = src->depth / 8;
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *row = src->data + (y * src->height / height) * src->scanline;
+        for (int x = 0; x < width; x++)
+        {
+            const unsigned char *p = row + (x * src->width / width) * bytes_per_pixel;
+            thumb->data[y * width + x] = bytes_per_pixel == 1 ? p[0] : (p[0] + 2 * p[1] + p[2]) / 4;
+        }
+    }
+    return thumb;
+}
+
+// Cache files are named by a hash of the item and start with its full key,
+// so a collision reads as a miss
+static std::string thumbnail_path(const std::string &key)
+{
+    unsigned long hash = 2166136261UL; // FNV-1a
+    for (size_t i = 0; i < key.length(); i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+    }
+
+    std::string dir = download_dir() + kThumbnailSubdir;
+    mkdir(dir.c_str(), 0755);
+    char name[32];
+    snprintf(name, sizeof(name), "/%08lx.thm", hash);
+    return dir + name;
+}
+
+static void save_thumbnail(const std::string &key, const ibitmap *thumb)
+{
+    unsigned char size[4] = {(unsigned char)(thumb->width >> 8), (unsigned char)thumb->width,
+                             (unsigned char)(thumb->height >> 8), (unsigned char)thumb->height};
+    std::string data = "GTH1\n" + key + "\n";
+    data.append((const char *)size, 4);
+    data.append((const char *)thumb->data, thumb->width * thumb->height);
+    persist_write(thumbnail_path(key), data);
+}
+
+static ibitmap *load_thumbnail(const std::string &key)
+{
+    std::string data;
+    if (!persist_read(thumbnail_path(key), data))
+        return NULL;
+
+    std::string header = "GTH1\n" + key + "\n";
+    if (data.length() < header.length() + 4 || data.compare(0, header.length(), header) != 0)
+        return NULL;
+
+    const unsigned char *size = (const unsigned char *)data.data() + header.length();
+    int width = (size[0] << 8) | size[1];
+    int height = (size[2] << 8) | size[3];
+    if (width <= 0 || height <= 0 || width > kThumbnailSize || height > kThumbnailSize ||
+        data.length() != header.length() + 4 + width * height)
+        return NULL;
+
+    ibitmap *thumb = (ibitmap *)malloc(sizeof(ibitmap) + width * height);
+    if (thumb == NULL)
+        return NULL;
+    thumb->width = width;
+    thumb->height = height;
+    thumb->depth = 8;
+    thumb->scanline = width;
+    memcpy(thumb->data, size + 4, width * height);
+    return thumb;
+}
+
+// Decodes a fetched (possibly truncated) image at thumbnail size. The JPEG
+// decoder scales while decoding; bitmaps are scaled afterwards.
+static ibitmap *decode_thumbnail(const std::string &data)
+{
+    std::string path = download_dir() + "/.thumb";
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL)
+        return NULL;
+    bool written = fwrite(data.data(), 1, data.length(), f) == data.length();
+    fclose(f);
+
+    ibitmap *image = NULL;
+    if (written && data[0] == 'B')
+        image = LoadBitmap(path.c_str());
+    else if (written)
+        image = LoadJPEG(path.c_str(), kThumbnailSize, kThumbnailSize, 100, 100, 1);
+    unlink(path.c_str());
+    if (image == NULL)
+        return NULL;
+
+    ibitmap *thumb = make_thumbnail(image);
+    free(image);
+    return thumb;
+}
+
+struct ThumbnailGrid
+{
+    bool active;
+    std::vector<int> items;         // Image items of the page, in order
+    int first;                      // Index into items of the first tile shown
+    std::vector<ibitmap *> thumbs;  // Per tile shown, NULL until there is one
+    std::vector<const char *> notes; // Shown instead of a missing thumbnail
+};
+
+static ThumbnailGrid grid;
+
+static void free_grid_thumbnails()
+{
+    for (size_t i = 0; i < grid.thumbs.size(); i++)
+        free(grid.thumbs[i]);
+    grid.thumbs.clear();
+    grid.notes.clear();
+}
+
+static void close_grid()
+{
+    free_grid_thumbnails();
+    grid.items.clear();
+    grid.active = false;
+}
+
+static std::string thumbnail_key(const GopherItem &item)
+{
+    return search_cache_key(item.host.c_str(), item.port, item.selector.c_str());
+}
+
+struct ThumbnailFetch
+{
+    int tile;
+    int fd;
+    bool connecting;
+    std::string request;
+    size_t sent;
+    std::string data;
+    JpegScan scan;
+    long deadline;
+    bool done;
+    bool complete; // Enough of the image arrived to decode
+};
+
+static void thumbnail_close(ThumbnailFetch &fetch, bool complete)
+{
+    if (fetch.fd >= 0)
+        close(fetch.fd);
+    fetch.fd = -1;
+    fetch.done = true;
+    fetch.complete = complete;
+}
+
+// Advances one fetch after poll() reported activity on its socket. Returns
+// the bytes received.
+static long thumbnail_step(ThumbnailFetch &fetch, short revents)
+{
+    if (fetch.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fetch.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (revents & (POLLERR | POLLHUP)))
+        {
+            thumbnail_close(fetch, false);
+            return 0;
+        }
+        fetch.connecting = false;
+    }
+
+    if (fetch.sent < fetch.request.length())
+    {
+        ssize_t n = send(fetch.fd, fetch.request.data() + fetch.sent, fetch.request.length() - fetch.sent, 0);
+        if (n < 0 && errno != EAGAIN)
+            thumbnail_close(fetch, false);
+        else if (n > 0)
+            fetch.sent += n;
+        return 0;
+    }
+
+    static char buffer[kMaxReadChunk];
+    ssize_t n = recv(fetch.fd, buffer, read_chunk_size(), 0);
+    if (n == 0)
+    {
+        thumbnail_close(fetch, !fetch.data.empty());
+        return 0;
+    }
+    if (n < 0)
+    {
+        if (errno != EAGAIN)
+            thumbnail_close(fetch, false);
+        return 0;
+    }
+
+    fetch.data.append(buffer, n);
+    const unsigned char *bytes = (const unsigned char *)fetch.data.data();
+    bool is_jpeg = bytes[0] == 0xFF && (fetch.data.length() < 2 || bytes[1] == 0xD8);
+    bool is_bmp = bytes[0] == 'B' && (fetch.data.length() < 2 || bytes[1] == 'M');
+    if (!is_jpeg && !is_bmp)
+    {
+        thumbnail_close(fetch, false);
+    }
+    else if (is_jpeg && jpeg_scan_advance(fetch.scan, fetch.data))
+    {
+        // The first scan is a complete low-resolution image: end it there
+        fetch.data.resize(fetch.scan.pos);
+        fetch.data += "\xFF\xD9";
+        thumbnail_close(fetch, true);
+    }
+    else if (fetch.data.length() > (size_t)settings.max_thumbnail_source)
+    {
+        thumbnail_close(fetch, false);
+    }
+    return n;
+}
+
+typedef void (*TileCallback)(int tile);
+
+// Fetches thumbnails for the tiles that are still "loading", at most
+// thumbnail_concurrency at a time. tile_done is called as each one
+// finishes, with or without a thumbnail.
+static void fetch_grid_thumbnails(TileCallback tile_done)
+{
+    std::vector<int> queue;
+    for (size_t i = 0; i < grid.notes.size(); i++)
+    {
+        if (grid.thumbs[i] == NULL && grid.notes[i] != NULL && strcmp(grid.notes[i], "loading") == 0)
+            queue.push_back(i);
+    }
+    if (queue.empty())
+        return;
+
+    if (!radio_begin())
+    {
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            grid.notes[queue[i]] = "offline";
+            tile_done(queue[i]);
+        }
+        return;
+    }
+
+    std::vector<ThumbnailFetch> active;
+    size_t next = 0;
+    long bytes = 0;
+    while (next < queue.size() || !active.empty())
+    {
+        // Keep the pipeline full
+        while (next < queue.size() && (int)active.size() < settings.thumbnail_concurrency)
+        {
+            const GopherItem &item = current_page.items[grid.items[grid.first + queue[next]]];
+            ThumbnailFetch fetch;
+            fetch.tile = queue[next++];
+            fetch.request = item.selector + "\r\n";
+            fetch.sent = 0;
+            fetch.scan.pos = 0;
+            fetch.scan.progressive = false;
+            fetch.scan.in_scan = false;
+            fetch.scan.given_up = false;
+            fetch.deadline = get_current_time_ms() + settings.fanout_timeout * 1000;
+            fetch.done = false;
+            fetch.complete = false;
+            fetch.connecting = true;
+            fetch.fd = connect_nonblocking(item.host.c_str(), item.port);
+            if (fetch.fd < 0)
+                thumbnail_close(fetch, false);
+            active.push_back(fetch);
+        }
+
+        std::vector<struct pollfd> fds;
+        long now = get_current_time_ms();
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            ThumbnailFetch &fetch = active[i];
+            if (!fetch.done && now >= fetch.deadline)
+                thumbnail_close(fetch, false);
+
+            struct pollfd pfd;
+            pfd.fd = fetch.fd;
+            pfd.events = (fetch.connecting || fetch.sent < fetch.request.length()) ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+        }
+
+        // Closed fetches have fd -1, which poll() skips
+        if (poll(&fds[0], fds.size(), 250) > 0)
+        {
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if (fds[i].revents != 0)
+                    bytes += thumbnail_step(active[i], fds[i].revents);
+            }
+        }
+
+        // Decode and paint whatever finished
+        for (size_t i = 0; i < active.size();)
+        {
+            ThumbnailFetch &fetch = active[i];
+            if (!fetch.done)
+            {
+                i++;
+                continue;
+            }
+
+            int tile = fetch.tile;
+            ibitmap *thumb = fetch.complete ? decode_thumbnail(fetch.data) : NULL;
+            if (thumb != NULL)
+                save_thumbnail(thumbnail_key(current_page.items[grid.items[grid.first + tile]]), thumb);
+            grid.thumbs[tile] = thumb;
+            grid.notes[tile] = thumb != NULL ? NULL : "no preview";
+            active.erase(active.begin() + i);
+            tile_done(tile);
+        }
+    }
+
+    radio_end(bytes);
+}
+
+// ============================================================================
+// Offline Mirror
+// ============================================================================
+
+// A site - a menu and the menus and texts below it on the same server - can
+// be saved to the SD card, and is then served from there when the network
+// is down. Updating a mirror fetches its menus again first and compares
+// each menu line with the one stored for the document it leads to; a text
+// is fetched again only if it is new or its line changed. A run stops after
+// mirror_radio_budget seconds of radio time and the next update carries on
+// from there.
+
+struct MirrorDoc
+{
+    char type;
+    unsigned long hash;  // CRC-32 of the body
+    long size;
+    unsigned long entry; // CRC-32 of the menu line that led here, 0 for the root
+};
+
+typedef std::map<std::string, MirrorDoc> MirrorIndex; // By selector
+
+static std::string mirror_report; // Last mirror run, shown as about:mirror
+
+static unsigned long crc_of(const std::string &data)
+{
+    return crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data.data(), data.length());
+}
+
+static std::string mirror_dir(const std::string &host, int port)
+{
+    char name[300];
+    snprintf(name, sizeof(name), "/.mirror-%s-%d", sanitize_filename(host).c_str(), port);
+    return download_dir() + name;
+}
+
+// Each document is a file named by its selector's CRC, starting with the
+// selector itself so a collision reads as a miss
+static std::string mirror_doc_path(const std::string &dir, const std::string &selector)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%08lx.gph", crc_of(selector));
+    return dir + name;
+}
+
+static bool write_mirror_doc(const std::string &dir, const std::string &selector, const std::string &body)
+{
+    FILE *f = fopen(mirror_doc_path(dir, selector).c_str(), "wb");
+    if (f == NULL)
+        return false;
+    fprintf(f, "%s\n", selector.c_str());
+    bool ok = fwrite(body.data(), 1, body.length(), f) == body.length();
+    return fclose(f) == 0 && ok;
+}
+
+static bool read_mirror_doc(const std::string &dir, const std::string &selector, std::string &body)
+{
+    FILE *f = fopen(mirror_doc_path(dir, selector).c_str(), "rb");
+    if (f == NULL)
+        return false;
+
+    std::string header = selector + "\n";
+    std::string found(header.length(), '\0');
+    bool ok = fread(&found[0], 1, found.length(), f) == found.length() && found == header;
+    body.clear();
+    char buffer[4096];
+    size_t n;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        body.append(buffer, n);
+    fclose(f);
+    return ok;
+}
+
+// The index is "root<TAB>selector", then "type hash size entry selector"
+// per document, tab-separated
+static bool load_mirror_index(const std::string &dir, std::string &root, MirrorIndex &index)
+{
+    FILE *f = fopen((dir + "/index").c_str(), "r");
+    if (f == NULL)
+        return false;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        std::string text = trim(line);
+        std::vector<std::string> fields = split(text, '\t');
+        if (fields.size() == 2 && fields[0] == "root")
+        {
+            root = fields[1];
+        }
+        else if (fields.size() == 5 && fields[0].length() == 1)
+        {
+            MirrorDoc &doc = index[fields[4]];
+            doc.type = fields[0][0];
+            doc.hash = strtoul(fields[1].c_str(), NULL, 16);
+            doc.size = atol(fields[2].c_str());
+            doc.entry = strtoul(fields[3].c_str(), NULL, 16);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void save_mirror_index(const std::string &dir, const std::string &root, const MirrorIndex &index)
+{
+    FILE *f = fopen((dir + "/index").c_str(), "w");
+    if (f == NULL)
+        return;
+
+    fprintf(f, "root\t%s\n", root.c_str());
+    for (MirrorIndex::const_iterator it = index.begin(); it != index.end(); ++it)
+    {
+        const MirrorDoc &doc = it->second;
+        fprintf(f, "%c\t%08lx\t%ld\t%08lx\t%s\n", doc.type, doc.hash, doc.size, doc.entry, it->first.c_str());
+    }
+    fclose(f);
+}
+
+static bool mirror_exists(const std::string &host, int port)
+{
+    return access((mirror_dir(host, port) + "/index").c_str(), F_OK) == 0;
+}
+
+// Saved copy of a document, for when the server can't be reached
+static bool mirror_lookup(const char *host, const char *selector, int port, std::string &body)
+{
+    return read_mirror_doc(mirror_dir(host, port), selector, body);
+}
+
+// Menus and texts on the same server under the root selector
+static bool in_mirror_scope(const GopherItem &item, const std::string &host, int port, const std::string &root)
+{
+    if (item.type != GOPHER_MENU && item.type != GOPHER_TEXT)
+        return false;
+    if (item.host != host || item.port != port)
+        return false;
+    return root.empty() || root == "/" || item.selector.compare(0, root.length(), root) == 0;
+}
+
+// Fetches one document into the mirror, keeping the old copy if that fails
+static bool mirror_fetch(const std::string &dir, const std::string &host, int port, const std::string &selector,
+                         char type, unsigned long entry, const MirrorIndex &old_index, MirrorIndex &index,
+                         std::string &body)
+{
+    body = fetch_gopher(host.c_str(), selector.c_str(), port);
+    MirrorIndex::const_iterator old = old_index.find(selector);
+    if (body.empty())
+    {
+        if (old != old_index.end())
+            index[selector] = old->second;
+        return false;
+    }
+
+    MirrorDoc doc;
+    doc.type = type;
+    doc.hash = crc_of(body);
+    doc.size = body.length();
+    doc.entry = entry;
+
+    // Unchanged bodies are not written to the card again
+    if (old != old_index.end() && old->second.hash == doc.hash)
+        index[selector] = doc;
+    else if (write_mirror_doc(dir, selector, body))
+        index[selector] = doc;
+    return true;
+}
+
+// Creates or updates the mirror of the site below root and writes the
+// report shown as about:mirror
+static void mirror_site(const std::string &host, int port, const std::string &root)
+{
+    std::string dir = mirror_dir(host, port);
+    mkdir(dir.c_str(), 0755);
+
+    // A mirror of another part of the site is replaced
+    std::string old_root;
+    MirrorIndex old_index;
+    bool updating = load_mirror_index(dir, old_root, old_index) && old_root == root;
+    if (!updating)
+        old_index.clear();
+
+    MirrorIndex index;
+    std::vector<std::string> menus(1, root);
+    std::vector<std::string> texts;
+    std::map<std::string, unsigned long> entries; // Menu line CRC by selector
+    std::set<std::string> seen;
+    seen.insert(root);
+    entries[root] = 0;
+
+    long radio_start = radio_on_time();
+    long budget = settings.mirror_radio_budget * 1000L;
+    bool out_of_time = false;
+    bool incomplete = false; // A menu could be neither fetched nor read back
+    int menus_fetched = 0, texts_fetched = 0, unchanged = 0, failed = 0, removed = 0;
+    long bytes_fetched = 0, bytes_saved = 0;
+
+    // Menus first: their item lists tell which texts need fetching again
+    for (size_t i = 0; i < menus.size(); i++)
+    {
+        if (radio_on_time() - radio_start > budget)
+        {
+            out_of_time = true;
+            break;
+        }
+
+        // A menu that can't be fetched is walked from its saved copy, so
+        // the documents below it are kept rather than removed
+        std::string body;
+        if (mirror_fetch(dir, host, port, menus[i], GOPHER_MENU, entries[menus[i]], old_index, index, body))
+        {
+            menus_fetched++;
+            bytes_fetched += body.length();
+        }
+        else
+        {
+            failed++;
+            if (!index.count(menus[i]) || !read_mirror_doc(dir, menus[i], body))
+            {
+                incomplete = true;
+                continue;
+            }
+        }
+
+        std::vector<std::string> lines = split(body, '\n');
+        for (size_t j = 0; j < lines.size(); j++)
+        {
+            std::string line = lines[j];
+            if (!line.empty() && line[line.length() - 1] == '\r')
+                line.erase(line.length() - 1);
+            if (line == ".")
+                break;
+
+            GopherItem item = parse_gopher_line(line);
+            if (!in_mirror_scope(item, host, port, root) || (int)seen.size() >= settings.max_mirror_documents ||
+                !seen.insert(item.selector).second)
+                continue;
+
+            entries[item.selector] = crc_of(line);
+            if (item.type == GOPHER_MENU)
+                menus.push_back(item.selector);
+            else
+                texts.push_back(item.selector);
+        }
+    }
+
+    // Then texts that are new or whose menu line changed
+    for (size_t i = 0; i < texts.size() && !out_of_time; i++)
+    {
+        const std::string &selector = texts[i];
+        MirrorIndex::const_iterator old = old_index.find(selector);
+        if (old != old_index.end() && old->second.type == GOPHER_TEXT && old->second.entry == entries[selector] &&
+            access(mirror_doc_path(dir, selector).c_str(), F_OK) == 0)
+        {
+            index[selector] = old->second;
+            unchanged++;
+            bytes_saved += old->second.size;
+            continue;
+        }
+
+        if (radio_on_time() - radio_start > budget)
+        {
+            out_of_time = true;
+            break;
+        }
+
+        std::string body;
+        if (!mirror_fetch(dir, host, port, selector, GOPHER_TEXT, entries[selector], old_index, index, body))
+        {
+            failed++;
+            continue;
+        }
+        texts_fetched++;
+        bytes_fetched += body.length();
+    }
+
+    // Documents no longer linked are removed, unless the run was cut short
+    // or lost a menu and simply didn't get to them
+    for (MirrorIndex::const_iterator it = old_index.begin(); it != old_index.end(); ++it)
+    {
+        if (index.count(it->first))
+            continue;
+        if (out_of_time || incomplete)
+        {
+            index[it->first] = it->second;
+        }
+        else
+        {
+            unlink(mirror_doc_path(dir, it->first).c_str());
+            removed++;
+        }
+    }
+    save_mirror_index(dir, root, index);
+
+    char line[512];
+    std::string report;
+    snprintf(line, sizeof(line), "%s of %s:%d%s\n\n", updating ? "Update" : "Mirror", host.c_str(), port, root.c_str());
+    report += line;
+    snprintf(line, sizeof(line), "Menus fetched: %d\nTexts fetched: %d\nBytes fetched: %ld\n",
+             menus_fetched, texts_fetched, bytes_fetched);
+    report += line;
+    snprintf(line, sizeof(line), "Texts unchanged, not fetched: %d\nBytes saved against a full crawl: %ld (%ld%%)\n",
+             unchanged, bytes_saved,
+             bytes_fetched + bytes_saved > 0 ? bytes_saved * 100 / (bytes_fetched + bytes_saved) : 0L);
+    report += line;
+    snprintf(line, sizeof(line), "Failed: %d\nRemoved: %d\nDocuments in mirror: %d\nRadio time: %ld s of %d s\n",
+             failed, removed, (int)index.size(), (radio_on_time() - radio_start) / 1000, settings.mirror_radio_budget);
+    report += line;
+    if (out_of_time)
+        report += "\nStopped at the radio budget; update again to continue.\n";
+    if ((int)seen.size() >= settings.max_mirror_documents)
+        report += "\nThe site has more documents than max_mirror_documents; the rest were left out.\n";
+    mirror_report = report;
+}
+
+// ============================================================================
+// EPUB Export
+// ============================================================================
+
+// A text document, or every text item of a menu in menu order, is written
+// to one EPUB for the device's own reader. Each chapter streams from the
+// page in memory, the offline mirror or the network through a line sink
+// straight into a deflated ZIP entry, so memory use doesn't grow with the
+// size or number of documents; only the chapter titles are kept for the
+// table of contents written at the end.
+
+struct ZipEntry
+{
+    std::string name;
+    int method;          // 0 = stored, 8 = deflated
+    unsigned long crc;
+    unsigned long packed_size;
+    unsigned long size;
+    unsigned long offset; // Local header
+};
+
+struct ZipWriter
+{
+    FILE *out;
+    std::vector<ZipEntry> entries;
+    z_stream stream;
+    unsigned int dos_time;
+    unsigned int dos_date;
+    bool failed;
+};
+
+static void put16(FILE *f, unsigned int value)
+{
+    fputc(value & 0xFF, f);
+    fputc((value >> 8) & 0xFF, f);
+}
+
+static void put32(FILE *f, unsigned long value)
+{
+    put16(f, value & 0xFFFF);
+    put16(f, (value >> 16) & 0xFFFF);
+}
+
+static bool zip_open(ZipWriter &zip, const std::string &path)
+{
+    zip.out = fopen(path.c_str(), "wb");
+    zip.failed = zip.out == NULL;
+
+    // Without a local time the entries get the DOS epoch, 1980-01-01
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    zip.dos_time = t != NULL ? (t->tm_hour << 11) | (t->tm_min << 5) | (t->tm_sec / 2) : 0;
+    zip.dos_date = t != NULL ? ((t->tm_year - 80) << 9) | ((t->tm_mon + 1) << 5) | t->tm_mday : (1 << 5) | 1;
+    return !zip.failed;
+}
+
+// Writes a local header with the sizes left blank; zip_end_entry fills
+// them in once the data is written
+static void zip_begin_entry(ZipWriter &zip, const std::string &name, int method)
+{
+    ZipEntry entry;
+    entry.name = name;
+    entry.method = method;
+    entry.crc = crc32(0L, Z_NULL, 0);
+    entry.packed_size = 0;
+    entry.size = 0;
+    entry.offset = ftell(zip.out);
+    zip.entries.push_back(entry);
+
+    put32(zip.out, 0x04034b50);
+    put16(zip.out, 20);
+    put16(zip.out, 0);
+    put16(zip.out, method);
+    put16(zip.out, zip.dos_time);
+    put16(zip.out, zip.dos_date);
+    put32(zip.out, 0);
+    put32(zip.out, 0);
+    put32(zip.out, 0);
+    put16(zip.out, name.length());
+    put16(zip.out, 0);
+    fwrite(name.data(), 1, name.length(), zip.out);
+
+    if (method == 8)
+    {
+        memset(&zip.stream, 0, sizeof(zip.stream));
+        if (deflateInit2(&zip.stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            zip.failed = true;
+    }
+}
+
+static void zip_deflate(ZipWriter &zip, const char *data, size_t len, int flush)
+{
+    ZipEntry &entry = zip.entries.back();
+    unsigned char buffer[kInflateChunk];
+    zip.stream.next_in = (Bytef *)data;
+    zip.stream.avail_in = len;
+    int ret;
+    do
+    {
+        zip.stream.next_out = buffer;
+        zip.stream.avail_out = sizeof(buffer);
+        ret = deflate(&zip.stream, flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            zip.failed = true;
+            return;
+        }
+        size_t produced = sizeof(buffer) - zip.stream.avail_out;
+        if (fwrite(buffer, 1, produced, zip.out) != produced)
+            zip.failed = true;
+        entry.packed_size += produced;
+    } while (zip.stream.avail_out == 0);
+
+    if (zip.stream.avail_in != 0 || (flush == Z_FINISH && ret != Z_STREAM_END))
+        zip.failed = true;
+}
+
+static void zip_write(ZipWriter &zip, const char *data, size_t len)
+{
+    if (zip.failed || len == 0)
+        return;
+
+    ZipEntry &entry = zip.entries.back();
+    entry.crc = crc32(entry.crc, (const Bytef *)data, len);
+    entry.size += len;
+    if (entry.method == 8)
+    {
+        zip_deflate(zip, data, len, Z_NO_FLUSH);
+    }
+    else
+    {
+        if (fwrite(data, 1, len, zip.out) != len)
+            zip.failed = true;
+        entry.packed_size += len;
+    }
+}
+
+static void zip_write(ZipWriter &zip, const std::string &data)
+{
+    zip_write(zip, data.data(), data.length());
+}
+
+static void zip_end_entry(ZipWriter &zip)
+{
+    ZipEntry &entry = zip.entries.back();
+    if (entry.method == 8)
+    {
+        if (!zip.failed)
+            zip_deflate(zip, NULL, 0, Z_FINISH);
+        deflateEnd(&zip.stream);
+    }
+
+    // Back-patch CRC and sizes into the local header
+    long end = ftell(zip.out);
+    fseek(zip.out, entry.offset + 14, SEEK_SET);
+    put32(zip.out, entry.crc);
+    put32(zip.out, entry.packed_size);
+    put32(zip.out, entry.size);
+    fseek(zip.out, end, SEEK_SET);
+}
+
+// Writes the central directory and closes the file
+static bool zip_close(ZipWriter &zip)
+{
+    unsigned long directory = ftell(zip.out);
+    for (size_t i = 0; i < zip.entries.size(); i++)
+    {
+        const ZipEntry &entry = zip.entries[i];
+        put32(zip.out, 0x02014b50);
+        put16(zip.out, 20);
+        put16(zip.out, 20);
+        put16(zip.out, 0);
+        put16(zip.out, entry.method);
+        put16(zip.out, zip.dos_time);
+        put16(zip.out, zip.dos_date);
+        put32(zip.out, entry.crc);
+        put32(zip.out, entry.packed_size);
+        put32(zip.out, entry.size);
+        put16(zip.out, entry.name.length());
+        put16(zip.out, 0);
+        put16(zip.out, 0);
+        put16(zip.out, 0);
+        put16(zip.out, 0);
+        put32(zip.out, 0);
+        put32(zip.out, entry.offset);
+        fwrite(entry.name.data(), 1, entry.name.length(), zip.out);
+    }
+    unsigned long directory_size = ftell(zip.out) - directory;
+
+    put32(zip.out, 0x06054b50);
+    put16(zip.out, 0);
+    put16(zip.out, 0);
+    put16(zip.out, zip.entries.size());
+    put16(zip.out, zip.entries.size());
+    put32(zip.out, directory_size);
+    put32(zip.out, directory);
+    put16(zip.out, 0);
+
+    bool ok = !zip.failed && !ferror(zip.out);
+    return fclose(zip.out) == 0 && ok;
+}
+
+// Appends text escaped for XHTML. Bytes that aren't valid UTF-8 are taken
+// as Latin-1, which is what most old gopher text is.
+static void append_xml_text(std::string &out, const std::string &text)
+{
+    for (size_t i = 0; i < text.length(); i++)
+    {
+        unsigned char c = text[i];
+        if (c == '&')
+            out += "&amp;";
+        else if (c == '<')
+            out += "&lt;";
+        else if (c == '>')
+            out += "&gt;";
+        else if (c == '\t')
+            out += ' ';
+        else if (c < 0x20 || c == 0x7F)
+            continue;
+        else if (c < 0x80)
+            out += c;
+        else
+        {
+            size_t length = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0;
+            size_t j = 1;
+            while (length > 0 && j < length && i + j < text.length() && ((unsigned char)text[i + j] & 0xC0) == 0x80)
+                j++;
+            if (length > 0 && j == length)
+            {
+                out.append(text, i, length);
+                i += length - 1;
+            }
+            else
+            {
+                append_utf8(out, c);
+            }
+        }
+    }
+}
+
+// Turns a text response into one XHTML chapter. Hard-wrapped lines are
+// joined into paragraphs so the reader can reflow them; paragraphs with
+// column alignment (runs of spaces) stay preformatted.
+struct EpubChapterSink : public LineSink
+{
+    ZipWriter &zip;
+    std::vector<std::string> paragraph;
+    size_t paragraph_bytes;
+
+    EpubChapterSink(ZipWriter &writer) : zip(writer), paragraph_bytes(0) {}
+
+    void begin() {}
+
+    void flush_paragraph()
+    {
+        if (paragraph.empty())
+            return;
+
+        bool aligned = false;
+        for (size_t i = 0; i < paragraph.size() && !aligned; i++)
+            aligned = paragraph[i].find("   ") != std::string::npos;
+
+        std::string html = aligned ? "<pre>" : "<p>";
+        for (size_t i = 0; i < paragraph.size(); i++)
+        {
+            if (i > 0)
+                html += aligned ? "\n" : " ";
+            append_xml_text(html, aligned ? paragraph[i] : trim(paragraph[i]));
+        }
+        html += aligned ? "</pre>\n" : "</p>\n";
+        zip_write(zip, html);
+
+        paragraph.clear();
+        paragraph_bytes = 0;
+    }
+
+    void handle_line(const std::string &line)
+    {
+        if (trim(line).empty())
+        {
+            flush_paragraph();
+            return;
+        }
+        paragraph.push_back(line);
+        paragraph_bytes += line.length();
+
+        // Text without blank lines still goes out in bounded pieces
+        if (paragraph_bytes > (size_t)kInflateChunk)
+            flush_paragraph();
+    }
+
+    bool finish()
+    {
+        bool ok = LineSink::finish();
+        flush_paragraph();
+        return ok;
+    }
+};
+
+// Streams a saved mirror copy into a sink, skipping its selector line
+static bool stream_mirror_doc(const GopherItem &item, ResponseSink &sink)
+{
+    FILE *f = fopen(mirror_doc_path(mirror_dir(item.host, item.port), item.selector).c_str(), "rb");
+    if (f == NULL)
+        return false;
+
+    char buffer[4096];
+    bool ok = fgets(buffer, sizeof(buffer), f) != NULL && trim(buffer) == item.selector;
+    size_t n;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    {
+        if (!sink.write(buffer, n))
+            break;
+    }
+    fclose(f);
+    return ok;
+}
+
+static std::string epub_chapter_name(size_t index)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "ch%04d.xhtml", (int)index + 1);
+    return name;
+}
+
+// Writes one chapter from the first source that has the document.
+// Returns false if none did.
+static bool export_chapter(ZipWriter &zip, const GopherItem &item, const std::string &title, size_t index)
+{
+    zip_begin_entry(zip, "OEBPS/" + epub_chapter_name(index), 8);
+
+    std::string head = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.1//EN\" \"http://www.w3.org/TR/xhtml11/DTD/xhtml11.dtd\">\n"
+                       "<html xmlns=\"http://www.w3.org/1999/xhtml\"><head><title>";
+    append_xml_text(head, title);
+    head += "</title></head><body>\n<h1>";
+    append_xml_text(head, title);
+    head += "</h1>\n";
+    zip_write(zip, head);
+
+    EpubChapterSink sink(zip);
+    bool ok;
+    if (current_page.type == GOPHER_TEXT && item.host == current_page.host && item.port == current_page.port &&
+        item.selector == current_page.selector && !current_page.raw_text.empty())
+    {
+        sink.write(current_page.raw_text.data(), current_page.raw_text.length());
+        ok = true;
+    }
+    else
+    {
+        ok = stream_mirror_doc(item, sink) ||
+             fetch_gopher_stream(item.host.c_str(), item.selector.c_str(), item.port, sink) > 0;
+    }
+    sink.finish();
+
+    if (!ok)
+        zip_write(zip, "<p>(Not available)</p>\n");
+    zip_write(zip, "</body></html>\n");
+    zip_end_entry(zip);
+    return ok;
+}
+
+// Exports the current text page, or the text items of the current menu.
+// Returns the EPUB's path, or an empty string on failure.
+static std::string export_epub()
+{
+    std::vector<GopherItem> documents;
+    std::vector<std::string> titles;
+    std::string book_title;
+    if (current_page.is_menu)
+    {
+        for (size_t i = 0; i < current_page.items.size(); i++)
+        {
+            if (current_page.items[i].type == GOPHER_TEXT)
+            {
+                documents.push_back(current_page.items[i]);
+                titles.push_back(trim(current_page.items[i].display));
+            }
+        }
+        book_title = current_page.host + current_page.selector;
+    }
+    else
+    {
+        GopherItem item;
+        item.type = GOPHER_TEXT;
+        item.host = current_page.host;
+        item.selector = current_page.selector;
+        item.port = current_page.port;
+        documents.push_back(item);
+        std::string::size_type slash = current_page.selector.find_last_of('/');
+        titles.push_back(slash == std::string::npos ? current_page.selector : current_page.selector.substr(slash + 1));
+        book_title = titles[0];
+    }
+    if (documents.empty())
+        return "";
+
+    std::string file_name = current_page.selector;
+    while (!file_name.empty() && file_name[file_name.length() - 1] == '/')
+        file_name.erase(file_name.length() - 1);
+    if (file_name.empty())
+        file_name = current_page.host;
+
+    std::string path = download_dir() + "/" + sanitize_filename(file_name) + ".epub";
+    ZipWriter zip;
+    if (!zip_open(zip, path))
+        return "";
+
+    // The mimetype comes first and uncompressed so readers can sniff it
+    zip_begin_entry(zip, "mimetype", 0);
+    zip_write(zip, "application/epub+zip");
+    zip_end_entry(zip);
+
+    zip_begin_entry(zip, "META-INF/container.xml", 8);
+    zip_write(zip, "<?xml version=\"1.0\"?>\n"
+                   "<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n"
+                   "<rootfiles><rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/></rootfiles>\n"
+                   "</container>\n");
+    zip_end_entry(zip);
+
+    int exported = 0;
+    for (size_t i = 0; i < documents.size(); i++)
+    {
+        char status[64];
+        snprintf(status, sizeof(status), "Exporting %d of %d...", (int)i + 1, (int)documents.size());
+        set_status(status);
+        if (export_chapter(zip, documents[i], titles[i], i))
+            exported++;
+    }
+
+    // Package and table of contents, in menu order
+    std::string xml_title;
+    append_xml_text(xml_title, book_title);
+    std::string uid = "urn:gopher:";
+    append_xml_text(uid, current_page.host + current_page.selector);
+
+    std::string opf = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                      "<package xmlns=\"http://www.idpf.org/2007/opf\" version=\"2.0\" unique-identifier=\"uid\">\n"
+                      "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\">\n"
+                      "<dc:title>" + xml_title + "</dc:title>\n"
+                      "<dc:identifier id=\"uid\">" + uid + "</dc:identifier>\n"
+                      "<dc:language>en</dc:language>\n</metadata>\n<manifest>\n"
+                      "<item id=\"ncx\" href=\"toc.ncx\" media-type=\"application/x-dtbncx+xml\"/>\n";
+    std::string spine = "<spine toc=\"ncx\">\n";
+    std::string ncx = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                      "<ncx xmlns=\"http://www.daisy.org/z3986/2005/ncx/\" version=\"2005-1\">\n"
+                      "<head><meta name=\"dtb:uid\" content=\"" + uid + "\"/></head>\n"
+                      "<docTitle><text>" + xml_title + "</text></docTitle>\n<navMap>\n";
+    for (size_t i = 0; i < documents.size(); i++)
+    {
+        char id[16];
+        snprintf(id, sizeof(id), "c%d", (int)i + 1);
+        std::string name = epub_chapter_name(i);
+        std::string title;
+        append_xml_text(title, titles[i]);
+
+        opf += std::string("<item id=\"") + id + "\" href=\"" + name + "\" media-type=\"application/xhtml+xml\"/>\n";
+        spine += std::string("<itemref idref=\"") + id + "\"/>\n";
+        char order[16];
+        snprintf(order, sizeof(order), "%d", (int)i + 1);
+        ncx += std::string("<navPoint id=\"") + id + "\" playOrder=\"" + order + "\"><navLabel><text>" + title +
+               "</text></navLabel><content src=\"" + name + "\"/></navPoint>\n";
+    }
+    opf += "</manifest>\n" + spine + "</spine>\n</package>\n";
+    ncx += "</navMap>\n</ncx>\n";
+
+    zip_begin_entry(zip, "OEBPS/content.opf", 8);
+    zip_write(zip, opf);
+    zip_end_entry(zip);
+    zip_begin_entry(zip, "OEBPS/toc.ncx", 8);
+    zip_write(zip, ncx);
+    zip_end_entry(zip);
+
+    set_status("");
+    if (!zip_close(zip) || exported == 0)
+    {
+        unlink(path.c_str());
+        return "";
+    }
+    return path;
+}
+
+// ============================================================================
+// Stats Page
+// ============================================================================
+
+// about:stats lists what the memory governor, transport and radio policy
+// have been doing this session, for tuning on the device.
+
+static void add_stat(std::string &menu, const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    GopherItem item;
+    item.type = GOPHER_INFO;
+    item.display = text;
+    item.port = 0;
+    menu += menu_line(item);
+}
+
+static std::string benchmark_report; // Last self-benchmark, shown as about:benchmark
+
+static std::string stats_page()
+{
+    std::string menu;
+
+    add_stat(menu, "Memory");
+    add_stat(menu, "  RSS %s, available %s", format_size(memory_stats.rss).c_str(),
+             memory_stats.available >= 0 ? format_size(memory_stats.available).c_str() : "?");
+    add_stat(menu, "  Sheds: %d soft, %d hard, %s released", memory_stats.soft_sheds,
+             memory_stats.hard_sheds, format_size(memory_stats.bytes_shed).c_str());
+    for (size_t i = 0; i < memory_consumers.size(); i++)
+    {
+        add_stat(menu, "  %-14s %s", memory_consumers[i].name,
+                 format_size(memory_consumers[i].usage()).c_str());
+    }
+    add_stat(menu, "");
+
+    add_stat(menu, "Transport");
+    add_stat(menu, "  %ld fetches, %s received", transport.fetches, format_size(transport.bytes).c_str());
+    add_stat(menu, "  recv calls per MB: %.0f",
+             transport.bytes > 0 ? transport.recv_calls * 1048576.0 / transport.bytes : 0.0);
+    add_stat(menu, "  Last fetch: first byte %ld ms, last byte %ld ms", transport.last_ttfb, transport.last_ttlb);
+    add_stat(menu, "  BDP %s, read chunk %s, Fast Open %s", format_size(transport.bdp).c_str(),
+             format_size(read_chunk_size()).c_str(), transport.fast_open ? "on" : "off");
+    add_stat(menu, "  Progress footer: %ld redraws, %ld ms", progress.draws, progress.draw_time);
+    add_stat(menu, "");
+
+    long on_time = radio_on_time();
+    add_stat(menu, "Radio");
+    add_stat(menu, "  %s, on for %ld:%02ld this session", radio.on ? "Up" : "Down",
+             on_time / 60000, (on_time / 1000) % 60);
+    add_stat(menu, "  %ld wake-ups, %s received", radio.wakeups, format_size(radio.bytes).c_str());
+    add_stat(menu, "");
+
+    pthread_mutex_lock(&persist_lock);
+    PersistStats persisted = persist_stats;
+    int depth = persist_queue.size();
+    pthread_mutex_unlock(&persist_lock);
+    add_stat(menu, "Persistence (%s)", persist_running ? "background writer" : "synchronous");
+    add_stat(menu, "  Queue depth %d, max %d; %ld writers waited", depth, persisted.max_depth, persisted.waits);
+    add_stat(menu, "  %ld writes, %ld merged, %s in %ld batches, %ld fsyncs, %ld failed", persisted.jobs,
+             persisted.coalesced, format_size(persisted.bytes).c_str(), persisted.batches, persisted.fsyncs,
+             persisted.failures);
+    add_stat(menu, "  Batch write latency: last %ld ms, avg %ld ms, max %ld ms", persisted.last_latency,
+             persisted.batches > 0 ? persisted.total_latency / persisted.batches : 0L, persisted.max_latency);
+    add_stat(menu, "");
+
+    add_stat(menu, "Settings (%s)", settings_path.empty() ? "defaults, no file" : settings_path.c_str());
+    for (int i = 0; i < kTunableCount; i++)
+    {
+        const Tunable &tunable = kTunables[i];
+        if (*tunable.value == tunable.default_value)
+            add_stat(menu, "  %s = %d", tunable.name, *tunable.value);
+        else
+            add_stat(menu, "  %s = %d (default %d)", tunable.name, *tunable.value, tunable.default_value);
+    }
+    for (size_t i = 0; i < settings_warnings.size(); i++)
+    {
+        add_stat(menu, "  ! %s", settings_warnings[i].c_str());
+    }
+
+    return menu;
+}
+
+static std::string about_page(const std::string &selector)
+{
+    if (selector == "benchmark")
+        return benchmark_report;
+    if (selector == "mirror")
+        return mirror_report;
+    return stats_page();
+}
+
+// ============================================================================
+// Item Types
+// ============================================================================
+
+// Everything that depends on an item's type is looked up in one table: the
+// prefix shown in menus, whether it can be followed, how it is viewed and
+// the sink its response streams into.
+
+enum ItemViewer
+{
+    VIEW_NONE,        // Info lines, errors and sessions that can't be opened
+    VIEW_PAGE,        // Streamed into the current page
+    VIEW_SEARCH,      // Asks for a query; results are a menu
+    VIEW_DOWNLOAD,    // Saved to the download directory
+    VIEW_IMAGE,       // Fetched and shown full screen
+    VIEW_UNSUPPORTED, // A link, but nothing on the device can show it
+};
+
+typedef ResponseSink *(*PageSinkFactory)(GopherPage &page);
+typedef DownloadSink *(*DownloadSinkFactory)(const GopherItem &item);
+
+struct ItemTypeHandler
+{
+    char type;
+    const char *prefix;                // Shown before the display text
+    const char *name;                  // Label in the type filter
+    bool selectable;
+    ItemViewer viewer;
+    PageSinkFactory page_sink;         // VIEW_PAGE
+    DownloadSinkFactory download_sink; // VIEW_DOWNLOAD and VIEW_IMAGE
+};
+
+static ResponseSink *make_menu_sink(GopherPage &page)
+{
+    return new MenuSink(page);
+}
+
+static ResponseSink *make_text_sink(GopherPage &page)
+{
+    return new TextSink(page);
+}
+
+static ResponseSink *make_html_sink(GopherPage &page)
+{
+    return new HtmlSink(page);
+}
+
+static DownloadSink *make_file_sink(const GopherItem &item)
+{
+    return new FileSink(selector_filename(item.selector));
+}
+
+static DownloadSink *make_uudecode_sink(const GopherItem &item)
+{
+    return new UudecodeSink(selector_filename(item.selector));
+}
+
+static DownloadSink *make_binhex_sink(const GopherItem &/*item*/)
+{
+    return new BinhexSink();
+}
+
+static DownloadSink *make_image_sink(const GopherItem &/*item*/)
+{
+    return new ImageSink();
+}
+
+static const ItemTypeHandler kItemTypeHandlers[] = {
+    {GOPHER_TEXT, "[T]", "Text files", true, VIEW_PAGE, make_text_sink, NULL},
+    {GOPHER_MENU, "[D]", "Directories", true, VIEW_PAGE, make_menu_sink, NULL},
+    {GOPHER_CSO, "[?]", "Other", false, VIEW_NONE, NULL, NULL},
+    {GOPHER_ERROR, "[E]", "Other", false, VIEW_NONE, NULL, NULL},
+    {GOPHER_BINHEX, "[?]", "Encoded files", true, VIEW_DOWNLOAD, NULL, make_binhex_sink},
+    {GOPHER_DOS, "[?]", "Binaries", true, VIEW_DOWNLOAD, NULL, make_file_sink},
+    {GOPHER_UUENCODE, "[?]", "Encoded files", true, VIEW_DOWNLOAD, NULL, make_uudecode_sink},
+    {GOPHER_SEARCH, "[?]", "Searches", true, VIEW_SEARCH, NULL, NULL},
+    {GOPHER_TELNET, "[?]", "Other", false, VIEW_NONE, NULL, NULL},
+    {GOPHER_BINARY, "[B]", "Binaries", true, VIEW_DOWNLOAD, NULL, make_file_sink},
+    {GOPHER_REDUNDANT, "[?]", "Other", false, VIEW_NONE, NULL, NULL},
+    {GOPHER_TN3270, "[?]", "Other", false, VIEW_NONE, NULL, NULL},
+    {GOPHER_GIF, "[I]", "Images", true, VIEW_IMAGE, NULL, make_image_sink},
+    {GOPHER_IMAGE, "[I]", "Images", true, VIEW_IMAGE, NULL, make_image_sink},
+    {GOPHER_INFO, "   ", "Info lines", false, VIEW_NONE, NULL, NULL},
+    {GOPHER_HTML, "[H]", "HTML", true, VIEW_PAGE, make_html_sink, NULL},
+    {GOPHER_SOUND, "[S]", "Sounds", true, VIEW_UNSUPPORTED, NULL, NULL},
+};
+
+static const int kItemTypeHandlerCount = sizeof(kItemTypeHandlers) / sizeof(kItemTypeHandlers[0]);
+
+// Unknown types are tried as menus
+static const ItemTypeHandler kFallbackHandler = {0, "[?]", "Other", true, VIEW_PAGE, make_menu_sink, NULL};
+
+static const ItemTypeHandler *find_handler(char type)
+{
+    for (int i = 0; i < kItemTypeHandlerCount; i++)
+    {
+        if (kItemTypeHandlers[i].type == type)
+            return &kItemTypeHandlers[i];
+    }
+    return &kFallbackHandler;
+}
+
+bool GopherItem::is_selectable() const
+{
+    return find_handler(type)->selectable;
+}
+
+// Loads a page through the sink for its type. Network responses stream
+// straight into the sink, after any prefix a peek left behind, with the
+// offline mirror as a fallback; archive listings and searches are
+// generated and fed in whole, as are about: pages. Returns false if
+// nothing arrived.
+static bool load_page(const char *host, const char *selector, int port, char type, GopherPage &page)
+{
+    const ItemTypeHandler *handler = find_handler(type);
+    if (handler->page_sink == NULL)
+        handler = find_handler(GOPHER_MENU);
+    ResponseSink *sink = handler->page_sink(page);
+
+    long received;
+    if (strcmp(host, kArchiveHost) == 0 || strcmp(host, kAboutHost) == 0 ||
+        is_search_selector(host, selector))
+    {
+        std::string response;
+        if (strcmp(host, kArchiveHost) == 0)
+            response = archive_page(selector);
+        else if (strcmp(host, kAboutHost) == 0)
+            response = about_page(selector);
+        else
+            response = cached_search(host, selector, port, page);
+        received = response.length();
+        if (received > 0)
+            sink->write(response.data(), response.length());
+    }
+    else
+    {
+        PrefixEntry prefix;
+        if (prefix_cache_take(search_cache_key(host, port, selector), prefix))
+        {
+            // Peeked before: show the start now, fetch only to complete it
+            sink->write(prefix.data.data(), prefix.data.length());
+            received = prefix.data.length();
+            if (!prefix.complete)
+            {
+                page.host = host;
+                page.selector = selector;
+                page.port = port;
+                set_status("Loading...");
+                draw_staged_page(page);
+
+                SkipPrefixSink rest(*sink, prefix.data);
+                received = fetch_gopher_stream(host, selector, port, rest);
+                if (rest.diverged || (received >= 0 && rest.matched < prefix.data.length()))
+                {
+                    // Changed since the peek: start over without the prefix
+                    delete sink;
+                    sink = handler->page_sink(page);
+                    received = fetch_gopher_stream(host, selector, port, *sink);
+                }
+            }
+        }
+        else
+        {
+            received = fetch_gopher_stream(host, selector, port, *sink);
+        }
+
+        // Unreachable: fall back to an offline mirror of the site
+        std::string saved;
+        if (received < 0 && mirror_lookup(host, selector, port, saved))
+        {
+            delete sink;
+            sink = handler->page_sink(page);
+            sink->write(saved.data(), saved.length());
+            received = saved.length();
+        }
+    }
+
+    bool ok = received > 0 && sink->finish();
+    delete sink;
+    if (!ok)
+        return false;
+
+    page.host = host;
+    page.selector = selector;
+    page.port = port;
+    page.type = type;
+    return true;
+}
+
+// Builds a page in staging_page and swaps it in only once it is complete,
+// so a failed load leaves the current page, position and history as they
+// were. The old page's memory is released after the swap.
+static bool load_into_current(const char *host, const char *selector, int port, char type)
+{
+    progress_begin(staging_page);
+    bool ok = load_page(host, selector, port, type, staging_page);
+    progress_end();
+    if (ok)
+    {
+        layout_worker_cancel();
+        current_page.swap(staging_page);
+    }
+    GopherPage().swap(staging_page);
+    return ok;
+}
+
+// Fetches an item into a download sink, reporting failures
+static bool fetch_download(const GopherItem &item, DownloadSink &sink)
+{
+    set_status("Downloading...");
+    is_loading = true;
+    long received = fetch_gopher_stream(item.host.c_str(), item.selector.c_str(), item.port, sink);
+    is_loading = false;
+
+    bool ok = sink.finish();
+    set_status("");
+
+    if (received < 0 || !ok)
+    {
+        char msg[512];
+        if (received < 0)
+            snprintf(msg, sizeof(msg), "Download failed: %s", status_message);
+        else
+            snprintf(msg, sizeof(msg), "Download failed: %s", sink.error.empty() ? "write error" : sink.error.c_str());
+        Message(ICON_WARNING, "Gopher Browser", msg, 3000);
+        return false;
+    }
+    return true;
+}
+
+// Saves an item; returns true if it is an archive to open in the browser
+static bool download_item(const GopherItem &item, DownloadSink &sink, std::string &archive_path)
+{
+    if (!fetch_download(item, sink))
+        return false;
+
+    MappedFile file;
+    if (map_file(sink.out.path, file))
+    {
+        bool is_archive = is_zip_file(file) || is_tar_file(file);
+        unmap_file(file);
+        if (is_archive)
+        {
+            archive_path = sink.out.path;
+            return true;
+        }
+    }
+
+    char msg[512];
+    snprintf(msg, sizeof(msg), "Saved %s", sink.out.path.c_str());
+    Message(ICON_INFORMATION, "Gopher Browser", msg, 3000);
+    return false;
+}
+
+static void close_image()
+{
+    if (viewed_image != NULL)
+    {
+        free(viewed_image);
+        viewed_image = NULL;
+    }
+}
+
+// Fetches an image and shows it until the next key press or tap
+static void show_image(const GopherItem &item, DownloadSink &sink)
+{
+    if (!fetch_download(item, sink))
+        return;
+
+    unsigned char magic[2] = {0, 0};
+    FILE *f = fopen(sink.out.path.c_str(), "rb");
+    if (f != NULL)
+    {
+        if (fread(magic, 1, 2, f) != 2)
+            magic[0] = 0;
+        fclose(f);
+    }
+
+    close_image();
+    if (magic[0] == 0xFF && magic[1] == 0xD8)
+        viewed_image = LoadJPEG(sink.out.path.c_str(), ScreenWidth(), ScreenHeight(), 100, 100, 1);
+    else if (magic[0] == 'B' && magic[1] == 'M')
+        viewed_image = LoadBitmap(sink.out.path.c_str());
+    unlink(sink.out.path.c_str());
+
+    if (viewed_image == NULL)
+        Message(ICON_WARNING, "Gopher Browser", "Cannot decode image", 2000);
+}
+
+// ============================================================================
+// Page Snapshots
+// ============================================================================
+
+// A parsed and laid out page frozen to bytes, so it comes back without
+// fetching, parsing or wrapping it again (warm start now; history, tabs and
+// a page cache can share the format). A snapshot is a header, fixed-width
+// columns found through the header's section table, and a string heap the
+// columns point into by (offset, length). There are no pointers, so a
+// mapped file is read in place; sections are 4-byte aligned for that.
+// Integers are in the device's byte order, which the magic number checks.
+// A CRC-32 covers everything after the header, and snapshot_open() checks
+// every offset and index, so a damaged file is rejected as a whole. Only
+// what can't be derived is kept: a text page's lines, not its raw text,
+// which export fetches again (as after the memory governor shed it).
+
+static const unsigned int kSnapshotMagic = 0x4E535047; // "GPSN" on a little-endian device
+static const unsigned int kSnapshotVersion = 2;
+
+enum SnapshotSection
+{
+    SNAP_TYPES,       // char per item
+    SNAP_DISPLAY,     // SnapshotRef per item
+    SNAP_SELECTOR,    // SnapshotRef per item
+    SNAP_HOST,        // SnapshotRef per item, equal hosts share heap bytes
+    SNAP_PORTS,       // int per item
+    SNAP_TOC,         // SnapshotToc
+    SNAP_LINKS,       // SnapshotLink
+    SNAP_BY_DISPLAY,  // Sort permutations, item indices
+    SNAP_BY_HOST,
+    SNAP_VIEW,        // Active view, position -> item
+    SNAP_LAYOUTS,     // SnapshotLayout
+    SNAP_LAYOUT_ROWS, // Rows and first rows of all layouts
+    SNAP_HEAP,        // String bytes
+    SNAP_SECTIONS
+};
+
+enum SnapshotFlags
+{
+    SNAP_MENU = 1,
+    SNAP_PREFORMATTED = 2,
+    SNAP_VIEW_ACTIVE = 4,
+    SNAP_INDEXED = 8, // type_index was built; rebuilt from SNAP_TYPES
+};
+
+struct SnapshotRef
+{
+    unsigned int offset; // Into SNAP_HEAP
+    unsigned int length;
+};
+
+struct SnapshotSpan
+{
+    unsigned int offset; // From the start of the snapshot
+    unsigned int count;  // Elements
+};
+
+struct SnapshotToc
+{
+    int line;
+    SnapshotRef title;
+};
+
+struct SnapshotLink
+{
+    int item;
+    unsigned int start;
+    unsigned int length;
+};
+
+struct SnapshotLayout
+{
+    int font_size;
+    int columns;
+    int next_item;
+    int known_items;
+    int known_rows;
+    unsigned int rows;      // First of the layout's entries in SNAP_LAYOUT_ROWS
+    unsigned int first_row; // Likewise, if first_rows is set
+    unsigned int first_rows;
+};
+
+struct SnapshotHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;     // Whole snapshot
+    unsigned int checksum; // CRC-32 of the bytes after the header
+    SnapshotRef host;
+    SnapshotRef selector;
+    int port;
+    int type;
+    int flags; // SnapshotFlags
+    int pan_column;
+    int view_type;
+    int view_sort;
+    int scroll_offset; // Reading position when the snapshot was taken
+    int scroll_row;
+    int selected_index;
+    SnapshotSpan sections[SNAP_SECTIONS];
+};
+
+static const unsigned int kSnapshotElementSize[SNAP_SECTIONS] = {
+    sizeof(char), sizeof(SnapshotRef), sizeof(SnapshotRef), sizeof(SnapshotRef), sizeof(int), sizeof(SnapshotToc),
+    sizeof(SnapshotLink), sizeof(int), sizeof(int), sizeof(int), sizeof(SnapshotLayout), sizeof(int), sizeof(char),
+};
+
+// A checked snapshot; data stays owned by the caller (usually a mapping)
+struct PageSnapshot
+{
+    const unsigned char *data;
+    size_t size;
+    const SnapshotHeader *header;
+};
+
+static SnapshotRef snapshot_string(std::string &heap, const std::string &text)
+{
+    SnapshotRef ref;
+    ref.offset = heap.length();
+    ref.length = text.length();
+    heap += text;
+    return ref;
+}
+
+// Appends a column, 4-byte aligned, and records it in the section table
+static void snapshot_column(std::string &out, SnapshotHeader &header, int section, const void *data, size_t count)
+{
+    while (out.length() % 4 != 0)
+        out += '\0';
+    header.sections[section].offset = out.length();
+    header.sections[section].count = count;
+    if (count > 0)
+        out.append((const char *)data, count * kSnapshotElementSize[section]);
+}
+
+static void snapshot_ints(std::string &out, SnapshotHeader &header, int section, const std::vector<int> &values)
+{
+    snapshot_column(out, header, section, values.empty() ? NULL : &values[0], values.size());
+}
+
+// Serializes a page and the reading position in it
+static std::string snapshot_page(const GopherPage &page, int scroll_offset, int scroll_row, int selected_index)
+{
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    std::string heap;
+
+    header.magic = kSnapshotMagic;
+    header.version = kSnapshotVersion;
+    header.host = snapshot_string(heap, page.host);
+    header.selector = snapshot_string(heap, page.selector);
+    header.port = page.port;
+    header.type = (unsigned char)page.type;
+    header.flags = (page.is_menu ? SNAP_MENU : 0) | (page.preformatted ? SNAP_PREFORMATTED : 0) |
+                   (page.view_active ? SNAP_VIEW_ACTIVE : 0) | (page.type_index.empty() ? 0 : SNAP_INDEXED);
+    header.pan_column = page.pan_column;
+    header.view_type = (unsigned char)page.view_type;
+    header.view_sort = page.view_sort;
+    header.scroll_offset = scroll_offset;
+    header.scroll_row = scroll_row;
+    header.selected_index = selected_index;
+
+    size_t count = page.items.size();
+    std::string types(count, '\0');
+    std::vector<SnapshotRef> display(count), selector(count), host(count);
+    std::vector<int> ports(count);
+    std::map<std::string, SnapshotRef> hosts;
+    for (size_t i = 0; i < count; i++)
+    {
+        const GopherItem &item = page.items[i];
+        types[i] = item.type;
+        display[i] = snapshot_string(heap, item.display);
+        selector[i] = snapshot_string(heap, item.selector);
+        std::map<std::string, SnapshotRef>::iterator it = hosts.find(item.host);
+        if (it == hosts.end())
+            it = hosts.insert(std::make_pair(item.host, snapshot_string(heap, item.host))).first;
+        host[i] = it->second;
+        ports[i] = item.port;
+    }
+
+    std::vector<SnapshotToc> toc(page.toc.size());
+    for (size_t i = 0; i < toc.size(); i++)
+    {
+        toc[i].line = page.toc[i].line;
+        toc[i].title = snapshot_string(heap, page.toc[i].title);
+    }
+
+    std::vector<SnapshotLink> links(page.links.size());
+    for (size_t i = 0; i < links.size(); i++)
+    {
+        links[i].item = page.links[i].item;
+        links[i].start = page.links[i].start;
+        links[i].length = page.links[i].length;
+    }
+
+    std::vector<SnapshotLayout> layouts(page.layouts.size());
+    std::vector<int> layout_rows;
+    for (size_t i = 0; i < layouts.size(); i++)
+    {
+        const PageLayout &layout = page.layouts[i];
+        layouts[i].font_size = layout.font_size;
+        layouts[i].columns = layout.columns;
+        layouts[i].next_item = layout.next_item;
+        layouts[i].known_items = layout.known_items;
+        layouts[i].known_rows = layout.known_rows;
+        layouts[i].rows = layout_rows.size();
+        layout_rows.insert(layout_rows.end(), layout.rows.begin(), layout.rows.end());
+        layouts[i].first_row = layout_rows.size();
+        layouts[i].first_rows = layout.first_row.size();
+        layout_rows.insert(layout_rows.end(), layout.first_row.begin(), layout.first_row.end());
+    }
+
+    std::string out(sizeof(header), '\0');
+    snapshot_column(out, header, SNAP_TYPES, types.data(), count);
+    snapshot_column(out, header, SNAP_DISPLAY, count > 0 ? &display[0] : NULL, count);
+    snapshot_column(out, header, SNAP_SELECTOR, count > 0 ? &selector[0] : NULL, count);
+    snapshot_column(out, header, SNAP_HOST, count > 0 ? &host[0] : NULL, count);
+    snapshot_ints(out, header, SNAP_PORTS, ports);
+    snapshot_column(out, header, SNAP_TOC, toc.empty() ? NULL : &toc[0], toc.size());
+    snapshot_column(out, header, SNAP_LINKS, links.empty() ? NULL : &links[0], links.size());
+    snapshot_ints(out, header, SNAP_BY_DISPLAY, page.by_display);
+    snapshot_ints(out, header, SNAP_BY_HOST, page.by_host);
+    snapshot_ints(out, header, SNAP_VIEW, page.view);
+    snapshot_column(out, header, SNAP_LAYOUTS, layouts.empty() ? NULL : &layouts[0], layouts.size());
+    snapshot_ints(out, header, SNAP_LAYOUT_ROWS, layout_rows);
+    snapshot_column(out, header, SNAP_HEAP, heap.data(), heap.length());
+
+    header.size = out.length();
+    header.checksum = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)out.data() + sizeof(header),
+                            out.length() - sizeof(header));
+    memcpy(&out[0], &header, sizeof(header));
+    return out;
+}
+
+static const void *snapshot_section(const PageSnapshot &snap, int section)
+{
+    return snap.data + snap.header->sections[section].offset;
+}
+
+static unsigned int snapshot_count(const PageSnapshot &snap, int section)
+{
+    return snap.header->sections[section].count;
+}
+
+static const int *snapshot_int_column(const PageSnapshot &snap, int section)
+{
+    return (const int *)snapshot_section(snap, section);
+}
+
+static const SnapshotRef *snapshot_ref_column(const PageSnapshot &snap, int section)
+{
+    return (const SnapshotRef *)snapshot_section(snap, section);
+}
+
+// Bytes of a heap string, in place
+static const char *snapshot_text(const PageSnapshot &snap, const SnapshotRef &ref)
+{
+    return (const char *)snapshot_section(snap, SNAP_HEAP) + ref.offset;
+}
+
+static std::string snapshot_text_string(const PageSnapshot &snap, const SnapshotRef &ref)
+{
+    return std::string(snapshot_text(snap, ref), ref.length);
+}
+
+static bool snapshot_ref_ok(const PageSnapshot &snap, const SnapshotRef &ref)
+{
+    unsigned int heap = snapshot_count(snap, SNAP_HEAP);
+    return ref.offset <= heap && ref.length <= heap - ref.offset;
+}
+
+static bool snapshot_refs_ok(const PageSnapshot &snap, int section)
+{
+    const SnapshotRef *refs = snapshot_ref_column(snap, section);
+    for (unsigned int i = 0; i < snapshot_count(snap, section); i++)
+    {
+        if (!snapshot_ref_ok(snap, refs[i]))
+            return false;
+    }
+    return true;
+}
+
+static bool snapshot_indices_ok(const PageSnapshot &snap, int section, unsigned int limit)
+{
+    const int *values = snapshot_int_column(snap, section);
+    for (unsigned int i = 0; i < snapshot_count(snap, section); i++)
+    {
+        if (values[i] < 0 || (unsigned int)values[i] >= limit)
+            return false;
+    }
+    return true;
+}
+
+// Checks a snapshot in place; nothing is copied or allocated
+static bool snapshot_open(const unsigned char *data, size_t size, PageSnapshot &snap)
+{
+    snap.data = data;
+    snap.size = size;
+    snap.header = (const SnapshotHeader *)data;
+    if (data == NULL || size < sizeof(SnapshotHeader) || (size_t)data % 4 != 0)
+        return false;
+
+    const SnapshotHeader &header = *snap.header;
+    if (header.magic != kSnapshotMagic || header.version != kSnapshotVersion || header.size != size)
+        return false;
+    if (header.checksum != crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data + sizeof(header), size - sizeof(header)))
+        return false;
+
+    for (int i = 0; i < SNAP_SECTIONS; i++)
+    {
+        const SnapshotSpan &span = header.sections[i];
+        if (span.offset < sizeof(header) || span.offset > size || span.offset % 4 != 0 ||
+            span.count > (size - span.offset) / kSnapshotElementSize[i])
+            return false;
+    }
+
+    unsigned int count = snapshot_count(snap, SNAP_TYPES);
+    if (snapshot_count(snap, SNAP_DISPLAY) != count || snapshot_count(snap, SNAP_SELECTOR) != count ||
+        snapshot_count(snap, SNAP_HOST) != count || snapshot_count(snap, SNAP_PORTS) != count)
+        return false;
+    if (!snapshot_ref_ok(snap, header.host) || !snapshot_ref_ok(snap, header.selector) ||
+        !snapshot_refs_ok(snap, SNAP_DISPLAY) || !snapshot_refs_ok(snap, SNAP_SELECTOR) ||
+        !snapshot_refs_ok(snap, SNAP_HOST))
+        return false;
+    if (!snapshot_indices_ok(snap, SNAP_BY_DISPLAY, count) || !snapshot_indices_ok(snap, SNAP_BY_HOST, count) ||
+        !snapshot_indices_ok(snap, SNAP_VIEW, count))
+        return false;
+
+    const SnapshotToc *toc = (const SnapshotToc *)snapshot_section(snap, SNAP_TOC);
+    for (unsigned int i = 0; i < snapshot_count(snap, SNAP_TOC); i++)
+    {
+        if (toc[i].line < 0 || (unsigned int)toc[i].line >= count || !snapshot_ref_ok(snap, toc[i].title))
+            return false;
+    }
+
+    const SnapshotRef *display = snapshot_ref_column(snap, SNAP_DISPLAY);
+    const SnapshotLink *links = (const SnapshotLink *)snapshot_section(snap, SNAP_LINKS);
+    for (unsigned int i = 0; i < snapshot_count(snap, SNAP_LINKS); i++)
+    {
+        if (links[i].item < 0 || (unsigned int)links[i].item >= count)
+            return false;
+        unsigned int length = display[links[i].item].length;
+        if (links[i].start > length || links[i].length > length - links[i].start)
+            return false;
+    }
+
+    // Layouts hold a row count per item, and a prefix sum once complete
+    unsigned int rows = snapshot_count(snap, SNAP_LAYOUT_ROWS);
+    const SnapshotLayout *layouts = (const SnapshotLayout *)snapshot_section(snap, SNAP_LAYOUTS);
+    for (unsigned int i = 0; i < snapshot_count(snap, SNAP_LAYOUTS); i++)
+    {
+        const SnapshotLayout &layout = layouts[i];
+        if (layout.next_item < 0 || (unsigned int)layout.next_item > count || layout.columns <= 0)
+            return false;
+        if (layout.rows > rows || count > rows - layout.rows)
+            return false;
+        if (layout.first_rows != 0 && layout.first_rows != count + 1)
+            return false;
+        if (layout.first_row > rows || layout.first_rows > rows - layout.first_row)
+            return false;
+    }
+    const int *values = snapshot_int_column(snap, SNAP_LAYOUT_ROWS);
+    for (unsigned int i = 0; i < rows; i++)
+    {
+        if (values[i] < 0)
+            return false;
+    }
+    return true;
+}
+
+// Rebuilds a page from a checked snapshot
+static void snapshot_restore(const PageSnapshot &snap, GopherPage &page)
+{
+    const SnapshotHeader &header = *snap.header;
+    clear_page(page, (header.flags & SNAP_MENU) != 0);
+    page.host = snapshot_text_string(snap, header.host);
+    page.selector = snapshot_text_string(snap, header.selector);
+    page.port = header.port;
+    page.type = header.type;
+    page.preformatted = (header.flags & SNAP_PREFORMATTED) != 0;
+    page.pan_column = header.pan_column;
+
+    unsigned int count = snapshot_count(snap, SNAP_TYPES);
+    const char *types = (const char *)snapshot_section(snap, SNAP_TYPES);
+    const SnapshotRef *display = snapshot_ref_column(snap, SNAP_DISPLAY);
+    const SnapshotRef *selector = snapshot_ref_column(snap, SNAP_SELECTOR);
+    const SnapshotRef *host = snapshot_ref_column(snap, SNAP_HOST);
+    const int *ports = snapshot_int_column(snap, SNAP_PORTS);
+    page.items.resize(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        GopherItem &item = page.items[i];
+        item.type = types[i];
+        item.display.assign(snapshot_text(snap, display[i]), display[i].length);
+        item.selector.assign(snapshot_text(snap, selector[i]), selector[i].length);
+        item.host.assign(snapshot_text(snap, host[i]), host[i].length);
+        item.port = ports[i];
+        if (header.flags & SNAP_INDEXED)
+            page.type_index[item.type].push_back(i);
+    }
+
+    const SnapshotToc *toc = (const SnapshotToc *)snapshot_section(snap, SNAP_TOC);
+    page.toc.resize(snapshot_count(snap, SNAP_TOC));
+    for (size_t i = 0; i < page.toc.size(); i++)
+    {
+        page.toc[i].line = toc[i].line;
+        page.toc[i].title = snapshot_text_string(snap, toc[i].title);
+    }
+
+    const SnapshotLink *links = (const SnapshotLink *)snapshot_section(snap, SNAP_LINKS);
+    page.links.resize(snapshot_count(snap, SNAP_LINKS));
+    for (size_t i = 0; i < page.links.size(); i++)
+    {
+        page.links[i].item = links[i].item;
+        page.links[i].start = links[i].start;
+        page.links[i].length = links[i].length;
+    }
+
+    const int *by_display = snapshot_int_column(snap, SNAP_BY_DISPLAY);
+    const int *by_host = snapshot_int_column(snap, SNAP_BY_HOST);
+    page.by_display.assign(by_display, by_display + snapshot_count(snap, SNAP_BY_DISPLAY));
+    page.by_host.assign(by_host, by_host + snapshot_count(snap, SNAP_BY_HOST));
+
+    if (header.flags & SNAP_VIEW_ACTIVE)
+    {
+        const int *view = snapshot_int_column(snap, SNAP_VIEW);
+        page.view_active = true;
+        page.view_type = header.view_type;
+        page.view_sort = header.view_sort;
+        page.view.assign(view, view + snapshot_count(snap, SNAP_VIEW));
+        page.view_pos.assign(count, -1);
+        for (size_t pos = 0; pos < page.view.size(); pos++)
+            page.view_pos[page.view[pos]] = pos;
+    }
+
+    const int *rows = snapshot_int_column(snap, SNAP_LAYOUT_ROWS);
+    const SnapshotLayout *layouts = (const SnapshotLayout *)snapshot_section(snap, SNAP_LAYOUTS);
+    long now = get_current_time_ms();
+    page.layouts.resize(snapshot_count(snap, SNAP_LAYOUTS));
+    for (size_t i = 0; i < page.layouts.size(); i++)
+    {
+        PageLayout &layout = page.layouts[i];
+        layout.font_size = layouts[i].font_size;
+        layout.columns = layouts[i].columns;
+        layout.rows.assign(rows + layouts[i].rows, rows + layouts[i].rows + count);
+        layout.first_row.assign(rows + layouts[i].first_row, rows + layouts[i].first_row + layouts[i].first_rows);
+        layout.next_item = layouts[i].next_item;
+        layout.known_items = layouts[i].known_items;
+        layout.known_rows = layouts[i].known_rows;
+        layout.last_used = now;
+    }
+}
+
+// ============================================================================
+// Navigation
+// ============================================================================
+
+static void navigate_to(const char *host, const char *selector, int port, char type = GOPHER_MENU);
+
+// History survives restarts as an append log on the card: "+" records a
+// page pushed, "-" one popped by going back. It is compacted when loaded.
+static std::string history_path()
+{
+    return download_dir() + "/.history";
+}
+
+static std::string history_record(const HistoryEntry &entry)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", entry.port);
+    return std::string("+\t") + entry.type + "\t" + port + "\t" + entry.host + "\t" + entry.selector + "\n";
+}
+
+static void load_history()
+{
+    std::string data;
+    if (!persist_read(history_path(), data))
+        return;
+
+    history.clear();
+    int records = 0;
+    std::vector<std::string> lines = split(data, '\n');
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        const std::string &line = lines[i];
+        if (line == "-")
+        {
+            if (!history.empty())
+                history.pop_back();
+            records++;
+            continue;
+        }
+
+        // Search selectors carry a tab, so the selector is everything after the host
+        std::vector<std::string> fields = split(line, '\t');
+        if (fields.size() < 5 || fields[0] != "+" || fields[1].length() != 1)
+            continue;
+        HistoryEntry entry;
+        entry.type = fields[1][0];
+        entry.port = atoi(fields[2].c_str());
+        entry.host = fields[3];
+        entry.selector = fields[4];
+        for (size_t j = 5; j < fields.size(); j++)
+            entry.selector += "\t" + fields[j];
+        history.push_back(entry);
+        records++;
+    }
+
+    if ((int)history.size() > settings.max_history)
+        history.erase(history.begin(), history.end() - settings.max_history);
+
+    if (records > (int)history.size())
+    {
+        std::string compact;
+        for (size_t i = 0; i < history.size(); i++)
+            compact += history_record(history[i]);
+        persist_write(history_path(), compact);
+    }
+}
+
+static void push_history(const HistoryEntry &entry)
+{
+    history.push_back(entry);
+    persist_append(history_path(), history_record(entry));
+
+    // Limit history size
+    while ((int)history.size() > settings.max_history)
+    {
+        history.erase(history.begin());
+    }
+}
+
+// Preformatted mode and pan offset of text documents, by host:port+selector
+struct DocumentView
+{
+    bool preformatted;
+    int pan_column;
+};
+
+static std::map<std::string, DocumentView> document_views;
+
+static std::string document_key(const GopherPage &page)
+{
+    return search_cache_key(page.host.c_str(), page.port, page.selector.c_str());
+}
+
+static void remember_document_view()
+{
+    if (current_page.is_menu)
+        return;
+
+    std::string key = document_key(current_page);
+    if (!current_page.preformatted)
+    {
+        document_views.erase(key);
+        return;
+    }
+
+    // Bounded; which document forgets its offset first doesn't matter much
+    if (document_views.size() >= (size_t)kMaxDocumentViews && document_views.find(key) == document_views.end())
+    {
+        document_views.erase(document_views.begin());
+    }
+
+    DocumentView &view = document_views[key];
+    view.preformatted = true;
+    view.pan_column = current_page.pan_column;
+}
+
+static void restore_document_view()
+{
+    if (current_page.is_menu)
+        return;
+
+    std::map<std::string, DocumentView>::const_iterator it = document_views.find(document_key(current_page));
+    if (it != document_views.end())
+    {
+        current_page.preformatted = it->second.preformatted;
+        current_page.pan_column = it->second.pan_column;
+    }
+}
+
+// Resets the view to the top of a freshly loaded page
+static void page_loaded()
+{
     scroll_offset = 0;
+    scroll_row = 0;
     selected_index = -1;
+    close_grid();
+    restore_document_view();
+
+    // Find first selectable item; links in text are only selected by tapping
+    for (size_t i = 0; current_page.is_menu && i < current_page.items.size(); i++)
+    {
+        if (current_page.items[i].is_selectable())
+        {
+            selected_index = i;
+            break;
+        }
+    }
+
+    // A new page may have pushed us over a threshold
+    memory_governor_check();
+
+    set_status("");
+}
+
+// The page being read is kept as a snapshot when the app is left, and
+// shown again at the same place on the next start
+static std::string session_path()
+{
+    return download_dir() + "/.session";
+}
+
+static void save_session()
+{
+    if (current_page.host.empty() || is_loading)
+        return;
+    persist_write(session_path(), snapshot_page(current_page, scroll_offset, scroll_row, selected_index));
+}
+
+static bool restore_session()
+{
+    MappedFile file;
+    if (!map_file(session_path(), file))
+        return false;
+
+    PageSnapshot snap;
+    bool ok = snapshot_open(file.data, file.size, snap);
+    if (ok)
+    {
+        snapshot_restore(snap, staging_page);
+        layout_worker_cancel();
+        current_page.swap(staging_page);
+        GopherPage().swap(staging_page);
+        page_loaded();
+
+        // The position is only trusted as far as the page goes
+        const SnapshotHeader &header = *snap.header;
+        int positions = current_page.view_active ? current_page.view.size() : current_page.items.size();
+        if (header.scroll_offset >= 0 && header.scroll_offset < positions)
+        {
+            scroll_offset = header.scroll_offset;
+            scroll_row = std::max(header.scroll_row, 0);
+        }
+        if (header.selected_index >= 0 && header.selected_index < (int)current_page.items.size() &&
+            current_page.items[header.selected_index].is_selectable())
+            selected_index = header.selected_index;
+    }
+    unmap_file(file);
+    return ok;
+}
+
+static bool go_back()
+{
+    if (history.empty())
+    {
+        return false;
+    }
+
+    // Navigate without adding to history; the entry is kept if loading fails
+    HistoryEntry entry = history.back();
+
+    set_status("Loading...");
+    is_loading = true;
+
+    bool ok = load_into_current(entry.host.c_str(), entry.selector.c_str(), entry.port, entry.type);
+
+    is_loading = false;
+
+    if (!ok)
+    {
+        set_status("Failed to load page");
+        return false;
+    }
+
+    history.pop_back();
+    persist_append(history_path(), "-\n");
+    page_loaded();
+    return true;
+}
+
+static void navigate_to(const char *host, const char *selector, int port, char type)
+{
+    // Remember the current page for history before it is replaced
+    HistoryEntry entry;
+    entry.host = current_page.host;
+    entry.selector = current_page.selector;
+    entry.port = current_page.port;
+    entry.type = current_page.type;
+
+    set_status("Connecting...");
+    is_loading = true;
+
+    bool ok = load_into_current(host, selector, port, type);
+
+    is_loading = false;
+
+    if (!ok)
+    {
+        set_status("Failed to load page");
+        return;
+    }
+
+    if (!entry.host.empty())
+    {
+        push_history(entry);
+    }
+
+    page_loaded();
+}
+
+// Keyboard handler for search input
+static void search_keyboard_handler(char *text)
+{
+    if (text == NULL || text[0] == '\0')
+    {
+        // User cancelled or entered empty string
+        search_pending = false;
+        draw_screen();
+        return;
+    }
+
+    // Build the search selector: original_selector + TAB + query
+    std::string search_selector = pending_search_item.selector + "\t" + text;
+
+    // Navigate to the search results
+    navigate_to(pending_search_item.host.c_str(),
+                search_selector.c_str(),
+                pending_search_item.port,
+                GOPHER_MENU);
+
+    search_pending = false;
+    draw_screen();
+}
+
+// Keyboard handler for multi-search input
+static void multi_search_keyboard_handler(char *text)
+{
+    search_pending = false;
+    if (text != NULL && text[0] != '\0')
+    {
+        navigate_to(kMultiSearchHost, text, 0, GOPHER_MENU);
+    }
+    draw_screen();
+}
+
+static bool multi_search_pending = false; // Keyboard is for multi-search
+
+static void open_search_keyboard()
+{
+    if (multi_search_pending)
+    {
+        OpenKeyboard("Search all engines", search_query, sizeof(search_query) - 1,
+                     KBD_NORMAL, multi_search_keyboard_handler);
+        return;
+    }
+
+    // Title shows what we're searching
+    char title[128];
+    snprintf(title, sizeof(title), "Search: %s", pending_search_item.display.c_str());
+
+    OpenKeyboard(title, search_query, sizeof(search_query) - 1,
+                 KBD_NORMAL, search_keyboard_handler);
+}
+
+// Recent query picked: open the keyboard with it, ready to run or refine
+static void recent_query_handler(int index)
+{
+    if (index < 0)
+    {
+        search_pending = false;
+        draw_screen();
+        return;
+    }
+    if (index < (int)recent_queries.size())
+    {
+        strncpy(search_query, recent_queries[index].c_str(), sizeof(search_query) - 1);
+    }
+    open_search_keyboard();
+}
+
+// Offers the last queries before the keyboard, if there are any
+static void prompt_search_query()
+{
+    static imenu recent_items[kMaxRecentQueries + 3];
+
+    // Clear the search buffer
+    memset(search_query, 0, sizeof(search_query));
+
+    if (recent_queries.empty())
+    {
+        open_search_keyboard();
+        return;
+    }
+
+    int n = 0;
+    set_menu_item(recent_items[n++], ITEM_HEADER, 0, "Recent searches", NULL);
+    for (size_t i = 0; i < recent_queries.size(); i++)
+    {
+        set_menu_item(recent_items[n++], ITEM_ACTIVE, i, recent_queries[i].c_str(), NULL);
+    }
+    set_menu_item(recent_items[n++], ITEM_ACTIVE, kMaxRecentQueries, "New search...", NULL);
+    set_menu_item(recent_items[n], 0, 0, NULL, NULL);
+
+    OpenMenu(recent_items, 0, 50, 100, (iv_menuhandler)recent_query_handler);
+}
+
+static void initiate_multi_search()
+{
+    search_pending = true;
+    multi_search_pending = true;
+    prompt_search_query();
+}
+
+static void initiate_search(const GopherItem &item)
+{
+    // Store the item we're searching
+    pending_search_item = item;
+    search_pending = true;
+    multi_search_pending = false;
+
+    prompt_search_query();
+}
+
+static void follow_link()
+{
+    if (selected_index < 0 || selected_index >= (int)current_page.items.size())
+    {
+        return;
+    }
+
+    // Copied: loading a page replaces the items
+    GopherItem item = current_page.items[selected_index];
+    const ItemTypeHandler *handler = find_handler(item.type);
+
+    switch (handler->viewer)
+    {
+    case VIEW_PAGE:
+        navigate_to(item.host.c_str(), item.selector.c_str(), item.port, item.type);
+        break;
+
+    case VIEW_SEARCH:
+        // Open keyboard for search query input
+        initiate_search(item);
+        break;
+
+    case VIEW_DOWNLOAD:
+    {
+        DownloadSink *sink = handler->download_sink(item);
+        std::string archive_path;
+        bool is_archive = download_item(item, *sink, archive_path);
+        delete sink;
+        if (is_archive)
+        {
+            navigate_to(kArchiveHost, archive_path.c_str(), 0, GOPHER_MENU);
+        }
+        break;
+    }
+
+    case VIEW_IMAGE:
+    {
+        DownloadSink *sink = handler->download_sink(item);
+        show_image(item, *sink);
+        delete sink;
+        break;
+    }
+
+    case VIEW_UNSUPPORTED:
+        Message(ICON_WARNING, "Gopher Browser",
+                "Binary files cannot be displayed", 2000);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// ============================================================================
+// Fonts and Layout
+// ============================================================================
+
+struct CachedFont
+{
+    int size;
+    ifont *font;
+    long last_used;
+};
+
+static std::vector<CachedFont> font_cache;
+
+// Returns the mono font at the given size, opening it on first use and
+// closing the least recently used one when the cache is full. The font in
+// use is never closed, so with one slot the cache briefly holds two.
+// Returns NULL, caching nothing, when the font cannot be opened.
+static ifont *get_font(int size)
+{
+    long now = get_current_time_ms();
+    for (size_t i = 0; i < font_cache.size(); i++)
+    {
+        if (font_cache[i].size == size)
+        {
+            font_cache[i].last_used = now;
+            return font_cache[i].font;
+        }
+    }
+
+    ifont *font = OpenFont("DroidSansMono", size, 1);
+    if (font == NULL)
+        return NULL;
+
+    if ((int)font_cache.size() >= settings.max_cached_fonts)
+    {
+        int oldest = -1;
+        for (size_t i = 0; i < font_cache.size(); i++)
+        {
+            if (font_cache[i].font == mono_font)
+                continue;
+            if (oldest < 0 || font_cache[i].last_used < font_cache[oldest].last_used)
+                oldest = (int)i;
+        }
+        if (oldest >= 0)
+        {
+            CloseFont(font_cache[oldest].font);
+            font_cache.erase(font_cache.begin() + oldest);
+        }
+    }
+
+    CachedFont entry;
+    entry.size = size;
+    entry.font = font;
+    entry.last_used = now;
+    font_cache.push_back(entry);
+    return entry.font;
+}
+
+static void close_fonts()
+{
+    for (size_t i = 0; i < font_cache.size(); i++)
+    {
+        CloseFont(font_cache[i].font);
+    }
+    font_cache.clear();
+    mono_font = NULL;
+}
+
+// Recomputes screen geometry for the current font and screen size
+static void update_metrics()
+{
+    int content_width = ScreenWidth() - (kScreenMargin * 2);
+
+    header_height = kScreenMargin + title_font_size + 2 + font_size + 2 + 4;
+    content_area_top = header_height;
+
+    // Leave space for footer
+    int footer_height = 30;
+    visible_lines = (ScreenHeight() - header_height - footer_height - kScreenMargin) / line_height;
+    if (visible_lines < 1)
+        visible_lines = 1;
+    content_area_bottom = header_height + (visible_lines * line_height);
+
+    // Type prefix takes three columns, scrollbar the right edge
+    text_columns = (content_width - 3 * char_width - 14) / char_width;
+    if (text_columns < 8)
+        text_columns = 8;
+    if (text_columns > 255)
+        text_columns = 255;
+}
+
+// Length of the wrapped row starting at start; breaks after the last space
+// that fits, or hard-breaks long words. draw_len excludes trailing spaces.
+static size_t wrap_row(const std::string &s, size_t start, int columns, int &draw_len)
+{
+    size_t remaining = s.length() - start;
+    if (remaining <= (size_t)columns)
+    {
+        draw_len = remaining;
+        return remaining;
+    }
+
+    size_t limit = start + columns;
+    for (size_t i = limit; i > start; i--)
+    {
+        if (s[i] == ' ')
+        {
+            size_t end = i;
+            while (end > start && s[end - 1] == ' ')
+                end--;
+            draw_len = end - start;
+            return i - start + 1;
+        }
+    }
+
+    // Don't split UTF-8 sequences
+    while (limit > start + 1 && (s[limit] & 0xC0) == 0x80)
+        limit--;
+    draw_len = limit - start;
+    return limit - start;
+}
+
+static int count_rows(const std::string &s, int columns)
+{
+    int rows = 1;
+    int draw_len;
+    size_t pos = wrap_row(s, 0, columns, draw_len);
+    while (pos < s.length())
+    {
+        pos += wrap_row(s, pos, columns, draw_len);
+        rows++;
+    }
+    return rows;
+}
+
+// Source offset of a wrapped row within an item's text
+static size_t row_start(const std::string &s, int row, int columns)
+{
+    size_t pos = 0;
+    int draw_len;
+    for (int r = 0; r < row && pos < s.length(); r++)
+    {
+        pos += wrap_row(s, pos, columns, draw_len);
+    }
+    return pos;
+}
+
+// Wrapped row of an item's text containing the given source offset
+static int row_at_offset(const std::string &s, size_t offset, int columns)
+{
+    size_t pos = 0;
+    int row = 0;
+    int draw_len;
+    while (pos < s.length())
+    {
+        size_t next = pos + wrap_row(s, pos, columns, draw_len);
+        if (offset < next)
+            break;
+        pos = next;
+        row++;
+    }
+    return row;
+}
+
+// ----------------------------------------------------------------------------
+// Layout worker
+// ----------------------------------------------------------------------------
+
+// Wraps the lines of a text page on a low-priority thread, first the
+// screens below the reading position and then the rest of the document, so
+// page turns and the idle pass find row counts ready. Results come back
+// through a ring of fixed batches with one writer on each side: the worker
+// fills a slot and then advances layout_head, the UI thread reads it and
+// then advances layout_tail. The indices only change through the atomic
+// builtins, which are full barriers, so no lock is taken for the handoff.
+// The ring is the worker's whole memory budget, and a job ends when the
+// ring is full; the UI drains it and asks for more. Row bitmaps are not
+// prepared: inkview drawing belongs to the UI thread. The worker reads the
+// page's lines in place, so whatever replaces the page calls
+// layout_worker_cancel() first.
+
+struct LayoutBatch
+{
+    unsigned int generation; // Job that produced it
+    int columns;
+    int first_item;
+    int count;
+    int rows[kLayoutBatchItems];
+};
+
+struct LayoutJob
+{
+    const std::vector<GopherItem> *items;
+    int columns;
+    int first_item;
+    int row_budget; // Stop after this many rows
+};
+
+static LayoutBatch layout_ring[kLayoutRingSize];
+static volatile unsigned int layout_head = 0;       // Batches published, written by the worker
+static volatile unsigned int layout_tail = 0;       // Batches taken, written by the UI thread
+static volatile unsigned int layout_generation = 0; // Bumped by the UI thread to drop a job
+static pthread_mutex_t layout_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t layout_wake = PTHREAD_COND_INITIALIZER; // New job or stop
+static pthread_cond_t layout_idle = PTHREAD_COND_INITIALIZER; // Worker let go of the page
+static pthread_t layout_thread;
+static LayoutJob layout_job;
+static bool layout_running = false;
+static bool layout_stopping = false;
+static bool layout_pending = false; // layout_job not picked up yet
+static bool layout_busy = false;    // Worker is reading the page
+
+// Atomic read and increment of the ring indices and the generation
+static unsigned int layout_load(volatile unsigned int &value)
+{
+    return __sync_fetch_and_add(&value, 0);
+}
+
+static void layout_advance(volatile unsigned int &value)
+{
+    __sync_fetch_and_add(&value, 1);
+}
+
+static bool layout_worker_on()
+{
+    return layout_running && settings.layout_ahead_screens > 0;
+}
+
+static void layout_run(const LayoutJob &job, unsigned int generation)
+{
+    int count = job.items->size();
+    int item = job.first_item;
+    int budget = job.row_budget;
+
+    unsigned int head = layout_load(layout_head);
+    while (item < count && budget > 0 && head - layout_load(layout_tail) < (unsigned int)kLayoutRingSize)
+    {
+        LayoutBatch &batch = layout_ring[head % kLayoutRingSize];
+        batch.generation = generation;
+        batch.columns = job.columns;
+        batch.first_item = item;
+        batch.count = 0;
+        while (batch.count < kLayoutBatchItems && item < count && budget > 0)
+        {
+            if (generation != layout_load(layout_generation))
+                return;
+            int rows = count_rows((*job.items)[item].display, job.columns);
+            batch.rows[batch.count++] = rows;
+            budget -= rows;
+            item++;
+        }
+
+        // The batch is written before the index that hands it over
+        layout_advance(layout_head);
+        head++;
+    }
+}
+
+static void *layout_main(void *)
+{
+#ifdef SYS_gettid
+    // Below the UI thread: only spare time goes to layout
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    pthread_mutex_lock(&layout_lock);
+    while (!layout_stopping)
+    {
+        if (!layout_pending)
+        {
+            pthread_cond_wait(&layout_wake, &layout_lock);
+            continue;
+        }
+
+        LayoutJob job = layout_job;
+        unsigned int generation = layout_load(layout_generation);
+        layout_pending = false;
+        layout_busy = true;
+        pthread_mutex_unlock(&layout_lock);
+
+        layout_run(job, generation);
+
+        pthread_mutex_lock(&layout_lock);
+        layout_busy = false;
+        pthread_cond_broadcast(&layout_idle);
+    }
+    pthread_mutex_unlock(&layout_lock);
+    return NULL;
+}
+
+static void layout_worker_start()
+{
+    if (layout_running)
+        return;
+    layout_stopping = false;
+    layout_running = pthread_create(&layout_thread, NULL, layout_main, NULL) == 0;
+}
+
+// Drops the current job and waits until the worker no longer reads the
+// page. It checks between lines, so this waits for one line at most.
+static void layout_worker_cancel()
+{
+    if (!layout_running)
+        return;
+
+    pthread_mutex_lock(&layout_lock);
+    layout_advance(layout_generation);
+    layout_pending = false;
+    while (layout_busy)
+        pthread_cond_wait(&layout_idle, &layout_lock);
+    pthread_mutex_unlock(&layout_lock);
+
+    // Whatever is still in the ring belongs to the old page
+    __sync_lock_test_and_set(&layout_tail, layout_load(layout_head));
+}
+
+static void layout_worker_stop()
+{
+    if (!layout_running)
+        return;
+
+    layout_worker_cancel();
+    pthread_mutex_lock(&layout_lock);
+    layout_stopping = true;
+    pthread_cond_signal(&layout_wake);
+    pthread_mutex_unlock(&layout_lock);
+
+    pthread_join(layout_thread, NULL);
+    layout_running = false;
+}
+
+// Hands the worker the lines from first_item on. Unless preempt is set, a
+// job already under way is left to finish.
+static void layout_worker_request(const PageLayout *layout, int first_item, int row_budget, bool preempt)
+{
+    pthread_mutex_lock(&layout_lock);
+    if (preempt || (!layout_busy && !layout_pending))
+    {
+        layout_advance(layout_generation);
+        layout_job.items = &current_page.items;
+        layout_job.columns = layout->columns;
+        layout_job.first_item = first_item;
+        layout_job.row_budget = row_budget;
+        layout_pending = true;
+        pthread_cond_signal(&layout_wake);
+    }
+    pthread_mutex_unlock(&layout_lock);
+}
+
+// Takes the published batches into a layout, UI thread only
+static void layout_worker_collect(PageLayout *layout)
+{
+    unsigned int head = layout_load(layout_head);
+    unsigned int generation = layout_load(layout_generation);
+    for (unsigned int tail = layout_load(layout_tail); tail != head; tail++)
+    {
+        const LayoutBatch &batch = layout_ring[tail % kLayoutRingSize];
+        if (batch.generation == generation && batch.columns == layout->columns)
+        {
+            for (int i = 0; i < batch.count && batch.first_item + i < (int)layout->rows.size(); i++)
+            {
+                int &rows = layout->rows[batch.first_item + i];
+                if (rows == 0)
+                {
+                    rows = batch.rows[i];
+                    layout->known_items++;
+                    layout->known_rows += rows;
+                }
+            }
+        }
 
-    // Find first selectable item
-    for (size_t i = 0; i < current_page.items.size(); i++)
+        // Done with the slot before the worker may reuse it
+        layout_advance(layout_tail);
+    }
+}
+
+// Layout of the current page for the current font size and screen width.
+// Text pages only; menus are one row per item.
+static PageLayout *current_layout()
+{
+    std::vector<PageLayout> &layouts = current_page.layouts;
+    long now = get_current_time_ms();
+
+    for (size_t i = 0; i < layouts.size(); i++)
     {
-        if (current_page.items[i].is_selectable())
+        if (layouts[i].font_size == font_size && layouts[i].columns == text_columns)
         {
-            selected_index = i;
-            break;
+            layouts[i].last_used = now;
+            return &layouts[i];
+        }
+    }
+
+    if ((int)layouts.size() >= settings.max_cached_layouts)
+    {
+        size_t oldest = 0;
+        for (size_t i = 1; i < layouts.size(); i++)
+        {
+            if (layouts[i].last_used < layouts[oldest].last_used)
+                oldest = i;
+        }
+        layouts.erase(layouts.begin() + oldest);
+    }
+
+    PageLayout layout;
+    layout.font_size = font_size;
+    layout.columns = text_columns;
+    layout.rows.assign(current_page.items.size(), 0);
+    layout.next_item = 0;
+    layout.known_items = 0;
+    layout.known_rows = 0;
+    layout.last_used = now;
+    layouts.push_back(layout);
+    return &layouts.back();
+}
+
+static int layout_item_rows(PageLayout *layout, int index)
+{
+    int &rows = layout->rows[index];
+    if (rows == 0 && layout_load(layout_tail) != layout_load(layout_head))
+        layout_worker_collect(layout);
+    if (rows == 0)
+    {
+        rows = count_rows(current_page.items[index].display, layout->columns);
+        layout->known_items++;
+        layout->known_rows += rows;
+    }
+    return rows;
+}
+
+// Menus and preformatted text show every item on a single, unwrapped row
+static bool single_row_items()
+{
+    return current_page.is_menu || current_page.preformatted;
+}
+
+// Number of screen rows an item occupies
+static int item_rows(int index)
+{
+    if (single_row_items())
+        return 1;
+    return layout_item_rows(current_layout(), index);
+}
+
+static bool layout_complete(const PageLayout *layout)
+{
+    return layout->first_row.size() == layout->rows.size() + 1;
+}
+
+// Lays out the part of the document that isn't on screen yet, a batch at a time
+static void layout_idle_step()
+{
+    if (single_row_items())
+        return;
+
+    PageLayout *layout = current_layout();
+    if (layout_complete(layout))
+        return;
+
+    size_t count = layout->rows.size();
+    if (layout_worker_on())
+    {
+        // The worker wraps; this takes its batches and keeps it going
+        layout_worker_collect(layout);
+        while (layout->next_item < count && layout->rows[layout->next_item] != 0)
+            layout->next_item++;
+        if (layout->next_item < count)
+            layout_worker_request(layout, layout->next_item, INT_MAX, false);
+    }
+    else
+    {
+        size_t end = layout->next_item + settings.layout_idle_batch;
+        if (end > count)
+            end = count;
+
+        for (; layout->next_item < end; layout->next_item++)
+        {
+            layout_item_rows(layout, layout->next_item);
+        }
+    }
+
+    if (layout->next_item < count)
+    {
+        SetWeakTimer("layout", layout_idle_step, settings.layout_idle_delay);
+        return;
+    }
+
+    layout->first_row.resize(count + 1);
+    layout->first_row[0] = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        layout->first_row[i + 1] = layout->first_row[i] + layout->rows[i];
+    }
+}
+
+// Points the worker at the screens below the reading position, unless
+// they are laid out already
+static void layout_worker_ahead(PageLayout *layout)
+{
+    layout_worker_collect(layout);
+
+    int count = layout->rows.size();
+    int budget = settings.layout_ahead_screens * visible_lines + scroll_row;
+    int item = scroll_offset;
+    while (item < count && budget > 0 && layout->rows[item] != 0)
+        budget -= layout->rows[item++];
+    if (item < count && budget > 0)
+        layout_worker_request(layout, item, budget, true);
+}
+
+static void schedule_layout()
+{
+    if (!single_row_items() && !layout_complete(current_layout()))
+    {
+        if (layout_worker_on())
+            layout_worker_ahead(current_layout());
+        SetWeakTimer("layout", layout_idle_step, settings.layout_idle_delay);
+    }
+}
+
+// Filter/sort views map screen positions to items. Without a view every
+// item is shown in page order and positions are item indices.
+static int view_count()
+{
+    return current_page.view_active ? current_page.view.size() : current_page.items.size();
+}
+
+static int view_item(int pos)
+{
+    return current_page.view_active ? current_page.view[pos] : pos;
+}
+
+// Position of an item in the current view, -1 if it is filtered out
+static int view_position(int index)
+{
+    if (!current_page.view_active)
+        return index;
+    if (index < 0 || index >= (int)current_page.view_pos.size())
+        return -1;
+    return current_page.view_pos[index];
+}
+
+// Switches the filter/sort view of a menu. Views are index permutations
+// built at parse time, so no items are copied.
+static void set_view(char type, int sort)
+{
+    GopherPage &page = current_page;
+    page.view_type = type;
+    page.view_sort = sort;
+    page.view.clear();
+    page.view_pos.clear();
+    page.view_active = page.is_menu && (type != 0 || sort != SORT_NONE);
+    if (!page.view_active)
+        return;
+
+    const std::vector<int> *order = NULL;
+    if (sort == SORT_DISPLAY)
+        order = &page.by_display;
+    else if (sort == SORT_HOST)
+        order = &page.by_host;
+
+    if (order == NULL)
+    {
+        page.view = page.type_index[type];
+    }
+    else
+    {
+        for (size_t i = 0; i < order->size(); i++)
+        {
+            int index = (*order)[i];
+            if (type == 0 || page.items[index].type == type)
+                page.view.push_back(index);
+        }
+    }
+
+    page.view_pos.assign(page.items.size(), -1);
+    for (size_t pos = 0; pos < page.view.size(); pos++)
+    {
+        page.view_pos[page.view[pos]] = pos;
+    }
+}
+
+// Moves a (position, row) pair by delta screen rows, stopping at the ends.
+// The position past the last row is (view_count(), 0).
+static void advance_position(int &pos, int &row, int delta)
+{
+    int count = view_count();
+
+    while (delta > 0 && pos < count)
+    {
+        int left = item_rows(view_item(pos)) - 1 - row;
+        if (delta <= left)
+        {
+            row += delta;
+            return;
+        }
+        delta -= left + 1;
+        pos++;
+        row = 0;
+    }
+
+    while (delta < 0 && (pos > 0 || row > 0))
+    {
+        if (-delta <= row || pos == 0)
+        {
+            row = (-delta <= row) ? row + delta : 0;
+            return;
+        }
+        delta += row + 1;
+        pos--;
+        row = item_rows(view_item(pos)) - 1;
+    }
+}
+
+// Top position that shows the last screen of the page
+static void max_scroll_position(int &pos, int &row)
+{
+    pos = view_count();
+    row = 0;
+    advance_position(pos, row, -visible_lines);
+}
+
+static void clamp_scroll()
+{
+    int max_pos, max_row;
+    max_scroll_position(max_pos, max_row);
+
+    if (scroll_offset > max_pos || (scroll_offset == max_pos && scroll_row > max_row))
+    {
+        scroll_offset = max_pos;
+        scroll_row = max_row;
+    }
+    if (scroll_offset < 0)
+    {
+        scroll_offset = 0;
+        scroll_row = 0;
+    }
+}
+
+static void scroll_by_rows(int delta)
+{
+    advance_position(scroll_offset, scroll_row, delta);
+    clamp_scroll();
+}
+
+static void scroll_to_item(int index)
+{
+    int pos = view_position(index);
+    if (pos < 0)
+        return;
+
+    scroll_offset = pos;
+    scroll_row = 0;
+    clamp_scroll();
+}
+
+// Scrolls just enough to bring an item's first row on screen
+static void ensure_visible(int index)
+{
+    int pos = view_position(index);
+    if (pos < 0)
+        return;
+
+    if (pos < scroll_offset || (pos == scroll_offset && scroll_row > 0))
+    {
+        scroll_offset = pos;
+        scroll_row = 0;
+        return;
+    }
+
+    int last_pos = scroll_offset;
+    int last_row = scroll_row;
+    advance_position(last_pos, last_row, visible_lines - 1);
+    if (pos > last_pos)
+    {
+        scroll_offset = pos;
+        scroll_row = 0;
+        advance_position(scroll_offset, scroll_row, -(visible_lines - 1));
+    }
+}
+
+// Item shown on the given screen row, or -1
+static int item_at_screen_row(int screen_row)
+{
+    int pos = scroll_offset;
+    int row = scroll_row;
+    advance_position(pos, row, screen_row);
+    if (pos >= view_count())
+        return -1;
+    return view_item(pos);
+}
+
+// Row index of the top of the screen and total rows, for the scrollbar and
+// page indicator. Estimated while the idle layout is still running.
+static bool scroll_metrics(int &top_row, int &total_rows)
+{
+    int items_count = current_page.items.size();
+
+    if (single_row_items())
+    {
+        top_row = scroll_offset;
+        total_rows = view_count();
+        return true;
+    }
+
+    PageLayout *layout = current_layout();
+    if (layout_complete(layout))
+    {
+        top_row = layout->first_row[scroll_offset] + scroll_row;
+        total_rows = layout->first_row[items_count];
+        return true;
+    }
+
+    int known_items = layout->known_items > 0 ? layout->known_items : 1;
+    int known_rows = layout->known_rows > 0 ? layout->known_rows : 1;
+    top_row = (int)((long long)scroll_offset * known_rows / known_items) + scroll_row;
+    total_rows = (int)((long long)items_count * known_rows / known_items);
+    if (total_rows < top_row + 1)
+        total_rows = top_row + 1;
+    return false;
+}
+
+static void apply_zoom(int level)
+{
+    // Stay at the current zoom if the new size cannot be opened
+    ifont *font = get_font(kZoomFontSizes[level]);
+    if (font == NULL && mono_font != NULL)
+        return;
+
+    zoom_level = level;
+    font_size = kZoomFontSizes[level];
+    title_font_size = font_size + 6;
+    line_height = font_size + 4;
+
+    mono_font = font;
+    SetFont(mono_font, BLACK);
+
+    char_width = CharWidth('M');
+    if (char_width <= 0)
+        char_width = font_size * 3 / 5;
+
+    update_metrics();
+}
+
+// Source offset of the top row within its item, for re-anchoring after the
+// layout changes (zoom, rotation)
+static size_t top_anchor()
+{
+    if (single_row_items() || scroll_offset >= (int)current_page.items.size())
+        return 0;
+    return row_start(current_page.items[scroll_offset].display, scroll_row, text_columns);
+}
+
+static void restore_anchor(size_t anchor)
+{
+    scroll_row = 0;
+    if (!single_row_items() && scroll_offset < (int)current_page.items.size())
+    {
+        scroll_row = row_at_offset(current_page.items[scroll_offset].display, anchor, text_columns);
+    }
+    clamp_scroll();
+}
+
+// Switches font size, keeping the top row anchored to the same source offset
+static void set_zoom(int level)
+{
+    if (level < 0 || level >= kZoomLevels || level == zoom_level)
+        return;
+
+    size_t anchor = top_anchor();
+    apply_zoom(level);
+    restore_anchor(anchor);
+}
+
+// Rotates the screen. Layouts are cached per width, so the portrait and
+// landscape ones both survive; only the rows on screen are laid out before
+// the first frame, the rest in idle time.
+static void set_orientation(int orientation)
+{
+    // text_columns still describes the old layout until update_metrics()
+    size_t anchor = top_anchor();
+    if (orientation != GetOrientation())
+    {
+        SetOrientation(orientation);
+    }
+    update_metrics();
+    restore_anchor(anchor);
+}
+
+// Memory governor hooks. Layouts other than the active one go at soft
+// pressure, all of them at hard pressure; they are rebuilt on demand.
+static long layouts_memory_usage()
+{
+    long total = 0;
+    for (size_t i = 0; i < current_page.layouts.size(); i++)
+    {
+        const PageLayout &layout = current_page.layouts[i];
+        total += sizeof(PageLayout) +
+                 (layout.rows.capacity() + layout.first_row.capacity()) * sizeof(int);
+    }
+    return total;
+}
+
+static void shrink_layouts(int pressure)
+{
+    std::vector<PageLayout> &layouts = current_page.layouts;
+    if (pressure == MEMORY_HARD)
+    {
+        std::vector<PageLayout>().swap(layouts);
+        return;
+    }
+
+    for (size_t i = layouts.size(); i > 0; i--)
+    {
+        if (layouts[i - 1].font_size != font_size || layouts[i - 1].columns != text_columns)
+            layouts.erase(layouts.begin() + (i - 1));
+    }
+}
+
+// Glyph caches live inside inkview, so count each open font at a rough size
+static long fonts_memory_usage()
+{
+    return font_cache.size() * 128 * 1024;
+}
+
+static void shrink_fonts(int /*pressure*/)
+{
+    for (size_t i = font_cache.size(); i > 0; i--)
+    {
+        if (font_cache[i - 1].font != mono_font)
+        {
+            CloseFont(font_cache[i - 1].font);
+            font_cache.erase(font_cache.begin() + (i - 1));
+        }
+    }
+}
+
+// The raw response of a text page duplicates its lines
+static long page_text_memory_usage()
+{
+    return current_page.raw_text.capacity();
+}
+
+static void shrink_page_text(int /*pressure*/)
+{
+    std::string().swap(current_page.raw_text);
+}
+
+// ============================================================================
+// Display Functions
+// ============================================================================
+
+static const char *get_type_prefix(char type)
+{
+    return find_handler(type)->prefix;
+}
+
+static const char *get_type_name(char type)
+{
+    return find_handler(type)->name;
+}
+
+// Orders links by item for lookups while drawing
+struct TextLinkBefore
+{
+    bool operator()(const TextLink &link, int item) const
+    {
+        return link.item < item;
+    }
+};
+
+// Characters (not bytes) in a UTF-8 range, for monospace positions
+static int utf8_length(const std::string &s, size_t start, size_t end)
+{
+    int length = 0;
+    for (size_t i = start; i < end; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+            length++;
+    }
+    return length;
+}
+
+// Byte offset of the character count characters after start, or the end
+static size_t utf8_offset(const std::string &s, size_t start, int count)
+{
+    size_t i = start;
+    while (i < s.length() && count > 0)
+    {
+        i++;
+        while (i < s.length() && (s[i] & 0xC0) == 0x80)
+            i++;
+        count--;
+    }
+    return i;
+}
+
+// Underlines the parts of an item's links that fall in the drawn row
+static void draw_link_underlines(int item, size_t pos, int draw_len, int x, int y)
+{
+    const std::vector<TextLink> &links = current_page.links;
+    const std::string &s = current_page.items[item].display;
+    std::vector<TextLink>::const_iterator it =
+        std::lower_bound(links.begin(), links.end(), item, TextLinkBefore());
+    for (; it != links.end() && it->item == item; ++it)
+    {
+        size_t start = std::max(it->start, pos);
+        size_t end = std::min(it->start + it->length, pos + draw_len);
+        if (start >= end)
+            continue;
+
+        int x0 = x + utf8_length(s, pos, start) * char_width;
+        int x1 = x0 + utf8_length(s, start, end) * char_width;
+        DrawLine(x0, y, x1, y, BLACK);
+    }
+}
+
+// Describes the active filter/sort view for the footer
+static std::string view_label()
+{
+    if (!current_page.view_active)
+        return "";
+
+    std::string label = current_page.view_type ? get_type_name(current_page.view_type) : "All";
+    if (current_page.view_sort == SORT_DISPLAY)
+        label += ", by name";
+    else if (current_page.view_sort == SORT_HOST)
+        label += ", by host";
+    return label;
+}
+
+// Draws the viewed image centered, shrunk to fit the screen if needed
+static void draw_image()
+{
+    ClearScreen();
+
+    int screen_width = ScreenWidth();
+    int screen_height = ScreenHeight();
+    int width = viewed_image->width;
+    int height = viewed_image->height;
+    if (width > screen_width || height > screen_height)
+    {
+        if (width * screen_height > height * screen_width)
+        {
+            height = height * screen_width / width;
+            width = screen_width;
+        }
+        else
+        {
+            width = width * screen_height / height;
+            height = screen_height;
         }
+        StretchBitmap((screen_width - width) / 2, (screen_height - height) / 2, width, height,
+                      viewed_image, 0);
+    }
+    else
+    {
+        DrawBitmap((screen_width - width) / 2, (screen_height - height) / 2, viewed_image);
     }
 
-    set_status("");
-    return true;
+    FullUpdate();
+}
+
+// Peek popup: the peeked item's name over the start of its text, placed in
+// the content area
+static void peek_box(int &x, int &y, int &width, int &height)
+{
+    int max_lines = visible_lines - 4;
+    if (max_lines < 1)
+        max_lines = 1;
+    int shown = (int)peek_lines.size() < max_lines ? (int)peek_lines.size() : max_lines;
+
+    x = kScreenMargin + 16;
+    y = content_area_top + line_height;
+    width = ScreenWidth() - 2 * x;
+    height = (shown + 2) * line_height + 12;
 }
 
-static void navigate_to(const char *host, const char *selector, int port, char expected_type)
+static void draw_peek()
 {
-    // Save current page to history
-    if (!current_page.host.empty())
+    int x, y, width, height;
+    peek_box(x, y, width, height);
+
+    FillArea(x, y, width, height, WHITE);
+    DrawRect(x, y, width, height, BLACK);
+
+    int columns = (width - 16) / char_width;
+    int row_y = y + 4;
+    SetFont(mono_font, BLACK);
+    DrawTextRect(x + 8, row_y, width - 16, font_size, peeked_item.display.c_str(), ALIGN_LEFT);
+    row_y += line_height;
+    DrawLine(x + 4, row_y, x + width - 4, row_y, BLACK);
+    row_y += 4;
+
+    int shown = (height - 12) / line_height - 2;
+    for (int i = 0; i < shown; i++)
     {
-        push_history();
+        // Truncated to the popup width on a character boundary
+        const std::string &line = peek_lines[i];
+        size_t len = line.length() < (size_t)columns ? line.length() : columns;
+        while (len > 0 && len < line.length() && (line[len] & 0xC0) == 0x80)
+            len--;
+        DrawTextRect(x + 8, row_y, width - 16, font_size, line.substr(0, len).c_str(), ALIGN_LEFT);
+        row_y += line_height;
     }
 
-    current_page.host = host;
-    current_page.selector = selector;
-    current_page.port = port;
+    SetFont(mono_font, DGRAY);
+    DrawTextRect(x + 8, row_y, width - 16, font_size, "Next: open   other keys, tap: close", ALIGN_LEFT);
+}
 
-    set_status("Connecting...");
-    is_loading = true;
+// Host and selector above the content area
+static void draw_header()
+{
+    int screen_width = ScreenWidth();
+    int content_width = screen_width - (kScreenMargin * 2);
+    int y = kScreenMargin;
 
-    std::string response = fetch_gopher(host, selector, port);
+    // Draw header
+    SetFont(mono_font, BLACK);
 
-    is_loading = false;
+    char header[256];
+    snprintf(header, sizeof(header), "Gopher: %s", current_page.host.c_str());
+    DrawTextRect(kScreenMargin + 6, y, content_width - 12, title_font_size, header, ALIGN_LEFT);
+    y += title_font_size + 2;
 
-    if (response.empty())
-    {
-        set_status("Failed to load page");
-        return;
-    }
+    // Draw current path
+    SetFont(mono_font, DGRAY);
+    DrawTextRect(kScreenMargin + 6, y, content_width - 12, font_size,
+                 current_page.selector.c_str(), ALIGN_LEFT);
+    y += font_size + 2;
+
+    // Separator line
+    DrawLine(kScreenMargin, y, screen_width - kScreenMargin, y, BLACK);
+}
+
+// Thumbnail grid geometry: tiles a little larger than a thumbnail, with
+// the item name underneath
+static int grid_columns()
+{
+    int columns = (ScreenWidth() - 2 * kScreenMargin) / (kThumbnailSize + 16);
+    return columns < 1 ? 1 : columns;
+}
+
+static int grid_rows()
+{
+    int rows = (content_area_bottom - content_area_top) / (kThumbnailSize + 8 + line_height);
+    return rows < 1 ? 1 : rows;
+}
+
+static int grid_tiles()
+{
+    return grid_columns() * grid_rows();
+}
+
+static void grid_tile_rect(int tile, int &x, int &y, int &width, int &height)
+{
+    width = (ScreenWidth() - 2 * kScreenMargin) / grid_columns();
+    height = (content_area_bottom - content_area_top) / grid_rows();
+    x = kScreenMargin + (tile % grid_columns()) * width;
+    y = content_area_top + (tile / grid_columns()) * height;
+}
+
+// Grid tile at a screen position, or -1
+static int grid_tile_at(int x, int y)
+{
+    if (y < content_area_top || y >= content_area_bottom || x < kScreenMargin)
+        return -1;
 
-    // Parse based on expected type
-    if (expected_type == GOPHER_TEXT || expected_type == GOPHER_HTML)
+    int tile_x, tile_y, width, height;
+    grid_tile_rect(0, tile_x, tile_y, width, height);
+    int column = (x - kScreenMargin) / width;
+    int tile = (y - content_area_top) / height * grid_columns() + column;
+    if (column >= grid_columns() || tile >= (int)grid.thumbs.size())
+        return -1;
+    return tile;
+}
+
+static void draw_tile(int tile)
+{
+    int x, y, width, height;
+    grid_tile_rect(tile, x, y, width, height);
+    FillArea(x, y, width, height, WHITE);
+
+    // Thumbnail centred above the label, or a note in its place
+    int image_height = height - line_height - 8;
+    const ibitmap *thumb = grid.thumbs[tile];
+    if (thumb != NULL)
     {
-        parse_text_file(response, current_page);
+        DrawBitmap(x + (width - thumb->width) / 2, y + 4 + (image_height - thumb->height) / 2, thumb);
     }
     else
     {
-        parse_gopher_menu(response, current_page);
+        DrawRect(x + 4, y + 4, width - 8, image_height, LGRAY);
+        SetFont(mono_font, DGRAY);
+        DrawTextRect(x + 4, y + 4 + (image_height - font_size) / 2, width - 8, font_size,
+                     grid.notes[tile], ALIGN_CENTER);
     }
 
-    scroll_offset = 0;
-    selected_index = -1;
+    const std::string &display = current_page.items[grid.items[grid.first + tile]].display;
+    int columns = (width - 8) / char_width;
+    size_t len = display.length() < (size_t)columns ? display.length() : columns;
+    while (len > 0 && len < display.length() && (display[len] & 0xC0) == 0x80)
+        len--;
+    SetFont(mono_font, BLACK);
+    DrawTextRect(x + 4, y + height - line_height - 2, width - 8, font_size,
+                 display.substr(0, len).c_str(), ALIGN_CENTER);
+}
 
-    // Find first selectable item
-    for (size_t i = 0; i < current_page.items.size(); i++)
+static void draw_grid()
+{
+    draw_header();
+    for (size_t i = 0; i < grid.thumbs.size(); i++)
     {
-        if (current_page.items[i].is_selectable())
+        draw_tile(i);
+    }
+
+    int y = ScreenHeight() - 25 - kScreenMargin;
+    DrawLine(kScreenMargin, y, ScreenWidth() - kScreenMargin, y, BLACK);
+    y += 5;
+
+    char page_info[64];
+    int tiles = grid_tiles();
+    snprintf(page_info, sizeof(page_info), "%d/%d", grid.first / tiles + 1,
+             ((int)grid.items.size() + tiles - 1) / tiles);
+    SetFont(mono_font, DGRAY);
+    DrawTextRect(kScreenMargin + 6, y, ScreenWidth() - 2 * kScreenMargin - 120, font_size,
+                 status_message[0] != '\0' ? status_message : "Thumbnails", ALIGN_LEFT);
+    DrawTextRect(ScreenWidth() - kScreenMargin - 100, y, 94, font_size, page_info, ALIGN_RIGHT);
+
+    FullUpdate();
+}
+
+// Byte offset of the visible column window of a preformatted line. Columns
+// are characters, so multibyte box drawing stays aligned across lines.
+static size_t pan_start(const std::string &text)
+{
+    return utf8_offset(text, 0, current_page.pan_column);
+}
+
+// Draws the content rows, starting at the wrapped row of the top item
+static void draw_rows()
+{
+    int content_width = ScreenWidth() - (kScreenMargin * 2);
+    int y = content_area_top;
+
+    SetFont(mono_font, BLACK);
+
+    int count = view_count();
+    int prefix_width = 3 * char_width;
+    int view_pos = scroll_offset;
+    int row = scroll_row;
+    size_t pos = 0;
+    if (view_pos < count && row > 0)
+    {
+        pos = row_start(current_page.items[view_item(view_pos)].display, row, text_columns);
+    }
+
+    for (int line = 0; line < visible_lines && view_pos < count; line++)
+    {
+        int item = view_item(view_pos);
+        const GopherItem &gi = current_page.items[item];
+
+        // Highlight selected item
+        if (item == selected_index)
         {
-            selected_index = i;
-            break;
+            FillArea(kScreenMargin, y, content_width, line_height, LGRAY);
+        }
+
+        // Draw type prefix
+        if (row == 0)
+        {
+            const char *prefix = get_type_prefix(gi.type);
+            SetFont(mono_font, (gi.type == GOPHER_INFO) ? DGRAY : BLACK);
+            DrawTextRect(kScreenMargin, y + 2, prefix_width + 4, font_size, prefix, ALIGN_LEFT);
+        }
+
+        // Draw display text: menus truncate, preformatted text shows the
+        // panned column window, other text pages wrap
+        SetFont(mono_font, BLACK);
+
+        char display_buf[256];
+        int draw_len;
+        size_t advance;
+        if (current_page.is_menu)
+        {
+            draw_len = gi.display.length() < (size_t)text_columns ? gi.display.length() : text_columns;
+            advance = gi.display.length();
+        }
+        else if (current_page.preformatted)
+        {
+            pos = pan_start(gi.display);
+            size_t end = utf8_offset(gi.display, pos, text_columns);
+            if (end - pos > sizeof(display_buf) - 1)
+            {
+                end = pos + sizeof(display_buf) - 1;
+                while (end > pos && (gi.display[end] & 0xC0) == 0x80)
+                    end--;
+            }
+            draw_len = end - pos;
+            advance = gi.display.length();
+        }
+        else
+        {
+            advance = wrap_row(gi.display, pos, text_columns, draw_len);
+        }
+
+        memcpy(display_buf, gi.display.data() + pos, draw_len);
+        display_buf[draw_len] = '\0';
+
+        DrawTextRect(kScreenMargin + prefix_width, y + 2, content_width - prefix_width - 8,
+                     font_size, display_buf, ALIGN_LEFT);
+        if (!current_page.is_menu && gi.type != GOPHER_INFO)
+        {
+            draw_link_underlines(item, pos, draw_len, kScreenMargin + prefix_width, y + 2 + font_size);
+        }
+
+        y += line_height;
+
+        pos += advance;
+        row++;
+        if (row >= item_rows(item))
+        {
+            view_pos++;
+            row = 0;
+            pos = 0;
         }
     }
+}
 
-    set_status("");
+static void draw_scrollbar(int top_row, int total_rows)
+{
+    if (total_rows <= visible_lines)
+        return;
+
+    int screen_width = ScreenWidth();
+    int scrollbar_height = content_area_bottom - header_height;
+    int thumb_height = (visible_lines * scrollbar_height) / total_rows;
+    if (thumb_height < 20)
+        thumb_height = 20;
+
+    int thumb_pos = header_height + (int)((long long)top_row * scrollbar_height / total_rows);
+
+    // Scrollbar track
+    FillArea(screen_width - kScreenMargin - 6, header_height, 5, scrollbar_height, LGRAY);
+    // Scrollbar thumb
+    FillArea(screen_width - kScreenMargin - 6, thumb_pos, 5, thumb_height, DGRAY);
 }
 
-// Keyboard handler for search input
-static void search_keyboard_handler(char *text)
+static void draw_screen()
 {
-    if (text == NULL || text[0] == '\0')
+    if (viewed_image != NULL)
     {
-        // User cancelled or entered empty string
-        search_pending = false;
-        draw_screen();
+        draw_image();
         return;
     }
 
-    // Build the search selector: original_selector + TAB + query
-    std::string search_selector = pending_search_item.selector + "\t" + text;
+    ClearScreen();
+    update_metrics();
 
-    // Navigate to the search results
-    navigate_to(pending_search_item.host.c_str(),
-                search_selector.c_str(),
-                pending_search_item.port,
-                GOPHER_MENU);
+    if (grid.active)
+    {
+        draw_grid();
+        return;
+    }
 
-    search_pending = false;
-    draw_screen();
+    int screen_width = ScreenWidth();
+    int content_width = screen_width - (kScreenMargin * 2);
+
+    draw_header();
+    draw_rows();
+
+    int top_row, total_rows;
+    bool exact = scroll_metrics(top_row, total_rows);
+    draw_scrollbar(top_row, total_rows);
+
+    // Draw footer/status bar
+    int y = footer_top();
+    DrawLine(kScreenMargin, y, screen_width - kScreenMargin, y, BLACK);
+    y += 5;
+
+    SetFont(mono_font, DGRAY);
+
+    if (progress.active)
+    {
+        DrawTextRect(kScreenMargin + 6, y, content_width - 120, font_size, progress_text().c_str(), ALIGN_LEFT);
+    }
+    else if (status_message[0] != '\0')
+    {
+        DrawTextRect(kScreenMargin + 6, y, content_width - 120, font_size, status_message, ALIGN_LEFT);
+    }
+    else if (current_page.view_active)
+    {
+        DrawTextRect(kScreenMargin + 6, y, content_width - 120, font_size, view_label().c_str(), ALIGN_LEFT);
+    }
+
+    // Page indicator and hint; approximate until the idle layout finishes
+    char page_info[64];
+    int current_page_num = (top_row / visible_lines) + 1;
+    int total_pages = ((total_rows + visible_lines - 1) / visible_lines);
+    if (total_pages < 1)
+        total_pages = 1;
+    if (current_page_num > total_pages)
+        current_page_num = total_pages;
+
+    snprintf(page_info, sizeof(page_info), exact ? "%d/%d" : "%d/~%d", current_page_num, total_pages);
+    DrawTextRect(screen_width - kScreenMargin - 100, y, 94, font_size, page_info, ALIGN_RIGHT);
+
+    if (!peek_lines.empty())
+        draw_peek();
+
+    FullUpdate();
+
+    schedule_layout();
 }
 
-static void initiate_search(const GopherItem &item)
+// ============================================================================
+// Self-Benchmark
+// ============================================================================
+
+// Measures the device's own costs: parsing embedded corpora, layout, the
+// text blit path, screen refreshes, flash I/O of cache-sized segments and
+// mmap page-in. Results go to a report on the SD card, one
+// "name<TAB>value<TAB>unit" line per measurement after '#' header lines,
+// so runs on different models (and the host) can be compared line by line.
+
+static const char *kBenchMenuSample =
+    "iWelcome to the benchmark corpus\t\tnull.host\t1\r\n"
+    "1Phlogs and gopherholes\t/phlogs\tgopher.example.org\t70\r\n"
+    "0About this server\t/about.txt\tgopher.example.org\t70\r\n"
+    "7Search the archive\t/search\tgopher.example.org\t70\r\n"
+    "9Firmware image\t/files/fw.bin\tfiles.example.org\t70\r\n"
+    "hWeb mirror\tURL:http://example.org/\tgopher.example.org\t70\r\n";
+
+static const char *kBenchTextSample =
+    "CHAPTER 1. THE PROTOCOL\r\n"
+    "The Internet Gopher protocol is designed for distributed document search\r\n"
+    "and retrieval. Documents reside on many autonomous servers on the Internet.\r\n"
+    "Users run client software on their desktop systems, connecting to a server\r\n"
+    "and sending the server a selector (a line of text, which may be empty).\r\n"
+    "\r\n";
+
+static const char *kBenchHtmlSample =
+    "<h2>Section</h2><p>The <b>Internet Gopher</b> protocol is designed for "
+    "distributed document search &amp; retrieval.</p><ul><li>Menus</li>"
+    "<li>Documents&nbsp;and&#32;searches</li></ul>\n";
+
+static std::string bench_corpus;
+static GopherPage bench_page;
+static volatile unsigned long bench_sink; // Keeps results from being optimized away
+
+static std::string bench_repeat(const char *sample)
 {
-    // Store the item we're searching
-    pending_search_item = item;
-    search_pending = true;
+    std::string corpus;
+    corpus.reserve(kBenchCorpusSize + strlen(sample));
+    while ((int)corpus.length() < kBenchCorpusSize)
+        corpus += sample;
+    return corpus;
+}
 
-    // Clear the search buffer
-    memset(search_query, 0, sizeof(search_query));
+static void bench_feed(ResponseSink &sink)
+{
+    // Network-sized pieces, as a fetch would deliver them
+    for (size_t pos = 0; pos < bench_corpus.length(); pos += kMinReadChunk)
+        sink.write(bench_corpus.data() + pos, std::min((size_t)kMinReadChunk, bench_corpus.length() - pos));
+    sink.finish();
+}
 
-    // Open the keyboard for input
-    // Title shows what we're searching
-    char title[128];
-    snprintf(title, sizeof(title), "Search: %s", item.display.c_str());
+static void bench_parse_menu()
+{
+    MenuSink sink(bench_page);
+    bench_feed(sink);
+}
 
-    OpenKeyboard(title, search_query, sizeof(search_query) - 1,
-                 KBD_NORMAL, search_keyboard_handler);
+static void bench_parse_text()
+{
+    TextSink sink(bench_page);
+    bench_feed(sink);
 }
 
-static void follow_link()
+static void bench_parse_html()
 {
-    if (selected_index < 0 || selected_index >= (int)current_page.items.size())
+    HtmlSink sink(bench_page);
+    bench_feed(sink);
+}
+
+// Wraps every line of the parsed text corpus at the current width
+static void bench_layout()
+{
+    int rows = 0;
+    for (size_t i = 0; i < bench_page.items.size(); i++)
+        rows += count_rows(bench_page.items[i].display, text_columns);
+    bench_sink = rows;
+}
+
+// Draws a screenful of text without refreshing the panel
+static void bench_blit()
+{
+    SetFont(mono_font, BLACK);
+    for (int i = 0; i < visible_lines && i < (int)bench_page.items.size(); i++)
     {
-        return;
+        DrawString(kScreenMargin, content_area_top + i * line_height,
+                   bench_page.items[i].display.c_str());
+    }
+}
+
+static std::string bench_snapshot;
+
+static void bench_snapshot_write()
+{
+    bench_snapshot = snapshot_page(bench_page, 0, 0, -1);
+}
+
+static void bench_snapshot_restore()
+{
+    PageSnapshot snap;
+    GopherPage page;
+    if (snapshot_open((const unsigned char *)bench_snapshot.data(), bench_snapshot.length(), snap))
+        snapshot_restore(snap, page);
+    bench_sink = page.items.size();
+}
+
+// Milliseconds per run, repeating until kBenchMinTime has passed
+static double bench_time(void (*proc)(), int &runs)
+{
+    double start = get_precise_time_ms();
+    double elapsed = 0;
+    runs = 0;
+    while (runs == 0 || elapsed < kBenchMinTime)
+    {
+        proc();
+        runs++;
+        elapsed = get_precise_time_ms() - start;
     }
+    return elapsed / runs;
+}
+
+static void bench_line(std::string &report, const char *name, double value, const char *unit)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "%s\t%.2f\t%s\n", name, value, unit);
+    report += line;
+}
 
-    const GopherItem &item = current_page.items[selected_index];
+static void bench_parse(std::string &report, const char *name, const char *sample, void (*proc)())
+{
+    int runs;
+    bench_corpus = bench_repeat(sample);
+    double ms = bench_time(proc, runs);
+    bench_line(report, name, ms > 0 ? bench_corpus.length() / 1048.576 / ms : 0, "MB/s");
+}
+
+// Writes, reads back and maps a file of cache-sized segments
+static void bench_flash(std::string &report)
+{
+    std::string path = download_dir() + "/.bench";
+    std::vector<char> segment(kBenchSegmentSize, 'x');
+    double total_mb = (double)kBenchSegmentSize * kBenchSegments / 1048576.0;
 
-    if (!item.is_selectable())
+    double start = get_precise_time_ms();
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
+        report += "# flash: cannot create " + path + "\n";
         return;
     }
+    bool ok = true;
+    for (int i = 0; i < kBenchSegments && ok; i++)
+        ok = write(fd, &segment[0], kBenchSegmentSize) == kBenchSegmentSize;
+    ok = ok && fsync(fd) == 0;
+    double elapsed = get_precise_time_ms() - start;
+    if (ok)
+        bench_line(report, "flash.write", total_mb * 1000.0 / elapsed, "MB/s");
+
+    // Drop the cached pages so reads come from flash
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    start = get_precise_time_ms();
+    fd = open(path.c_str(), O_RDONLY);
+    long bytes = 0;
+    ssize_t n;
+    while (fd >= 0 && (n = read(fd, &segment[0], kBenchSegmentSize)) > 0)
+        bytes += n;
+    elapsed = get_precise_time_ms() - start;
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    if (bytes > 0)
+        bench_line(report, "flash.read", bytes / 1048.576 / elapsed, "MB/s");
 
-    // Handle different item types
-    switch (item.type)
+    MappedFile file;
+    start = get_precise_time_ms();
+    if (map_file(path, file))
     {
-    case GOPHER_MENU:
-        navigate_to(item.host.c_str(), item.selector.c_str(), item.port, GOPHER_MENU);
-        break;
+        unsigned long sum = 0;
+        long page = sysconf(_SC_PAGESIZE);
+        long pages = 0;
+        for (size_t pos = 0; pos < file.size; pos += page, pages++)
+            sum += file.data[pos];
+        elapsed = get_precise_time_ms() - start;
+        unmap_file(file);
+        bench_line(report, "mmap.pagein", pages / elapsed, "pages/ms");
+        bench_sink = sum;
+    }
 
-    case GOPHER_SEARCH:
-        // Open keyboard for search query input
-        initiate_search(item);
-        break;
+    unlink(path.c_str());
+}
 
-    case GOPHER_TEXT:
-    case GOPHER_HTML:
-        navigate_to(item.host.c_str(), item.selector.c_str(), item.port, GOPHER_TEXT);
-        break;
+static void bench_refresh(std::string &report)
+{
+    const int full_runs = 3;
+    const int partial_runs = 5;
 
-    case GOPHER_BINARY:
-    case GOPHER_IMAGE:
-    case GOPHER_GIF:
-    case GOPHER_SOUND:
-    case GOPHER_DOS:
-    case GOPHER_BINHEX:
-    case GOPHER_UUENCODE:
-        Message(ICON_WARNING, "Gopher Browser",
-                "Binary files cannot be displayed", 2000);
-        break;
+    double start = get_precise_time_ms();
+    for (int i = 0; i < full_runs; i++)
+        FullUpdate();
+    bench_line(report, "refresh.full", (get_precise_time_ms() - start) / full_runs, "ms");
+
+    int band = (content_area_bottom - content_area_top) / 4;
+    start = get_precise_time_ms();
+    for (int i = 0; i < partial_runs; i++)
+        PartialUpdate(0, content_area_top, ScreenWidth(), band);
+    bench_line(report, "refresh.partial", (get_precise_time_ms() - start) / partial_runs, "ms");
+}
+
+// Runs the suite, saves the report and shows it as about:benchmark
+static void run_benchmark()
+{
+    set_status("Running benchmark...");
+    draw_screen();
+
+    // Both stamps are taken now, before anything reuses localtime's buffer;
+    // without a local time the report is dated "unknown"
+    char header[256];
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    char date[32] = "unknown";
+    char stamp[32] = "unknown";
+    if (t != NULL)
+    {
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", t);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", t);
+    }
+    snprintf(header, sizeof(header), "# gopher-browser benchmark\n# model %s\n# date %s\n# screen %dx%d font %d columns %d\n",
+             GetDeviceModel(), date, ScreenWidth(), ScreenHeight(), font_size, text_columns);
+    std::string report = header;
+
+    bench_parse(report, "parse.menu", kBenchMenuSample, bench_parse_menu);
+    bench_parse(report, "parse.html", kBenchHtmlSample, bench_parse_html);
+    bench_parse(report, "parse.text", kBenchTextSample, bench_parse_text);
+
+    // Layout and blit run over the parsed text corpus
+    int runs;
+    double ms = bench_time(bench_layout, runs);
+    bench_line(report, "layout.wrap", ms > 0 ? bench_page.items.size() / ms : 0, "lines/ms");
+    ms = bench_time(bench_blit, runs);
+    bench_line(report, "blit.screen", ms, "ms");
+    ms = bench_time(bench_snapshot_write, runs);
+    bench_line(report, "snapshot.write", ms > 0 ? bench_snapshot.length() / 1048.576 / ms : 0, "MB/s");
+    ms = bench_time(bench_snapshot_restore, runs);
+    bench_line(report, "snapshot.restore", ms > 0 ? bench_snapshot.length() / 1048.576 / ms : 0, "MB/s");
+    std::string().swap(bench_snapshot);
+    bench_refresh(report);
+    bench_flash(report);
+
+    bench_corpus.clear();
+    GopherPage().swap(bench_page);
+
+    // Saved next to the download directory, named by model and time
+    char name[128];
+    snprintf(name, sizeof(name), "gopher-bench-%s-%s.txt", GetDeviceModel(), stamp);
+    std::string path = std::string(SDCARDDIR) + "/" + sanitize_filename(name);
+    FILE *f = fopen(path.c_str(), "w");
+    if (f != NULL)
+    {
+        fputs(report.c_str(), f);
+        fclose(f);
+        report = "# saved to " + path + "\n" + report;
+    }
+
+    benchmark_report = report;
+    set_status("");
+    navigate_to(kAboutHost, "benchmark", 0, GOPHER_TEXT);
+}
+
+// ============================================================================
+// Input Handling
+// ============================================================================
+
+static void move_selection(int direction)
+{
+    int count = view_count();
+    if (count == 0)
+        return;
+
+    int current = view_position(selected_index);
+    if (current < 0)
+        current = (direction > 0) ? scroll_offset - 1 : scroll_offset;
+
+    // Find next selectable item, wrapping around at the ends
+    for (int step = 1; step <= count; step++)
+    {
+        int pos = ((current + direction * step) % count + count) % count;
+        int index = view_item(pos);
+        if (current_page.items[index].is_selectable())
+        {
+            selected_index = index;
 
-    default:
-        // Try as menu
-        navigate_to(item.host.c_str(), item.selector.c_str(), item.port, GOPHER_MENU);
-        break;
+            // Adjust scroll if needed
+            ensure_visible(selected_index);
+
+            draw_screen();
+            return;
+        }
     }
 }
 
-// ============================================================================
-// Display Functions
-// ============================================================================
-
-static const char *get_type_prefix(char type)
+static void scroll_page(int direction)
 {
-    switch (type)
-    {
-    case GOPHER_TEXT:
-        return "[T]";
-    case GOPHER_MENU:
-        return "[D]";
-    case GOPHER_SEARCH:
-        return "[?]";
-    case GOPHER_BINARY:
-        return "[B]";
-    case GOPHER_IMAGE:
-    case GOPHER_GIF:
-        return "[I]";
-    case GOPHER_SOUND:
-        return "[S]";
-    case GOPHER_HTML:
-        return "[H]";
-    case GOPHER_ERROR:
-        return "[E]";
-    case GOPHER_INFO:
-        return "   ";
-    default:
-        return "[?]";
-    }
+    scroll_by_rows(direction * visible_lines);
+    draw_screen();
 }
 
-static void draw_screen()
+// Switches a text page between wrapped and preformatted (panned) display,
+// keeping the top line in place
+static void toggle_preformatted()
 {
-    ClearScreen();
+    current_page.preformatted = !current_page.preformatted;
+    current_page.pan_column = 0;
+    scroll_row = 0;
+    clamp_scroll();
+    remember_document_view();
+}
 
-    int screen_width = ScreenWidth();
-    int screen_height = ScreenHeight();
-    int content_width = screen_width - (kScreenMargin * 2);
-    int y = kScreenMargin;
+// Shifts the preformatted view sideways. Only the visible column window of
+// each line is drawn, and only the content area is refreshed.
+static void pan_by(int columns)
+{
+    int widest = 0;
+    for (size_t i = 0; i < current_page.items.size(); i++)
+    {
+        const std::string &display = current_page.items[i].display;
+        if ((int)display.length() > widest)
+            widest = std::max(widest, utf8_length(display, 0, display.length()));
+    }
 
-    // Draw header
-    SetFont(mono_font, BLACK);
+    int max_column = widest - text_columns;
+    int column = current_page.pan_column + columns;
+    if (column > max_column)
+        column = max_column;
+    if (column < 0)
+        column = 0;
+    if (column == current_page.pan_column)
+        return;
 
-    char header[256];
-    snprintf(header, sizeof(header), "Gopher: %s", current_page.host.c_str());
-    DrawTextRect(kScreenMargin + 6, y, content_width - 12, kTitleFontSize, header, ALIGN_LEFT);
-    y += kTitleFontSize + 2;
+    current_page.pan_column = column;
+    remember_document_view();
 
-    // Draw current path
-    SetFont(mono_font, DGRAY);
-    DrawTextRect(kScreenMargin + 6, y, content_width - 12, kFontSize,
-                 current_page.selector.c_str(), ALIGN_LEFT);
-    y += kFontSize + 2;
+    int height = content_area_bottom - content_area_top;
+    FillArea(0, content_area_top, ScreenWidth(), height, WHITE);
+    draw_rows();
 
-    // Separator line
-    DrawLine(kScreenMargin, y, screen_width - kScreenMargin, y, BLACK);
-    y += 4;
+    int top_row, total_rows;
+    scroll_metrics(top_row, total_rows);
+    draw_scrollbar(top_row, total_rows);
 
-    header_height = y;
-    content_area_top = y;
+    PartialUpdate(0, content_area_top, ScreenWidth(), height);
+}
 
-    // Calculate visible lines (leave space for footer)
-    int footer_height = 30;
-    visible_lines = (screen_height - header_height - footer_height - kScreenMargin) / kLineHeight;
-    content_area_bottom = header_height + (visible_lines * kLineHeight);
+// Shows the start of a text item in a popup, refreshing only its region
+static void show_peek(const GopherItem &item)
+{
+    if (!peek_item(item))
+    {
+        Message(ICON_WARNING, "Gopher Browser", "Peek failed", 2000);
+        return;
+    }
+    if (peek_lines.empty())
+        peek_lines.push_back("");
 
-    // Draw items
-    SetFont(mono_font, BLACK);
+    draw_peek();
+    int x, y, width, height;
+    peek_box(x, y, width, height);
+    PartialUpdate(x, y, width, height);
+}
 
-    int items_count = current_page.items.size();
-    int end_index = scroll_offset + visible_lines;
-    if (end_index > items_count)
-        end_index = items_count;
+static void close_peek()
+{
+    peek_lines.clear();
+}
 
-    for (int i = scroll_offset; i < end_index; i++)
-    {
-        const GopherItem &item = current_page.items[i];
+// Mirrors the site below the current menu and shows the report
+static void mirror_current_site()
+{
+    set_status(mirror_exists(current_page.host, current_page.port) ? "Updating mirror..." : "Saving site...");
+    draw_screen();
 
-        // Highlight selected item
-        if (i == selected_index)
-        {
-            FillArea(kScreenMargin, y, content_width, kLineHeight, LGRAY);
-        }
+    mirror_site(current_page.host, current_page.port, current_page.selector);
 
-        // Draw type prefix
-        const char *prefix = get_type_prefix(item.type);
-        SetFont(mono_font, (item.type == GOPHER_INFO) ? DGRAY : BLACK);
-        DrawTextRect(kScreenMargin, y + 2, kScreenMargin + 28, kFontSize, prefix, ALIGN_LEFT);
+    set_status("");
+    navigate_to(kAboutHost, "mirror", 0, GOPHER_TEXT);
+}
 
-        // Draw display text
-        SetFont(mono_font, BLACK);
+static void export_current_page()
+{
+    set_status("Exporting...");
+    draw_screen();
 
-        // Truncate long lines
-        char display_buf[256];
-        int max_chars = (content_width - 38) / 8; // Approximate char width
-        if (max_chars > 255)
-            max_chars = 255;
+    std::string path = export_epub();
+    set_status("");
+    if (path.empty())
+    {
+        Message(ICON_WARNING, "Gopher Browser", "Export failed", 2000);
+        return;
+    }
 
-        strncpy(display_buf, item.display.c_str(), max_chars);
-        display_buf[max_chars] = '\0';
+    std::string msg = "Saved to " + path;
+    Message(ICON_INFORMATION, "Gopher Browser", msg.c_str(), 3000);
+}
 
-        DrawTextRect(kScreenMargin + 24, y + 2, content_width - 8, kFontSize, display_buf, ALIGN_LEFT);
+// A finished thumbnail is painted and refreshed on its own
+static void grid_tile_done(int tile)
+{
+    int x, y, width, height;
+    draw_tile(tile);
+    grid_tile_rect(tile, x, y, width, height);
+    PartialUpdate(x, y, width, height);
+}
 
-        y += kLineHeight;
-    }
+// Shows the grid page starting at grid.first: cached thumbnails at once,
+// the rest tile by tile as they arrive
+static void show_grid_page()
+{
+    free_grid_thumbnails();
+    update_metrics();
 
-    // Draw scrollbar if needed
-    if (items_count > visible_lines)
+    int tiles = grid_tiles();
+    for (int i = grid.first; i < (int)grid.items.size() && i < grid.first + tiles; i++)
     {
-        int scrollbar_height = content_area_bottom - header_height;
-        int thumb_height = (visible_lines * scrollbar_height) / items_count;
-        if (thumb_height < 20)
-            thumb_height = 20;
+        const GopherItem &item = current_page.items[grid.items[i]];
+        ibitmap *thumb = load_thumbnail(thumbnail_key(item));
+        grid.thumbs.push_back(thumb);
 
-        int thumb_pos = header_height + (scroll_offset * scrollbar_height) / items_count;
-
-        // Scrollbar track
-        FillArea(screen_width - kScreenMargin - 6, header_height, 5, scrollbar_height, LGRAY);
-        // Scrollbar thumb
-        FillArea(screen_width - kScreenMargin - 6, thumb_pos, 5, thumb_height, DGRAY);
+        // GIF has no decoder here; don't fetch what can't be shown
+        if (thumb != NULL)
+            grid.notes.push_back(NULL);
+        else
+            grid.notes.push_back(item.type == GOPHER_GIF ? "GIF" : "loading");
     }
 
-    // Draw footer/status bar
-    y = screen_height - 25 - kScreenMargin;
-    DrawLine(kScreenMargin, y, screen_width - kScreenMargin, y, BLACK);
-    y += 5;
-
-    SetFont(mono_font, DGRAY);
+    draw_screen();
+    fetch_grid_thumbnails(grid_tile_done);
+}
 
-    if (status_message[0] != '\0')
+static void show_grid()
+{
+    close_grid();
+    for (size_t i = 0; i < current_page.items.size(); i++)
     {
-        DrawTextRect(kScreenMargin + 6, y, content_width - 120, kFontSize, status_message, ALIGN_LEFT);
+        if (find_handler(current_page.items[i].type)->viewer == VIEW_IMAGE)
+            grid.items.push_back(i);
     }
+    if (grid.items.empty())
+        return;
 
-    // Page indicator and hint
-    char page_info[64];
-    int current_page_num = (scroll_offset / visible_lines) + 1;
-    int total_pages = ((items_count + visible_lines - 1) / visible_lines);
-    if (total_pages < 1)
-        total_pages = 1;
+    grid.active = true;
+    grid.first = 0;
+    show_grid_page();
+}
 
-    snprintf(page_info, sizeof(page_info), "%d/%d", current_page_num, total_pages);
-    DrawTextRect(screen_width - kScreenMargin - 100, y, 94, kFontSize, page_info, ALIGN_RIGHT);
+// Moves the grid a page forward or back; false at either end
+static bool turn_grid_page(int direction)
+{
+    int first = grid.first + direction * grid_tiles();
+    if (first < 0 || first >= (int)grid.items.size())
+        return false;
 
-    FullUpdate();
+    grid.first = first;
+    show_grid_page();
+    return true;
 }
 
-// ============================================================================
-// Input Handling
-// ============================================================================
+// Opens the image of a tapped tile; closing it returns to the grid
+static void open_grid_tile(int tile)
+{
+    selected_index = grid.items[grid.first + tile];
+    follow_link();
+    draw_screen();
+}
 
-static void move_selection(int direction)
+static void toc_menu_handler(int index)
 {
-    int items_count = current_page.items.size();
-    if (items_count == 0)
+    if (index < 0 || index >= (int)current_page.toc.size())
         return;
 
-    int new_index = selected_index + direction;
+    // Items of a text page are its lines, so the heading's line is the scroll target
+    scroll_to_item(current_page.toc[index].line);
+    draw_screen();
+}
 
-    // Find next selectable item
-    while (new_index >= 0 && new_index < items_count)
-    {
-        if (current_page.items[new_index].is_selectable())
-        {
-            selected_index = new_index;
+static void show_toc_menu()
+{
+    static std::vector<imenu> toc_items;
+    static std::vector<std::string> group_titles;
 
-            // Adjust scroll if needed
-            if (selected_index < scroll_offset)
-            {
-                scroll_offset = selected_index;
-            }
-            else if (selected_index >= scroll_offset + visible_lines)
-            {
-                scroll_offset = selected_index - visible_lines + 1;
-            }
+    const std::vector<TocEntry> &toc = current_page.toc;
+    int count = toc.size();
+    int groups = (count + kTocMenuPageSize - 1) / kTocMenuPageSize;
 
-            draw_screen();
-            return;
+    // Layout: one terminated block of leaves per group, followed by the
+    // terminated top-level list of group submenus (only if there are several)
+    int top = count + groups;
+    toc_items.assign(top + (groups > 1 ? groups + 1 : 0), imenu());
+    group_titles.clear();
+
+    for (int g = 0; g < groups; g++)
+    {
+        int first = g * kTocMenuPageSize;
+        int last = first + kTocMenuPageSize;
+        if (last > count)
+            last = count;
+
+        int block = first + g;
+        for (int i = first; i < last; i++)
+        {
+            set_menu_item(toc_items[block + i - first], ITEM_ACTIVE, i, toc[i].title.c_str(), NULL);
         }
-        new_index += direction;
+        set_menu_item(toc_items[block + last - first], 0, 0, NULL, NULL);
+
+        char title[64];
+        snprintf(title, sizeof(title), "%d. %s", first + 1, toc[first].title.c_str());
+        group_titles.push_back(title);
     }
 
-    // If no selectable item found in direction, try wrapping
-    if (direction > 0)
+    imenu *menu = &toc_items[0];
+    if (groups > 1)
     {
-        // Try from start
-        for (int i = 0; i < selected_index; i++)
+        // Too many headings for one screen: one submenu per group
+        for (int g = 0; g < groups; g++)
         {
-            if (current_page.items[i].is_selectable())
-            {
-                selected_index = i;
-                scroll_offset = 0;
-                draw_screen();
-                return;
-            }
+            set_menu_item(toc_items[top + g], ITEM_SUBMENU, 0, group_titles[g].c_str(),
+                          &toc_items[g * (kTocMenuPageSize + 1)]);
         }
+        set_menu_item(toc_items[top + groups], 0, 0, NULL, NULL);
+        menu = &toc_items[top];
     }
+
+    OpenMenu(menu, 0, 50, 100, (iv_menuhandler)toc_menu_handler);
+}
+
+// View menu indices: filters by type, then sort orders
+static const int kViewMenuAll = 0;
+static const int kViewMenuType = 1; // + type byte as unsigned, 1-256
+static const int kViewMenuSort = 1000; // + ViewSort
+
+static void view_menu_handler(int index)
+{
+    GopherPage &page = current_page;
+    if (index < 0)
+        return;
+
+    if (index >= kViewMenuSort)
+        set_view(page.view_type, index - kViewMenuSort);
+    else if (index == kViewMenuAll)
+        set_view(0, page.view_sort);
     else
+        set_view((char)(unsigned char)(index - kViewMenuType), page.view_sort);
+
+    // Keep the selection if it is still shown, otherwise take the first
+    scroll_offset = 0;
+    scroll_row = 0;
+    if (view_position(selected_index) < 0)
     {
-        // Try from end
-        for (int i = items_count - 1; i > selected_index; i--)
+        selected_index = -1;
+        for (int pos = 0; pos < view_count(); pos++)
         {
-            if (current_page.items[i].is_selectable())
+            if (page.items[view_item(pos)].is_selectable())
             {
-                selected_index = i;
-                scroll_offset = selected_index - visible_lines + 1;
-                if (scroll_offset < 0)
-                    scroll_offset = 0;
-                draw_screen();
-                return;
+                selected_index = view_item(pos);
+                break;
             }
         }
     }
+    ensure_visible(selected_index);
+    draw_screen();
 }
 
-static void scroll_page(int direction)
+static void show_view_menu()
 {
-    int items_count = current_page.items.size();
-    int max_scroll = items_count - visible_lines;
-    if (max_scroll < 0)
-        max_scroll = 0;
+    static imenu view_items[64];
+    static std::vector<std::string> labels;
 
-    scroll_offset += direction * visible_lines;
+    GopherPage &page = current_page;
+    labels.clear();
+    labels.reserve(page.type_index.size());
 
-    if (scroll_offset < 0)
-        scroll_offset = 0;
-    if (scroll_offset > max_scroll)
-        scroll_offset = max_scroll;
+    int n = 0;
+    set_menu_item(view_items[n++], ITEM_HEADER, 0, "Show", NULL);
+    set_menu_item(view_items[n++], page.view_type == 0 ? ITEM_INACTIVE : ITEM_ACTIVE,
+                  kViewMenuAll, "All items", NULL);
 
-    draw_screen();
+    for (std::map<char, std::vector<int> >::iterator it = page.type_index.begin();
+         it != page.type_index.end() && n < 56; ++it)
+    {
+        if (it->first == GOPHER_INFO)
+            continue;
+
+        char label[64];
+        snprintf(label, sizeof(label), "%s %s (%d)", get_type_prefix(it->first),
+                 get_type_name(it->first), (int)it->second.size());
+        labels.push_back(label);
+        set_menu_item(view_items[n++], page.view_type == it->first ? ITEM_INACTIVE : ITEM_ACTIVE,
+                      kViewMenuType + (unsigned char)it->first, labels.back().c_str(), NULL);
+    }
+
+    set_menu_item(view_items[n++], ITEM_HEADER, 0, "Sort", NULL);
+    set_menu_item(view_items[n++], page.view_sort == SORT_NONE ? ITEM_INACTIVE : ITEM_ACTIVE,
+                  kViewMenuSort + SORT_NONE, "Page order", NULL);
+    set_menu_item(view_items[n++], page.view_sort == SORT_DISPLAY ? ITEM_INACTIVE : ITEM_ACTIVE,
+                  kViewMenuSort + SORT_DISPLAY, "By name", NULL);
+    set_menu_item(view_items[n++], page.view_sort == SORT_HOST ? ITEM_INACTIVE : ITEM_ACTIVE,
+                  kViewMenuSort + SORT_HOST, "By host", NULL);
+    set_menu_item(view_items[n], 0, 0, NULL, NULL);
+
+    OpenMenu(view_items, 0, 50, 100, (iv_menuhandler)view_menu_handler);
 }
 
+// Menu indices for actions (bookmarks use 0..3)
+static const int kMenuContents = 100;
+static const int kMenuZoomIn = 101;
+static const int kMenuZoomOut = 102;
+static const int kMenuRotate = 103;
+static const int kMenuMultiSearch = 104;
+static const int kMenuView = 105;
+static const int kMenuStats = 106;
+static const int kMenuBenchmark = 107;
+static const int kMenuReloadSettings = 108;
+static const int kMenuPreformatted = 109;
+static const int kMenuPeek = 110;
+static const int kMenuThumbnails = 111;
+static const int kMenuMirror = 112;
+static const int kMenuExport = 113;
+
 static void bookmark_menu_handler(int index)
 {
     switch (index)
@@ -865,44 +8592,259 @@ static void bookmark_menu_handler(int index)
     case 3:
         navigate_to("gopher.floodgap.com", "/v2/vs", 70);
         break;
+    case kMenuContents:
+        show_toc_menu();
+        return;
+    case kMenuMultiSearch:
+        initiate_multi_search();
+        return;
+    case kMenuView:
+        show_view_menu();
+        return;
+    case kMenuStats:
+        navigate_to(kAboutHost, "stats", 0);
+        break;
+    case kMenuBenchmark:
+        run_benchmark();
+        break;
+    case kMenuReloadSettings:
+        apply_settings();
+        if (load_into_current(kAboutHost, "stats", 0, GOPHER_MENU))
+        {
+            page_loaded();
+        }
+        break;
+    case kMenuPreformatted:
+        toggle_preformatted();
+        break;
+    case kMenuPeek:
+        draw_screen();
+        show_peek(current_page.items[selected_index]);
+        return;
+    case kMenuThumbnails:
+        show_grid();
+        return;
+    case kMenuMirror:
+        mirror_current_site();
+        break;
+    case kMenuExport:
+        export_current_page();
+        break;
+    case kMenuZoomIn:
+        set_zoom(zoom_level + 1);
+        break;
+    case kMenuZoomOut:
+        set_zoom(zoom_level - 1);
+        break;
+    case kMenuRotate:
+        // Toggle between portrait and landscape
+        set_orientation((GetOrientation() == 0 || GetOrientation() == 3) ? 1 : 0);
+        break;
     }
     draw_screen();
 }
 
 static void show_bookmarks_menu()
 {
-    static imenu bookmark_items[5];
+    static imenu bookmark_items[18];
+    int n = 0;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = 0;
+    bookmark_items[n].text = (char *)"Floodgap Gopher";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = 1;
+    bookmark_items[n].text = (char *)"SDF Public Access";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = 2;
+    bookmark_items[n].text = (char *)"Gopherpedia";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = 3;
+    bookmark_items[n].text = (char *)"Veronica-2 Search";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = kMenuMultiSearch;
+    bookmark_items[n].text = (char *)"Search all engines";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    // Quick look at the start of the selected text item
+    if (current_page.is_menu && selected_index >= 0 && current_page.items[selected_index].type == GOPHER_TEXT)
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuPeek;
+        bookmark_items[n].text = (char *)"Peek";
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
+
+    // Image menus can be browsed as thumbnails
+    if (current_page.is_menu &&
+        (current_page.type_index.count(GOPHER_IMAGE) || current_page.type_index.count(GOPHER_GIF)))
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuThumbnails;
+        bookmark_items[n].text = (char *)"Thumbnails";
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
+
+    // Save or refresh an offline copy of the site below this menu
+    if (current_page.is_menu && current_page.port > 0 && !is_search_selector(current_page.host.c_str(), current_page.selector.c_str()))
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuMirror;
+        bookmark_items[n].text = (char *)(mirror_exists(current_page.host, current_page.port) ?
+                                          "Update offline mirror" : "Save site offline");
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
+
+    // Long reads go to the device's own reader
+    if (current_page.is_menu ? current_page.type_index.count(GOPHER_TEXT) > 0 : current_page.type == GOPHER_TEXT)
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuExport;
+        bookmark_items[n].text = (char *)"Export to EPUB";
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
 
-    bookmark_items[0].type = ITEM_ACTIVE;
-    bookmark_items[0].index = 0;
-    bookmark_items[0].text = (char *)"Floodgap Gopher";
-    bookmark_items[0].submenu = NULL;
+    // Filter and sort views of the current menu
+    if (current_page.is_menu && !current_page.items.empty())
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuView;
+        bookmark_items[n].text = (char *)"Filter / sort...";
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
 
-    bookmark_items[1].type = ITEM_ACTIVE;
-    bookmark_items[1].index = 1;
-    bookmark_items[1].text = (char *)"SDF Public Access";
-    bookmark_items[1].submenu = NULL;
+    // Table of contents of the current text document
+    if (!current_page.is_menu && !current_page.toc.empty())
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuContents;
+        bookmark_items[n].text = (char *)"Table of contents";
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
 
-    bookmark_items[2].type = ITEM_ACTIVE;
-    bookmark_items[2].index = 2;
-    bookmark_items[2].text = (char *)"Gopherpedia";
-    bookmark_items[2].submenu = NULL;
+    // Wide ASCII art and tables read better unwrapped
+    if (!current_page.is_menu)
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuPreformatted;
+        bookmark_items[n].text = (char *)(current_page.preformatted ? "Wrap lines" : "Preformatted (no wrap)");
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
 
-    bookmark_items[3].type = ITEM_ACTIVE;
-    bookmark_items[3].index = 3;
-    bookmark_items[3].text = (char *)"Veronica-2 Search";
-    bookmark_items[3].submenu = NULL;
+    bookmark_items[n].type = (zoom_level + 1 < kZoomLevels) ? ITEM_ACTIVE : ITEM_INACTIVE;
+    bookmark_items[n].index = kMenuZoomIn;
+    bookmark_items[n].text = (char *)"Larger font";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = (zoom_level > 0) ? ITEM_ACTIVE : ITEM_INACTIVE;
+    bookmark_items[n].index = kMenuZoomOut;
+    bookmark_items[n].text = (char *)"Smaller font";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = kMenuRotate;
+    bookmark_items[n].text = (char *)"Rotate screen";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    bookmark_items[n].type = ITEM_ACTIVE;
+    bookmark_items[n].index = kMenuStats;
+    bookmark_items[n].text = (char *)"Statistics";
+    bookmark_items[n].submenu = NULL;
+    n++;
+
+    // Hidden actions: only offered while looking at the stats page
+    if (current_page.host == kAboutHost && current_page.selector == "stats")
+    {
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuBenchmark;
+        bookmark_items[n].text = (char *)"Run self-benchmark";
+        bookmark_items[n].submenu = NULL;
+        n++;
+
+        bookmark_items[n].type = ITEM_ACTIVE;
+        bookmark_items[n].index = kMenuReloadSettings;
+        bookmark_items[n].text = (char *)"Reload settings";
+        bookmark_items[n].submenu = NULL;
+        n++;
+    }
 
-    bookmark_items[4].type = 0;
-    bookmark_items[4].index = 0;
-    bookmark_items[4].text = NULL;
-    bookmark_items[4].submenu = NULL;
+    bookmark_items[n].type = 0;
+    bookmark_items[n].index = 0;
+    bookmark_items[n].text = NULL;
+    bookmark_items[n].submenu = NULL;
 
     OpenMenu(bookmark_items, 0, 50, 100, (iv_menuhandler)bookmark_menu_handler);
 }
 
 static void handle_key(int key)
 {
+    // Any key closes the image viewer
+    if (viewed_image != NULL)
+    {
+        close_image();
+        draw_screen();
+        return;
+    }
+
+    // Next opens the peeked item, any other key closes the popup
+    if (!peek_lines.empty())
+    {
+        close_peek();
+        if (key == KEY_RIGHT || key == KEY_NEXT)
+        {
+            navigate_to(peeked_item.host.c_str(), peeked_item.selector.c_str(), peeked_item.port, peeked_item.type);
+        }
+        draw_screen();
+        return;
+    }
+
+    // The thumbnail grid pages with next/previous; leaving it returns to
+    // the list
+    if (grid.active)
+    {
+        if (key == KEY_RIGHT || key == KEY_NEXT)
+        {
+            turn_grid_page(1);
+        }
+        else if (key == KEY_LEFT || key == KEY_PREV)
+        {
+            if (!turn_grid_page(-1))
+            {
+                close_grid();
+                draw_screen();
+            }
+        }
+        else if (key == KEY_MENU || key == KEY_BACK)
+        {
+            close_grid();
+            draw_screen();
+        }
+        return;
+    }
+
     switch (key)
     {
     case KEY_LEFT:
@@ -928,6 +8870,16 @@ static void handle_key(int key)
         show_bookmarks_menu();
         break;
 
+    case KEY_PLUS:
+        set_zoom(zoom_level + 1);
+        draw_screen();
+        break;
+
+    case KEY_MINUS:
+        set_zoom(zoom_level - 1);
+        draw_screen();
+        break;
+
     case KEY_BACK:
         CloseApp();
         break;
@@ -949,9 +8901,19 @@ static int main_handler(int event_type, int param_one, int param_two)
     {
     case EVT_INIT:
         // Initialize font
-        // mono_font = OpenFont("LiberationMono", kFontSize, 0);
-        mono_font = OpenFont("DroidSansMono", kFontSize, 1);
-        SetFont(mono_font, BLACK);
+        // mono_font = OpenFont("LiberationMono", font_size, 0);
+        load_settings();
+        apply_zoom(kDefaultZoom);
+        persist_start();
+        layout_worker_start();
+        load_history();
+
+        register_memory_consumer("peek prefixes", 5, prefix_cache_memory_usage, shrink_prefix_cache);
+        register_memory_consumer("page text", 10, page_text_memory_usage, shrink_page_text);
+        register_memory_consumer("search cache", 15, search_cache_memory_usage, shrink_search_cache);
+        register_memory_consumer("layouts", 20, layouts_memory_usage, shrink_layouts);
+        register_memory_consumer("fonts", 30, fonts_memory_usage, shrink_fonts);
+        memory_governor_start();
 
         ClearScreen();
         FullUpdate();
@@ -961,12 +8923,20 @@ static int main_handler(int event_type, int param_one, int param_two)
         // Load initial page only on first show
         if (!initial_load_done)
         {
-            navigate_to(kDefaultHost, kDefaultSelector, kDefaultGopherPort);
+            if (!restore_session())
+                navigate_to(kDefaultHost, kDefaultSelector, kDefaultGopherPort);
             initial_load_done = true;
         }
         draw_screen();
         break;
 
+    case EVT_ORIENTATION:
+        // G-sensor rotation: accept the new orientation and relayout
+        set_orientation(param_one);
+        draw_screen();
+        result = 1;
+        break;
+
     case EVT_KEYPRESS:
         handle_key(param_one);
         result = 1;
@@ -974,16 +8944,34 @@ static int main_handler(int event_type, int param_one, int param_two)
 
     case EVT_POINTERDOWN:
         // Record touch start position for swipe detection
+        touch_start_x = param_one;
         touch_start_y = param_two;
         touch_is_drag = false;
+        touch_is_long = false;
+        result = 1;
+        break;
+
+    case EVT_POINTERLONG:
+        // Long press on a text item in a menu peeks at its start
+        if (!touch_is_drag && viewed_image == NULL && peek_lines.empty() && !grid.active && current_page.is_menu &&
+            param_two >= content_area_top && param_two < content_area_bottom)
+        {
+            int line_index = item_at_screen_row((param_two - content_area_top) / line_height);
+            if (line_index >= 0 && current_page.items[line_index].type == GOPHER_TEXT)
+            {
+                touch_is_long = true;
+                show_peek(current_page.items[line_index]);
+            }
+        }
         result = 1;
         break;
 
     case EVT_POINTERMOVE:
         // Detect drag/swipe
         {
+            int delta_x = param_one - touch_start_x;
             int delta_y = param_two - touch_start_y;
-            if (delta_y > 20 || delta_y < -20)
+            if (delta_y > 20 || delta_y < -20 || delta_x > 20 || delta_x < -20)
             {
                 touch_is_drag = true;
             }
@@ -995,26 +8983,59 @@ static int main_handler(int event_type, int param_one, int param_two)
     {
         int touch_x = param_one;
         int touch_y = param_two;
+        int delta_x = touch_x - touch_start_x;
         int delta_y = touch_y - touch_start_y;
 
+        // The long press already did its work
+        if (touch_is_long)
+        {
+            result = 1;
+            break;
+        }
+
+        // A tap or swipe closes the image viewer or the peek popup
+        if (viewed_image != NULL)
+        {
+            close_image();
+            draw_screen();
+        }
+        else if (!peek_lines.empty())
+        {
+            close_peek();
+            draw_screen();
+        }
+        // Sideways swipes page the grid, a tap opens an image
+        else if (grid.active)
+        {
+            if (touch_is_drag && abs(delta_x) > abs(delta_y))
+            {
+                turn_grid_page(delta_x < 0 ? 1 : -1);
+            }
+            else if (!touch_is_drag && touch_y < header_height)
+            {
+                close_grid();
+                draw_screen();
+            }
+            else if (!touch_is_drag)
+            {
+                int tile = grid_tile_at(touch_x, touch_y);
+                if (tile >= 0)
+                    open_grid_tile(tile);
+            }
+        }
         // Check if this was a swipe gesture
-        if (touch_is_drag)
+        // Mostly sideways swipes pan preformatted text, following the finger
+        else if (touch_is_drag && current_page.preformatted && abs(delta_x) > abs(delta_y))
+        {
+            pan_by(-delta_x / char_width);
+        }
+        else if (touch_is_drag)
         {
             // Swipe up = scroll down, swipe down = scroll up
-            int swipe_lines = -delta_y / kLineHeight;
+            int swipe_lines = -delta_y / line_height;
             if (swipe_lines != 0)
             {
-                int items_count = current_page.items.size();
-                int max_scroll = items_count - visible_lines;
-                if (max_scroll < 0)
-                    max_scroll = 0;
-
-                scroll_offset += swipe_lines;
-                if (scroll_offset < 0)
-                    scroll_offset = 0;
-                if (scroll_offset > max_scroll)
-                    scroll_offset = max_scroll;
-
+                scroll_by_rows(swipe_lines);
                 draw_screen();
             }
         }
@@ -1031,8 +9052,8 @@ static int main_handler(int event_type, int param_one, int param_two)
             // Check if tap is in content area
             else if (touch_y >= content_area_top && touch_y < content_area_bottom)
             {
-                int line_index = scroll_offset + (touch_y - content_area_top) / kLineHeight;
-                if (line_index >= 0 && line_index < (int)current_page.items.size())
+                int line_index = item_at_screen_row((touch_y - content_area_top) / line_height);
+                if (line_index >= 0)
                 {
                     const GopherItem &item = current_page.items[line_index];
 
@@ -1040,7 +9061,7 @@ static int main_handler(int event_type, int param_one, int param_two)
                     {
                         // Check for double-tap on same item
                         if (line_index == last_tap_index &&
-                            (current_time - last_tap_time) < kDoubleTapTime)
+                            (current_time - last_tap_time) < settings.double_tap_time)
                         {
                             // Double-tap: follow link
                             selected_index = line_index;
@@ -1068,10 +9089,51 @@ static int main_handler(int event_type, int param_one, int param_two)
         result = 1;
         break;
 
+    case EVT_BACKGROUND:
+        // Another app is in front: give back what we can rebuild, and get
+        // queued writes onto the card in case we don't come back
+        save_session();
+        memory_governor_stop();
+        shed_memory(MEMORY_SOFT, false);
+        persist_flush();
+        result = 1;
+        break;
+
+#ifdef EVT_SAVESTATE
+    case EVT_SAVESTATE:
+        // Sent before the device powers off
+        save_session();
+        persist_flush();
+        result = 1;
+        break;
+#endif
+
+#ifdef EVT_USBSTORE_IN
+    case EVT_USBSTORE_IN:
+        // The card is about to be shared with a computer
+        persist_flush();
+        result = 1;
+        break;
+#endif
+
+    case EVT_FOREGROUND:
+        // Pick up settings edited while we were in the background
+        if (settings_changed())
+            load_settings();
+        memory_governor_start();
+        memory_governor_check();
+        result = 1;
+        break;
+
     case EVT_EXIT:
         // Cleanup
-        if (mono_font)
-            CloseFont(mono_font);
+        save_session();
+        layout_worker_stop();
+        memory_governor_stop();
+        radio_shutdown();
+        persist_stop();
+        close_image();
+        close_fonts();
 
         history.clear();
         current_page.items.clear();
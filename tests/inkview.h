@@ -0,0 +1,139 @@
+// Host stand-in for the PocketBook SDK's inkview.h: just the declarations
+// gopher_browser.cpp uses, so its logic can be built and tested on a PC.
+// Drawing and timers do nothing (see inkview_stub.cpp); the network calls
+// report no connection.
+
+#ifndef INKVIEW_STUB_H
+#define INKVIEW_STUB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define BLACK 0x000000
+#define DGRAY 0x555555
+#define LGRAY 0xaaaaaa
+#define WHITE 0xffffff
+
+#define ALIGN_LEFT 1
+#define ALIGN_CENTER 2
+#define ALIGN_RIGHT 4
+
+enum
+{
+    EVT_INIT = 21,
+    EVT_EXIT = 22,
+    EVT_SHOW = 23,
+    EVT_HIDE = 24,
+    EVT_KEYPRESS = 25,
+    EVT_KEYRELEASE = 26,
+    EVT_KEYREPEAT = 28,
+    EVT_POINTERUP = 29,
+    EVT_POINTERDOWN = 30,
+    EVT_POINTERMOVE = 31,
+    EVT_ORIENTATION = 32,
+    EVT_POINTERLONG = 34,
+    EVT_FOREGROUND = 151,
+    EVT_BACKGROUND = 152,
+    EVT_SAVESTATE = 155,
+    EVT_USBSTORE_IN = 160
+};
+
+enum
+{
+    KEY_BACK = 0x1b,
+    KEY_OK = 0x0a,
+    KEY_UP = 0x11,
+    KEY_DOWN = 0x12,
+    KEY_LEFT = 0x13,
+    KEY_RIGHT = 0x14,
+    KEY_MINUS = 0x15,
+    KEY_PLUS = 0x16,
+    KEY_MENU = 0x17,
+    KEY_PREV = 0x18,
+    KEY_NEXT = 0x19
+};
+
+#define ICON_INFORMATION 1
+#define ICON_WARNING 3
+
+#define ITEM_HEADER 1
+#define ITEM_ACTIVE 2
+#define ITEM_INACTIVE 3
+#define ITEM_SUBMENU 5
+
+#define KBD_NORMAL 0
+
+#define NET_CONNECTED 0x100
+
+#ifndef SDCARDDIR
+#define SDCARDDIR "/tmp"
+#endif
+#ifndef FLASHDIR
+#define FLASHDIR SDCARDDIR
+#endif
+
+typedef struct ifont_s
+{
+    char *name;
+    int size;
+} ifont;
+
+typedef struct imenu_s
+{
+    short type;
+    short index;
+    char *text;
+    struct imenu_s *submenu;
+} imenu;
+
+typedef struct
+{
+    unsigned short width, height, depth, scanline;
+    unsigned char data[1];
+} ibitmap;
+
+typedef void (*iv_menuhandler)(int index);
+typedef void (*iv_keyboardhandler)(char *text);
+typedef void (*iv_timerproc)();
+typedef int (*iv_handler)(int type, int par1, int par2);
+
+ifont *OpenFont(const char *name, int size, int aa);
+void CloseFont(ifont *f);
+void SetFont(const ifont *font, int color);
+int CharWidth(unsigned short c);
+char *DrawTextRect(int x, int y, int w, int h, const char *s, int flags);
+void DrawString(int x, int y, const char *s);
+void DrawLine(int x1, int y1, int x2, int y2, int color);
+void DrawRect(int x, int y, int w, int h, int color);
+void FillArea(int x, int y, int w, int h, int color);
+void DrawBitmap(int x, int y, const ibitmap *b);
+void StretchBitmap(int x, int y, int w, int h, const ibitmap *src, int flags);
+ibitmap *LoadBitmap(const char *filename);
+ibitmap *LoadJPEG(const char *path, int width, int height, int br, int co, int proportional);
+
+void ClearScreen();
+void FullUpdate();
+void PartialUpdate(int x, int y, int w, int h);
+void PartialUpdateBW(int x, int y, int w, int h);
+int ScreenWidth();
+int ScreenHeight();
+int GetOrientation();
+void SetOrientation(int n);
+
+void Message(int icon, const char *title, const char *text, int timeout);
+void OpenMenu(imenu *menu, int pos, int x, int y, iv_menuhandler hproc);
+void OpenKeyboard(const char *title, char *buffer, int maxlen, int flags, iv_keyboardhandler hproc);
+
+void SetWeakTimer(const char *name, iv_timerproc tproc, int ms);
+void ClearTimer(iv_timerproc tproc);
+
+int QueryNetwork();
+int NetConnect(const char *name);
+int NetDisconnect();
+
+const char *GetDeviceModel();
+void CloseApp();
+void InkViewMain(iv_handler h);
+
+#endif
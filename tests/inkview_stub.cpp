@@ -0,0 +1,95 @@
+// Host stand-ins for the InkView calls declared in inkview.h
+
+#include "inkview.h"
+
+#include <string.h>
+
+static ifont stub_font;
+
+ifont *OpenFont(const char *, int size, int)
+{
+    stub_font.size = size;
+    return &stub_font;
+}
+
+void CloseFont(ifont *) {}
+void SetFont(const ifont *, int) {}
+
+int CharWidth(unsigned short)
+{
+    return 8;
+}
+
+char *DrawTextRect(int, int, int, int, const char *, int)
+{
+    return NULL;
+}
+
+void DrawString(int, int, const char *) {}
+void DrawLine(int, int, int, int, int) {}
+void DrawRect(int, int, int, int, int) {}
+void FillArea(int, int, int, int, int) {}
+void DrawBitmap(int, int, const ibitmap *) {}
+void StretchBitmap(int, int, int, int, const ibitmap *, int) {}
+
+ibitmap *LoadBitmap(const char *)
+{
+    return NULL;
+}
+
+ibitmap *LoadJPEG(const char *, int, int, int, int, int)
+{
+    return NULL;
+}
+
+void ClearScreen() {}
+void FullUpdate() {}
+void PartialUpdate(int, int, int, int) {}
+void PartialUpdateBW(int, int, int, int) {}
+
+int ScreenWidth()
+{
+    return 600;
+}
+
+int ScreenHeight()
+{
+    return 800;
+}
+
+int GetOrientation()
+{
+    return 0;
+}
+
+void SetOrientation(int) {}
+
+void Message(int, const char *, const char *, int) {}
+void OpenMenu(imenu *, int, int, int, iv_menuhandler) {}
+void OpenKeyboard(const char *, char *, int, int, iv_keyboardhandler) {}
+
+void SetWeakTimer(const char *, iv_timerproc, int) {}
+void ClearTimer(iv_timerproc) {}
+
+int QueryNetwork()
+{
+    return 0;
+}
+
+int NetConnect(const char *)
+{
+    return -1;
+}
+
+int NetDisconnect()
+{
+    return 0;
+}
+
+const char *GetDeviceModel()
+{
+    return "host";
+}
+
+void CloseApp() {}
+void InkViewMain(iv_handler) {}
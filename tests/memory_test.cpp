@@ -0,0 +1,162 @@
+// Memory governor: pressure thresholds, and shedding from fake consumers in
+// priority order. The real process is put under pressure by moving the
+// thresholds around its actual RSS rather than by allocating.
+
+#define main gopher_main
+#include "../gopher_browser.cpp"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);          \
+            failures++;                                                              \
+        }                                                                            \
+    } while (0)
+
+static const long MB = 1024 * 1024;
+
+// Fake consumers: each holds some bytes and records when it was shrunk
+static long held[3];
+static std::string shed_log; // Consumer letters in the order they were shrunk
+static int last_pressure;
+static bool relieve_after_shrink; // Shrinking brings the process under the soft threshold
+
+static void shrink(int index, int pressure)
+{
+    shed_log += (char)('a' + index);
+    last_pressure = pressure;
+    held[index] = pressure == MEMORY_HARD ? 0 : held[index] / 2;
+    if (relieve_after_shrink)
+    {
+        settings.memory_soft_rss = INT_MAX;
+        settings.memory_soft_available = 0;
+    }
+}
+
+static long usage_a() { return held[0]; }
+static long usage_b() { return held[1]; }
+static long usage_c() { return held[2]; }
+static void shrink_a(int pressure) { shrink(0, pressure); }
+static void shrink_b(int pressure) { shrink(1, pressure); }
+static void shrink_c(int pressure) { shrink(2, pressure); }
+
+static void reset(long a, long b, long c)
+{
+    held[0] = a;
+    held[1] = b;
+    held[2] = c;
+    shed_log.clear();
+    last_pressure = -1;
+    relieve_after_shrink = false;
+    memset(&memory_stats, 0, sizeof(memory_stats));
+}
+
+// Thresholds with the running process between soft and hard, or past hard
+static void simulate(int pressure)
+{
+    settings.memory_soft_available = 0;
+    settings.memory_hard_available = 0;
+    settings.memory_soft_rss = pressure == MEMORY_OK ? INT_MAX : 0;
+    settings.memory_hard_rss = pressure == MEMORY_HARD ? 0 : INT_MAX;
+}
+
+static void test_thresholds()
+{
+    settings.memory_soft_rss = 40 * MB;
+    settings.memory_hard_rss = 60 * MB;
+    settings.memory_soft_available = 16 * MB;
+    settings.memory_hard_available = 8 * MB;
+
+    CHECK(memory_pressure(10 * MB, 100 * MB) == MEMORY_OK);
+    CHECK(memory_pressure(40 * MB, 100 * MB) == MEMORY_OK);
+    CHECK(memory_pressure(40 * MB + 1, 100 * MB) == MEMORY_SOFT);
+    CHECK(memory_pressure(60 * MB, 100 * MB) == MEMORY_SOFT);
+    CHECK(memory_pressure(60 * MB + 1, 100 * MB) == MEMORY_HARD);
+
+    // Low system memory counts even for a small process
+    CHECK(memory_pressure(10 * MB, 16 * MB) == MEMORY_OK);
+    CHECK(memory_pressure(10 * MB, 16 * MB - 1) == MEMORY_SOFT);
+    CHECK(memory_pressure(10 * MB, 8 * MB - 1) == MEMORY_HARD);
+    CHECK(memory_pressure(10 * MB, 0) == MEMORY_HARD);
+
+    // Unknown availability is ignored
+    CHECK(memory_pressure(10 * MB, -1) == MEMORY_OK);
+    CHECK(memory_pressure(50 * MB, -1) == MEMORY_SOFT);
+}
+
+static void test_shedding()
+{
+    // Registered out of order; shed lowest priority first
+    register_memory_consumer("c", 30, usage_c, shrink_c);
+    register_memory_consumer("a", 10, usage_a, shrink_a);
+    register_memory_consumer("b", 20, usage_b, shrink_b);
+
+    // No pressure, nothing shed
+    reset(1000, 2000, 3000);
+    simulate(MEMORY_OK);
+    memory_governor_check();
+    CHECK(shed_log.empty());
+
+    // Hard pressure drops every consumer, in order
+    reset(1000, 2000, 3000);
+    simulate(MEMORY_HARD);
+    memory_governor_check();
+    CHECK(shed_log == "abc");
+    CHECK(last_pressure == MEMORY_HARD);
+    CHECK(held[0] == 0 && held[1] == 0 && held[2] == 0);
+    CHECK(memory_stats.hard_sheds == 1 && memory_stats.soft_sheds == 0);
+    CHECK(memory_stats.bytes_shed == 6000);
+
+    // Empty consumers are skipped
+    reset(0, 2000, 0);
+    simulate(MEMORY_HARD);
+    memory_governor_check();
+    CHECK(shed_log == "b");
+
+    // Soft pressure stops once the process is back under the threshold
+    reset(1000, 2000, 3000);
+    simulate(MEMORY_SOFT);
+    relieve_after_shrink = true;
+    memory_governor_check();
+    CHECK(shed_log == "a");
+    CHECK(last_pressure == MEMORY_SOFT);
+    CHECK(held[0] == 500 && held[1] == 2000 && held[2] == 3000);
+    CHECK(memory_stats.soft_sheds == 1 && memory_stats.bytes_shed == 500);
+
+    // Soft pressure that persists goes through every consumer
+    reset(1000, 2000, 3000);
+    simulate(MEMORY_SOFT);
+    memory_governor_check();
+    CHECK(shed_log == "abc");
+    CHECK(memory_stats.bytes_shed == 3000);
+
+    // Going to background sheds from everyone even when relieved early
+    reset(1000, 2000, 3000);
+    simulate(MEMORY_SOFT);
+    relieve_after_shrink = true;
+    shed_memory(MEMORY_SOFT, false);
+    CHECK(shed_log == "abc");
+}
+
+int main()
+{
+    load_settings();
+
+    printf("thresholds\n");
+    test_thresholds();
+    printf("shedding\n");
+    test_shedding();
+
+    if (failures > 0)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,244 @@
+// Page snapshots: round trips of menu and text pages, and damaged or
+// crafted snapshots, which snapshot_open() must reject without reading out
+// of bounds (build with -fsanitize=address, as the Makefile does).
+
+#define main gopher_main
+#include "../gopher_browser.cpp"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);          \
+            failures++;                                                              \
+        }                                                                            \
+    } while (0)
+
+static std::string make_menu(int count)
+{
+    static const char types[] = {GOPHER_MENU, GOPHER_TEXT, GOPHER_INFO, GOPHER_SEARCH, 'I', '9'};
+    std::string body;
+    char line[256];
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(line, sizeof(line), "%cItem %d\t/sel/%d\thost%d.example\t%d\r\n", types[i % 6], (i * 7919) % count,
+                 i, i % 3, 70 + i % 2);
+        body += line;
+    }
+    return body + ".\r\n";
+}
+
+static std::string make_text(int lines)
+{
+    std::string body = "INTRODUCTION\r\n";
+    char line[256];
+    for (int i = 0; i < lines; i++)
+    {
+        if (i % 50 == 0)
+            snprintf(line, sizeof(line), "%d. Chapter %d\r\n", i / 50 + 1, i / 50 + 1);
+        else if (i % 17 == 0)
+            snprintf(line, sizeof(line), "See gopher://host.example:7070/0/doc/%d for more.\r\n", i);
+        else
+            snprintf(line, sizeof(line), "Line %d of a paragraph long enough to wrap on a narrow screen, "
+                                         "\xe2\x94\x80\xe2\x94\x80 with some box drawing.\r\n", i);
+        body += line;
+    }
+    return body;
+}
+
+static void load_text(const std::string &body)
+{
+    TextSink sink(current_page);
+    sink.write(body.data(), body.length());
+    sink.finish();
+}
+
+static bool same_page(const GopherPage &a, const GopherPage &b)
+{
+    if (a.host != b.host || a.selector != b.selector || a.port != b.port || a.type != b.type ||
+        a.is_menu != b.is_menu || a.preformatted != b.preformatted || a.pan_column != b.pan_column)
+        return false;
+    if (a.items.size() != b.items.size() || a.toc.size() != b.toc.size() || a.links.size() != b.links.size() ||
+        a.layouts.size() != b.layouts.size())
+        return false;
+    for (size_t i = 0; i < a.items.size(); i++)
+    {
+        const GopherItem &x = a.items[i];
+        const GopherItem &y = b.items[i];
+        if (x.type != y.type || x.display != y.display || x.selector != y.selector || x.host != y.host ||
+            x.port != y.port)
+            return false;
+    }
+    for (size_t i = 0; i < a.toc.size(); i++)
+    {
+        if (a.toc[i].line != b.toc[i].line || a.toc[i].title != b.toc[i].title)
+            return false;
+    }
+    for (size_t i = 0; i < a.links.size(); i++)
+    {
+        if (a.links[i].item != b.links[i].item || a.links[i].start != b.links[i].start ||
+            a.links[i].length != b.links[i].length)
+            return false;
+    }
+    for (size_t i = 0; i < a.layouts.size(); i++)
+    {
+        const PageLayout &x = a.layouts[i];
+        const PageLayout &y = b.layouts[i];
+        if (x.font_size != y.font_size || x.columns != y.columns || x.rows != y.rows || x.first_row != y.first_row ||
+            x.next_item != y.next_item || x.known_items != y.known_items || x.known_rows != y.known_rows)
+            return false;
+    }
+    return a.type_index == b.type_index && a.by_display == b.by_display && a.by_host == b.by_host &&
+           a.view_active == b.view_active && a.view_type == b.view_type && a.view_sort == b.view_sort &&
+           a.view == b.view && a.view_pos == b.view_pos;
+}
+
+// Opens a snapshot from a 4-byte aligned copy, as a mapping would be
+static bool open_copy(const std::string &data, std::vector<unsigned int> &buffer, PageSnapshot &snap)
+{
+    buffer.assign(data.length() / 4 + 1, 0);
+    if (!data.empty())
+        memcpy(&buffer[0], data.data(), data.length());
+    return snapshot_open((const unsigned char *)&buffer[0], data.length(), snap);
+}
+
+static void test_round_trip(const char *name)
+{
+    std::string data = snapshot_page(current_page, 3, 1, 5);
+    std::vector<unsigned int> buffer;
+    PageSnapshot snap;
+    bool opened = open_copy(data, buffer, snap);
+    CHECK(opened);
+    if (!opened)
+        return;
+
+    GopherPage restored;
+    snapshot_restore(snap, restored);
+    if (!same_page(current_page, restored))
+    {
+        printf("%s: restored page differs\n", name);
+        failures++;
+    }
+    CHECK(restored.raw_text.empty());
+    CHECK(snap.header->scroll_offset == 3 && snap.header->scroll_row == 1 && snap.header->selected_index == 5);
+
+    // A snapshot of the restored page is byte for byte the same
+    CHECK(snapshot_page(restored, 3, 1, 5) == data);
+}
+
+// Rewrites the size and checksum so a mutation reaches the deeper checks
+static void reseal(std::string &data)
+{
+    if (data.length() < sizeof(SnapshotHeader))
+        return;
+    SnapshotHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    header.size = data.length();
+    header.checksum = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data.data() + sizeof(header),
+                            data.length() - sizeof(header));
+    memcpy(&data[0], &header, sizeof(header));
+}
+
+static void test_damaged(const std::string &data)
+{
+    std::vector<unsigned int> buffer;
+    PageSnapshot snap;
+
+    // Truncated anywhere
+    for (size_t length = 0; length < data.length(); length += 1 + length / 8)
+        CHECK(!open_copy(data.substr(0, length), buffer, snap));
+
+    // Unaligned
+    std::string shifted = std::string(1, '\0') + data;
+    std::vector<unsigned int> raw(shifted.length() / 4 + 1);
+    memcpy(&raw[0], shifted.data(), shifted.length());
+    CHECK(!snapshot_open((const unsigned char *)&raw[0] + 1, data.length(), snap));
+
+    // Wrong version, even with a valid checksum
+    std::string old = data;
+    SnapshotHeader header;
+    memcpy(&header, old.data(), sizeof(header));
+    header.version = kSnapshotVersion - 1;
+    memcpy(&old[0], &header, sizeof(header));
+    CHECK(!open_copy(old, buffer, snap));
+
+    // Bit flips are caught by the checksum
+    srand(1);
+    for (int i = 0; i < 2000; i++)
+    {
+        std::string flipped = data;
+        flipped[sizeof(SnapshotHeader) + rand() % (data.length() - sizeof(SnapshotHeader))] ^= 1 << (rand() % 8);
+        CHECK(!open_copy(flipped, buffer, snap));
+    }
+
+    // Resealed mutations get past the checksum; whatever opens must restore
+    // without touching memory outside the snapshot
+    int accepted = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        std::string mutated = data;
+        int flips = 1 + rand() % 4;
+        for (int j = 0; j < flips; j++)
+            mutated[rand() % mutated.length()] ^= 1 << (rand() % 8);
+        if (rand() % 5 == 0)
+            mutated.resize(rand() % mutated.length());
+        reseal(mutated);
+        if (open_copy(mutated, buffer, snap))
+        {
+            GopherPage page;
+            snapshot_restore(snap, page);
+            accepted++;
+        }
+    }
+    printf("  %d of 20000 resealed mutations accepted and restored\n", accepted);
+}
+
+int main()
+{
+    load_settings();
+    apply_zoom(kDefaultZoom);
+
+    parse_gopher_menu(make_menu(2000), current_page);
+    current_page.host = "menu.example";
+    current_page.selector = "/";
+    current_page.port = 70;
+    current_page.type = GOPHER_MENU;
+    set_view(GOPHER_TEXT, SORT_DISPLAY);
+    printf("menu\n");
+    test_round_trip("menu");
+    std::string menu = snapshot_page(current_page, 0, 0, -1);
+    test_damaged(menu);
+
+    load_text(make_text(1000));
+    current_page.host = "text.example";
+    current_page.selector = "/doc";
+    current_page.port = 7070;
+    current_page.type = GOPHER_TEXT;
+    CHECK(!current_page.toc.empty() && !current_page.links.empty());
+    while (!layout_complete(current_layout()))
+        layout_idle_step();
+    current_page.preformatted = true;
+    current_page.pan_column = 7;
+    printf("text\n");
+    test_round_trip("text");
+    std::string text = snapshot_page(current_page, 0, 0, -1);
+    CHECK(text.length() < current_page.raw_text.length() * 2);
+    test_damaged(text);
+
+    // An empty page
+    clear_page(current_page, true);
+    printf("empty\n");
+    test_round_trip("empty");
+
+    if (failures > 0)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}